@@ -0,0 +1,616 @@
+/**
+ * File:    loadgen.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   Load generator for ftserver.
+ *
+ *          Each of N client threads opens a data listener and a control
+ *          connection, negotiates protocol 2, and issues a mix of "list"
+ *          and "get" commands back to back, timing each from sending the
+ *          command to the last byte of its response. Files are picked
+ *          from a size distribution (eg. "1K:60,64K:30,1M:10"); the
+ *          fixture directory is filled with matching files first.
+ *
+ *          By default each client holds a session, so one data
+ *          connection carries all of its responses; --no-session makes
+ *          the server connect for every response instead. With --spawn,
+ *          the server is started in the fixture directory and stopped at
+ *          the end.
+ *
+ *          --sequence makes the gets a batch job's: every client walks
+ *          the fixture files in the same order, each from its own place
+ *          in it, pausing --think-us between gets as if processing each
+ *          file. --cold drops the fixture files from the page cache
+ *          before each of --passes passes, so the later passes time cold
+ *          reads against a server that has seen the order before.
+ */
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "../protocol.hpp"
+using namespace std;
+
+#define FILES_PER_SIZE 8        // Fixture files of each size
+#define READ_BUF_LEN (1 << 16)  // Bytes read per recv()
+#define SPAWN_WAIT_MS 5000      // Time a spawned server has to listen
+
+#define USAGE "Usage: loadgen [options]\n" \
+    "  --host H          server host (default 127.0.0.1)\n" \
+    "  --port P          server control port (default 30500)\n" \
+    "  --clients N       concurrent control/data pairs (default 16)\n" \
+    "  --requests N      commands per client (default 1000)\n" \
+    "  --list-pct N      percent of commands that are \"list\" (default 5)\n" \
+    "  --sizes SPEC      file sizes and weights (default 1K:60,64K:30,1M:10)\n" \
+    "  --fixture DIR     directory holding the files (default bench/data)\n" \
+    "  --no-session      one data connection per response\n" \
+    "  --spawn PATH      start the server at PATH in the fixture directory\n" \
+    "  --backend B       I/O backend of the spawned server (default epoll)\n" \
+    "  --sequence        get the files in a fixed order, not at random\n" \
+    "  --cold            drop the files from the page cache before a pass\n" \
+    "  --passes N        runs of --requests commands per client (default 1)\n" \
+    "  --think-us N      pause between a response and the next command\n"
+
+// One file size class
+struct SizeClass {
+    size_t bytes;
+    int weight;
+};
+
+// Settings from the commandline
+struct LoadOptions {
+    string host;
+    int port;
+    int clients;
+    int requests;
+    int listPct;
+    vector<SizeClass> sizes;
+    string fixture;
+    bool session;
+    string spawn;
+    string backend;
+    bool sequence;
+    bool cold;
+    int passes;
+    int thinkUs;
+};
+
+// Results of one client thread
+struct ClientResult {
+    vector<long long> latencies;  // Microseconds, one per command
+    unsigned long long bytes;     // Response bytes received
+    int errors;                   // Failed commands
+};
+
+/**
+ * Parse a size such as "512", "64K" or "4M".
+ *
+ * @return the size in bytes, or 0 if text is not a size
+ */
+static size_t parseSize(const string &text) {
+    char *end;
+    unsigned long long n = strtoull(text.c_str(), &end, 10);
+    if (end == text.c_str())
+        return 0;
+    if (*end == 'K' || *end == 'k')
+        n <<= 10, end++;
+    else if (*end == 'M' || *end == 'm')
+        n <<= 20, end++;
+    else if (*end == 'G' || *end == 'g')
+        n <<= 30, end++;
+    return *end == '\0' ? n : 0;
+}
+
+/**
+ * Parse a size distribution such as "1K:60,64K:30,1M:10".
+ *
+ * @return false if spec is malformed
+ */
+static bool parseSizes(const string &spec, vector<SizeClass> *sizes) {
+    size_t start = 0;
+    sizes->clear();
+    while (start < spec.length()) {
+        size_t comma = spec.find(',', start);
+        if (comma == string::npos)
+            comma = spec.length();
+        string item = spec.substr(start, comma - start);
+        size_t colon = item.find(':');
+
+        SizeClass size;
+        size.bytes = parseSize(item.substr(0, colon));
+        size.weight = (colon == string::npos) ? 1 : atoi(item.c_str() + colon + 1);
+        if (size.bytes == 0 || size.weight <= 0)
+            return false;
+        sizes->push_back(size);
+        start = comma + 1;
+    }
+    return !sizes->empty();
+}
+
+/**
+ * Process the commandline into options.
+ *
+ * @return false on invalid arguments
+ */
+static bool getOptions(int argc, char **argv, LoadOptions *opts) {
+    opts->host = "127.0.0.1";
+    opts->port = 30500;
+    opts->clients = 16;
+    opts->requests = 1000;
+    opts->listPct = 5;
+    opts->fixture = "bench/data";
+    opts->session = true;
+    opts->backend = "epoll";
+    opts->sequence = false;
+    opts->cold = false;
+    opts->passes = 1;
+    opts->thinkUs = 0;
+    parseSizes("1K:60,64K:30,1M:10", &opts->sizes);
+
+    for (int i = 1; i < argc; i++) {
+        string opt(argv[i]);
+        if (opt == "--no-session") {
+            opts->session = false;
+            continue;
+        }
+        if (opt == "--sequence") {
+            opts->sequence = true;
+            continue;
+        }
+        if (opt == "--cold") {
+            opts->cold = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+            return false;
+        const char *value = argv[++i];
+
+        if (opt == "--host")
+            opts->host = value;
+        else if (opt == "--port")
+            opts->port = atoi(value);
+        else if (opt == "--clients")
+            opts->clients = atoi(value);
+        else if (opt == "--requests")
+            opts->requests = atoi(value);
+        else if (opt == "--list-pct")
+            opts->listPct = atoi(value);
+        else if (opt == "--sizes") {
+            if (!parseSizes(value, &opts->sizes))
+                return false;
+        }
+        else if (opt == "--fixture")
+            opts->fixture = value;
+        else if (opt == "--spawn")
+            opts->spawn = value;
+        else if (opt == "--backend")
+            opts->backend = value;
+        else if (opt == "--passes")
+            opts->passes = atoi(value);
+        else if (opt == "--think-us")
+            opts->thinkUs = atoi(value);
+        else
+            return false;
+    }
+    return opts->port > 0 && opts->clients > 0 && opts->requests > 0
+        && opts->listPct >= 0 && opts->listPct <= 100 && opts->passes > 0
+        && opts->thinkUs >= 0;
+}
+
+/**
+ * Return the fixture file name of size class bytes, copy i.
+ */
+static string fixtureName(size_t bytes, int i) {
+    return "s" + to_string((unsigned long long)bytes) + "_" + to_string(i)
+        + ".bin";
+}
+
+/**
+ * Create any missing fixture files.
+ *
+ * @return false if a file cannot be written
+ */
+static bool makeFixture(const LoadOptions &opts) {
+    vector<char> block(1 << 20);
+    for (size_t i = 0; i < block.size(); i++)
+        block[i] = (char)(i * 31 + 7);
+
+    mkdir(opts.fixture.c_str(), 0755);
+    for (size_t s = 0; s < opts.sizes.size(); s++) {
+        size_t bytes = opts.sizes[s].bytes;
+        for (int i = 0; i < FILES_PER_SIZE; i++) {
+            string path = opts.fixture + "/" + fixtureName(bytes, i);
+            struct stat info;
+            if (stat(path.c_str(), &info) == 0 && (size_t)info.st_size == bytes)
+                continue;
+
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1) {
+                perror(path.c_str());
+                return false;
+            }
+            for (size_t done = 0; done < bytes; ) {
+                size_t n = min(bytes - done, block.size());
+                ssize_t w = write(fd, block.data(), n);
+                if (w <= 0) {
+                    perror(path.c_str());
+                    close(fd);
+                    return false;
+                }
+                done += w;
+            }
+            close(fd);
+        }
+    }
+    return true;
+}
+
+/**
+ * Connect to host:port.
+ *
+ * @return the socket or -1
+ */
+static int connectTo(const string &host, int port) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &res) != 0)
+        return -1;
+    int s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (s != -1 && connect(s, res->ai_addr, res->ai_addrlen) == -1) {
+        close(s);
+        s = -1;
+    }
+    freeaddrinfo(res);
+    if (s != -1) {
+        int yes = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+    }
+    return s;
+}
+
+/**
+ * Open a listener on an ephemeral port.
+ *
+ * @return the socket, or -1; port receives its number
+ */
+static int openDataListener(int *port) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof addr;
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == -1)
+        return -1;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(s, (struct sockaddr *)&addr, sizeof addr) == -1
+            || listen(s, 16) == -1
+            || getsockname(s, (struct sockaddr *)&addr, &len) == -1) {
+        close(s);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return s;
+}
+
+/**
+ * Write all of msg to s.
+ */
+static bool sendAll(int s, const string &msg) {
+    size_t done = 0;
+    while (done < msg.length()) {
+        ssize_t n = send(s, msg.data() + done, msg.length() - done,
+                MSG_NOSIGNAL);
+        if (n <= 0 && errno != EINTR)
+            return false;
+        if (n > 0)
+            done += n;
+    }
+    return true;
+}
+
+/**
+ * Read exactly len bytes from s, into buf if not NULL.
+ */
+static bool recvExactly(int s, char *buf, size_t len) {
+    static thread_local vector<char> discard(READ_BUF_LEN);
+    while (len > 0) {
+        size_t want = buf ? len : min(len, discard.size());
+        ssize_t n = recv(s, buf ? buf : discard.data(), want, 0);
+        if (n == 0)
+            return false;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        len -= n;
+        if (buf)
+            buf += n;
+    }
+    return true;
+}
+
+/**
+ * Read one control reply, eg. "<proto>2</proto>", ending in closeTag.
+ */
+static bool recvReply(int s, const string &closeTag) {
+    string reply;
+    char c;
+    while (reply.length() < closeTag.length()
+            || reply.compare(reply.length() - closeTag.length(),
+                closeTag.length(), closeTag) != 0) {
+        if (recv(s, &c, 1, 0) != 1)
+            return false;
+        reply.push_back(c);
+    }
+    return true;
+}
+
+/**
+ * Read one framed response from the data connection.
+ *
+ * @param failed set if the response is an error message
+ *
+ * @return response bytes, or -1 if the connection broke
+ */
+static long long recvResponse(int data, bool *failed) {
+    char buf[FRAME_HEADER_LEN];
+    FrameHeader header;
+
+    if (!recvExactly(data, buf, FRAME_HEADER_LEN)
+            || !parseFrameHeader(buf, &header))
+        return -1;
+    if (!recvExactly(data, NULL, header.nameLength + header.contentLength))
+        return -1;
+    *failed = (header.status == FT_STATUS_ERROR);
+    return FRAME_HEADER_LEN + header.nameLength + header.contentLength;
+}
+
+/**
+ * Client thread body: run opts.requests commands and time each.
+ *
+ * @param order the files in the order --sequence gets them
+ */
+static void runClient(const LoadOptions &opts, const vector<string> &order,
+        int id, ClientResult *result) {
+    mt19937 rng(id * 7919 + 1);
+    int totalWeight = 0;
+    for (size_t i = 0; i < opts.sizes.size(); i++)
+        totalWeight += opts.sizes[i].weight;
+
+    result->bytes = 0;
+    result->errors = 0;
+    result->latencies.reserve(opts.requests);
+
+    int dataPort;
+    int listener = openDataListener(&dataPort);
+    int control = connectTo(opts.host, opts.port);
+    if (listener == -1 || control == -1) {
+        perror("loadgen connect");
+        result->errors = opts.requests;
+        return;
+    }
+
+    sendAll(control, "<" PROTO_TAG ">2</" PROTO_TAG ">");
+    bool ok = recvReply(control, "</" PROTO_TAG ">");
+    if (ok && opts.session) {
+        sendAll(control, "<session>1</session>");
+        ok = recvReply(control, "</session>");
+    }
+    if (!ok) {
+        result->errors = opts.requests;
+        close(control);
+        close(listener);
+        return;
+    }
+
+    int data = -1;
+    for (int r = 0; r < opts.requests; r++) {
+        string command;
+        if ((int)(rng() % 100) < opts.listPct) {
+            command = "<l> </l>";
+        }
+        else if (opts.sequence) {
+            size_t start = id * order.size() / opts.clients;
+            command = "<g>" + order[(start + r) % order.size()] + "</g>";
+        }
+        else {
+            int pick = rng() % totalWeight;
+            size_t s = 0;
+            while (pick >= opts.sizes[s].weight)
+                pick -= opts.sizes[s++].weight;
+            command = "<g>" + fixtureName(opts.sizes[s].bytes,
+                    rng() % FILES_PER_SIZE) + "</g>";
+        }
+        command += "<dataport>" + to_string(dataPort) + "</dataport>";
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        if (!sendAll(control, command))
+            break;
+        if (data == -1 && (data = accept(listener, NULL, NULL)) == -1)
+            break;
+        bool failed = false;
+        long long bytes = recvResponse(data, &failed);
+        long long us = chrono::duration_cast<chrono::microseconds>(
+                chrono::steady_clock::now() - start).count();
+
+        if (bytes < 0 || failed)
+            result->errors++;
+        else
+            result->latencies.push_back(us);
+        if (bytes > 0)
+            result->bytes += bytes;
+        if (!opts.session || bytes < 0) {  // A broken stream cannot resync
+            close(data);
+            data = -1;
+        }
+        if (opts.thinkUs > 0)  // As if the client processed the response
+            this_thread::sleep_for(chrono::microseconds(opts.thinkUs));
+    }
+    if (data != -1)
+        close(data);
+    close(control);
+    close(listener);
+}
+
+/**
+ * Start the server at opts.spawn in the fixture directory and wait until
+ * it accepts connections.
+ *
+ * @return the server's pid, or -1
+ */
+static pid_t spawnServer(const LoadOptions &opts) {
+    string path = opts.spawn;
+    if (path[0] != '/') {
+        char cwd[4096];
+        if (getcwd(cwd, sizeof cwd) == NULL)
+            return -1;
+        path = string(cwd) + "/" + path;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (chdir(opts.fixture.c_str()) == -1)
+            _exit(1);
+        string port = to_string(opts.port);
+        execl(path.c_str(), path.c_str(), port.c_str(), "--log-level",
+                "warn", "--io-backend", opts.backend.c_str(), (char *)NULL);
+        _exit(1);
+    }
+    for (int waited = 0; pid > 0 && waited < SPAWN_WAIT_MS; waited += 10) {
+        int s = connectTo(opts.host, opts.port);
+        if (s != -1) {
+            close(s);
+            return pid;
+        }
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    if (pid > 0)
+        kill(pid, SIGKILL);
+    return -1;
+}
+
+/**
+ * Return every fixture file, in the order --sequence gets them: a fixed
+ * shuffle, so neighbours are of any size.
+ */
+static vector<string> fixtureOrder(const LoadOptions &opts) {
+    vector<string> order;
+    for (size_t s = 0; s < opts.sizes.size(); s++) {
+        for (int i = 0; i < FILES_PER_SIZE; i++)
+            order.push_back(fixtureName(opts.sizes[s].bytes, i));
+    }
+    shuffle(order.begin(), order.end(), mt19937(1));
+    return order;
+}
+
+/**
+ * Drop the fixture files from the page cache.
+ */
+static void evictFixture(const LoadOptions &opts,
+        const vector<string> &files) {
+    for (size_t i = 0; i < files.size(); i++) {
+        string path = opts.fixture + "/" + files[i];
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1)
+            continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+/**
+ * Return the q quantile of sorted latencies.
+ */
+static long long quantile(const vector<long long> &sorted, double q) {
+    if (sorted.empty())
+        return 0;
+    size_t rank = (size_t)(q * sorted.size());
+    return sorted[min(rank, sorted.size() - 1)];
+}
+
+int main(int argc, char **argv) {
+    LoadOptions opts;
+    if (!getOptions(argc, argv, &opts)) {
+        cerr << USAGE;
+        return 1;
+    }
+    if (!makeFixture(opts))
+        return 1;
+
+    pid_t server = -1;
+    if (!opts.spawn.empty() && (server = spawnServer(opts)) == -1) {
+        cerr << "Could not start " << opts.spawn << endl;
+        return 1;
+    }
+
+    vector<string> order = fixtureOrder(opts);
+    int errors = 0;
+    for (int pass = 1; pass <= opts.passes; pass++) {
+        if (opts.cold)
+            evictFixture(opts, order);
+
+        vector<ClientResult> results(opts.clients);
+        vector<thread> clients;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int i = 0; i < opts.clients; i++)
+            clients.push_back(thread(runClient, cref(opts), cref(order), i,
+                        &results[i]));
+        for (size_t i = 0; i < clients.size(); i++)
+            clients[i].join();
+        double seconds = chrono::duration<double>(
+                chrono::steady_clock::now() - start).count();
+
+        vector<long long> all;
+        unsigned long long bytes = 0;
+        int passErrors = 0;
+        for (size_t i = 0; i < results.size(); i++) {
+            all.insert(all.end(), results[i].latencies.begin(),
+                    results[i].latencies.end());
+            bytes += results[i].bytes;
+            passErrors += results[i].errors;
+        }
+        sort(all.begin(), all.end());
+        errors += passErrors;
+
+        if (opts.passes > 1)
+            cout << "pass " << pass << (opts.cold ? " (cold)" : "") << "\n";
+        cout << "clients " << opts.clients
+            << (opts.session ? " (sessions)" : " (connect per response)")
+            << "\n"
+            << "requests " << all.size() << " ok, " << passErrors
+            << " failed in " << seconds << " s\n"
+            << "throughput " << all.size() / seconds << " req/s, "
+            << bytes / seconds / (1 << 20) << " MiB/s\n"
+            << "latency_us p50 " << quantile(all, 0.5)
+            << " p99 " << quantile(all, 0.99)
+            << " p999 " << quantile(all, 0.999)
+            << " max " << (all.empty() ? 0 : all.back()) << endl;
+    }
+
+    if (server != -1) {
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+    }
+    return errors == 0 ? 0 : 2;
+}
@@ -0,0 +1,349 @@
+/**
+ * File:    micro_bench.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   Microbenchmarks of the request path functions of ftserver,
+ *          run against the files of a fixture directory.
+ *
+ *          Directory lookups are timed both by scanning the directory,
+ *          which is what fileExists() and lsCWD() do without inotify, and
+ *          through the directory index. File reads are timed both with
+ *          openFile() and through the hot-file cache. ETags are timed
+ *          hashing a 1 MiB buffer and answering from the ETag cache.
+ *
+ *          The hostname resolver is checked against a stub lookup:
+ *          concurrent lookups of one address must be merged, names and
+ *          failures alike cached, and both looked up again once their
+ *          TTL has passed.
+ *
+ *          Every heap allocation of the process is counted, by replacing
+ *          the global operator new, and reported per call beside the time.
+ *          The steady-state request path (a cached get, its trip through
+ *          the I/O pool, and its transfer's queue node) should allocate
+ *          nothing.
+ */
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include "../ftserver.hpp"
+#include "../reactor.hpp"
+#include "../iopool.hpp"
+#include "../parser.hpp"
+#include "../protocol.hpp"
+#include "../dirindex.hpp"
+#include "../filecache.hpp"
+#include "../etag.hpp"
+#include "../listing.hpp"
+#include "../resolver.hpp"
+using namespace std;
+
+#define BENCH_MIN_MS 200  // Each benchmark runs at least this long
+#define STUB_TTL 1        // Seconds the resolver check caches names
+#define STUB_DELAY_MS 50  // Each stub lookup takes this long
+#define STUB_NAMED "192.0.2.1"    // The stub's address with a name
+#define STUB_UNNAMED "192.0.2.2"  // And one without
+
+static volatile size_t sink;  // Keeps results from being optimized out
+static std::atomic<long long> allocations(0);  // operator new calls
+
+void *operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+/**
+ * Print the mean time and heap allocations per call of fn, run for at
+ * least BENCH_MIN_MS.
+ */
+template <typename F>
+static void bench(const char *name, F fn) {
+    long long calls = 0;
+    double elapsed = 0;
+
+    fn();  // Warm up caches
+    long long allocated = allocations.load();
+    for (long long batch = 1; elapsed * 1000 < BENCH_MIN_MS; batch *= 2) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (long long i = 0; i < batch; i++)
+            fn();
+        elapsed += chrono::duration<double>(
+                chrono::steady_clock::now() - start).count();
+        calls += batch;
+    }
+    cout << left << setw(34) << name << right << setw(12) << fixed
+        << setprecision(1) << elapsed * 1e9 / calls << " ns/call"
+        << setw(8) << setprecision(2)
+        << (double)(allocations.load() - allocated) / calls << " allocs/call"
+        << endl;
+}
+
+static std::atomic<int> stubLookups(0);  // Calls of stubLookup()
+
+/**
+ * Name lookup standing in for DNS: slow, and without a name for
+ * STUB_UNNAMED.
+ */
+static string stubLookup(const struct sockaddr *addr, socklen_t) {
+    char text[INET_ADDRSTRLEN];
+    const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+
+    stubLookups++;
+    this_thread::sleep_for(chrono::milliseconds(STUB_DELAY_MS));
+    inet_ntop(AF_INET, &in->sin_addr, text, sizeof text);
+    return string(text) == STUB_UNNAMED ? "" : "stub." + string(text);
+}
+
+/**
+ * Resolve address, counting the answers in answered and keeping the
+ * last in name.
+ *
+ * @return if it was answered from the cache
+ */
+static bool resolve(const string &address, Mailbox *box, int *answered,
+        string *name) {
+    struct sockaddr_in addr = sockaddr_in();
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, address.c_str(), &addr.sin_addr);
+    return resolveHost(address, (const struct sockaddr *)&addr, sizeof addr,
+        box, [answered, name](const string &host) {
+            (*answered)++;
+            *name = host;
+        });
+}
+
+/**
+ * Drain box until answered reaches count.
+ */
+static void awaitAnswers(Mailbox *box, const int *answered, int count) {
+    while (*answered < count) {
+        struct pollfd ready = { mailboxFd(box), POLLIN, 0 };
+        poll(&ready, 1, -1);
+        drainMailbox(box);
+    }
+}
+
+/**
+ * Check the resolver against stubLookup().
+ *
+ * @return the first check that failed, or "" if all passed
+ */
+static string checkResolver(Mailbox *box) {
+    int answered = 0;
+    string name;
+
+    setResolverLookup(stubLookup);
+    startResolver(STUB_TTL);
+
+    // Both clients wait on one lookup
+    if (resolve(STUB_NAMED, box, &answered, &name)
+            || resolve(STUB_NAMED, box, &answered, &name))
+        return "first lookup answered from the cache";
+    awaitAnswers(box, &answered, 2);
+    if (stubLookups != 1)
+        return "concurrent lookups not merged";
+    if (name != "stub." STUB_NAMED)
+        return "wrong name " + name;
+    if (!resolve(STUB_NAMED, box, &answered, &name) || stubLookups != 1)
+        return "name not cached";
+
+    // A failure is answered with the numeric address, and cached
+    resolve(STUB_UNNAMED, box, &answered, &name);
+    awaitAnswers(box, &answered, 4);
+    if (name != STUB_UNNAMED)
+        return "failure not answered with the address";
+    if (!resolve(STUB_UNNAMED, box, &answered, &name) || stubLookups != 2)
+        return "failure not cached";
+
+    // Then both expire
+    this_thread::sleep_for(chrono::milliseconds(STUB_TTL * 1000 + 100));
+    if (resolve(STUB_NAMED, box, &answered, &name)
+            || resolve(STUB_UNNAMED, box, &answered, &name))
+        return "entry not expired after its TTL";
+    awaitAnswers(box, &answered, 7);
+    if (stubLookups != 4)
+        return "expired entry not looked up again";
+    return "";
+}
+
+/**
+ * Release what a response holds.
+ */
+static void dropResponse(Response *r) {
+    if (r->fd != -1)
+        close(r->fd);
+    sink += r->header.length() + r->length;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2 || chdir(argv[1]) == -1) {
+        cerr << "Usage: micro_bench <fixture directory>" << endl;
+        return 1;
+    }
+
+    // The smallest regular file stands in for a typical request.
+    string filename;
+    off_t smallest = -1;
+    int entries = 0;
+    DIR *dir = opendir(".");
+    struct dirent *d;
+    while (dir && (d = readdir(dir)) != NULL) {
+        struct stat info;
+        entries++;
+        if (stat(d->d_name, &info) == 0 && S_ISREG(info.st_mode)
+                && (smallest == -1 || info.st_size < smallest)) {
+            smallest = info.st_size;
+            filename = d->d_name;
+        }
+    }
+    if (dir)
+        closedir(dir);
+    if (filename.empty()) {
+        cerr << "No files in " << argv[1] << endl;
+        return 1;
+    }
+    cout << entries << " directory entries; file " << filename << " ("
+        << smallest << " bytes)" << endl;
+
+    string command = "<g>" + filename + "</g><dataport>40000</dataport>";
+    bench("parseTag (g, l, dataport)", [&]() {
+        sink += parseTag(GET_COMMAND, command).length()
+            + parseTag(LIST_COMMAND, command).length()
+            + parseTag(PORT_TAG, command).length();
+    });
+    bench("parseMessage + parseRequest", [&]() {
+        MessageParser parser;
+        Message message;
+        Request request;
+        resetParser(&parser);
+        parseMessage(&parser, command.data(), command.length(), &message);
+        sink += parseRequest(message, &request);
+    });
+
+    // Without the index, as when inotify is unavailable
+    bench("fileExists (directory scan)", [&]() {
+        sink += fileExists(filename);
+    });
+    bench("lsCWD (directory scan)", [&]() {
+        sink += lsCWD(PROTO_FRAMED)->length();
+    });
+    ListQuery page;
+    page.limit = 100;
+    page.withStat = true;
+    bench("listPage (100 names, stat)", [&]() {
+        uint64_t next;
+        bool more;
+        sink += listPage(page, PROTO_FRAMED, &next, &more)->length();
+    });
+    bench("openFile", [&]() {
+        Response r;
+        sink += openFile(filename, &r);
+        dropResponse(&r);
+    });
+    setCacheBudget(0);
+    bench("parseCommand get (scan, no cache)", [&]() {
+        Request request;
+        request.verb = VERB_GET;
+        request.filename = filename;
+        request.dataPortNo = 40000;
+        Response r = parseCommand(request, "bench", PROTO_FRAMED);
+        dropResponse(&r);
+    });
+
+    setCacheBudget((size_t)DEFAULT_CACHE_MB << 20);
+    bench("cacheLookup (hit)", [&]() {
+        Response r;
+        sink += cacheLookup(filename, &r);
+        dropResponse(&r);
+    });
+    Request get;
+    get.verb = VERB_GET;
+    get.filename = filename;
+    get.dataPortNo = 40000;
+    string client = "bench";
+    bench("parseCommand get (cache hit)", [&]() {
+        Response r = parseCommand(get, client, PROTO_FRAMED);
+        dropResponse(&r);
+    });
+
+    // A job and its completion, with closures the size the reactor uses
+    startIoPool(1);
+    Mailbox *box = createMailbox();
+    bench("submitIo + drainMailbox", [&]() {
+        bool done = false;
+        Request *request = &get;
+        submitIo(box, [request]() { sink += request->dataPortNo; },
+            [&done, box]() { done = true; });
+        while (!done) {
+            struct pollfd ready = { mailboxFd(box), POLLIN, 0 };
+            poll(&ready, 1, -1);
+            drainMailbox(box);
+        }
+    });
+
+    deque<Transfer, RecyclingAllocator<Transfer> > transfers;
+    bench("transfer queue push + pop", [&]() {
+        transfers.push_back(Transfer());
+        transfers.back().request.dataPortNo = 40000;
+        sink += transfers.front().request.dataPortNo;
+        transfers.pop_front();
+    });
+
+    string failed = checkResolver(box);
+    if (!failed.empty()) {
+        cerr << "Resolver check failed: " << failed << endl;
+        return 1;
+    }
+    cout << "Resolver checks passed" << endl;
+
+    vector<char> block(1 << 20, 'x');
+    bench("contentHash (1 MiB)", [&]() {
+        sink += contentHash(block.data(), block.size());
+    });
+    Request conditional;
+    conditional.verb = VERB_GET;
+    conditional.filename = filename;
+    conditional.dataPortNo = 40000;
+    conditional.wantETag = true;
+    Response tagged = parseCommand(conditional, "bench", PROTO_FRAMED);
+    dropResponse(&tagged);
+    conditional.conditional = cachedETag(filename, &conditional.etag);
+    bench("parseCommand get (not modified)", [&]() {
+        Response r = parseCommand(conditional, "bench", PROTO_FRAMED);
+        dropResponse(&r);
+    });
+
+    if (!startDirIndex()) {
+        cerr << "inotify unavailable; skipping index benchmarks" << endl;
+        return 0;
+    }
+    bench("dirIndexContains", [&]() {
+        sink += dirIndexContains(filename);
+    });
+    bench("dirIndexListing", [&]() {
+        sink += dirIndexListing(PROTO_FRAMED)->length();
+    });
+    return 0;
+}
@@ -0,0 +1,101 @@
+/**
+ * File:    parse_bench.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   Microbenchmarks of the client message parser against the
+ *          original parseTag() scanning.
+ *
+ *          Each case parses the same stream of commands: once with
+ *          parseTag() the way parseCommand() used it (one whole command
+ *          per recv), and once with parseMessage() fed the stream in
+ *          recv-sized slices, in single bytes, and coalesced whole.
+ */
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <chrono>
+#include "../ftserver.hpp"
+#include "../parser.hpp"
+using namespace std;
+
+#define COMMANDS 100000  // Commands in the benchmark stream
+
+static volatile size_t sink;  // Keeps results from being optimized out
+
+/**
+ * Return the nanoseconds per command of one run of fn.
+ */
+template <typename F>
+static double timePerCommand(F fn) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    fn();
+    chrono::duration<double, nano> elapsed =
+        chrono::steady_clock::now() - start;
+    return elapsed.count() / COMMANDS;
+}
+
+/**
+ * Parse each command with parseTag(), as parseCommand() once did.
+ */
+static void parseTagCommands(const string *commands) {
+    for (int i = 0; i < COMMANDS; i++) {
+        string port = parseTag(PORT_TAG, commands[i]);
+        string filename = parseTag(GET_COMMAND, commands[i]);
+        if (filename.compare("") == 0)
+            filename = parseTag(LIST_COMMAND, commands[i]);
+        sink += port.length() + filename.length();
+    }
+}
+
+/**
+ * Feed stream to parseMessage() in slices of at most slice bytes.
+ */
+static void parseStream(const string &stream, size_t slice) {
+    MessageParser parser;
+    Message message;
+    size_t start = 0, available = 0;
+
+    resetParser(&parser);
+    while (available < stream.length()) {
+        available = min(stream.length(), available + slice);
+        while (parseMessage(&parser, stream.data() + start,
+                    available - start, &message) == PARSE_MESSAGE) {
+            start += parser.length;
+            resetParser(&parser);
+            sink += parsePort(message.field(PORT_TAG))
+                + message.contents[0].length();
+        }
+    }
+}
+
+int main() {
+    string *commands = new string[COMMANDS];
+    string stream;
+
+    for (int i = 0; i < COMMANDS; i++) {
+        if (i % 4 == 0)
+            commands[i] = "<l> </l>";
+        else
+            commands[i] = "<g>file" + to_string(i) + ".txt</g>";
+        commands[i] += "<dataport>" + to_string(30000 + i % 1000)
+            + "</dataport>";
+        stream += commands[i];
+    }
+
+    cout << "parseTag, one command per recv:     "
+        << timePerCommand([&]() { parseTagCommands(commands); })
+        << " ns/command" << endl;
+    cout << "parseMessage, recv-sized reads:     "
+        << timePerCommand([&]() { parseStream(stream, RECV_BUF_LEN); })
+        << " ns/command" << endl;
+    cout << "parseMessage, 1-byte reads:         "
+        << timePerCommand([&]() { parseStream(stream, 1); })
+        << " ns/command" << endl;
+    cout << "parseMessage, one coalesced read:   "
+        << timePerCommand([&]() { parseStream(stream, stream.length()); })
+        << " ns/command" << endl;
+
+    delete[] commands;
+    return 0;
+}
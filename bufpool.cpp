@@ -0,0 +1,83 @@
+/**
+ * File:    bufpool.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the implementation of the response buffer
+ *          pool. A thread that runs out of buffers refills half its share
+ *          from the shared pool; one with a full share moves half of it
+ *          there. Buffers are moved, never copied, so trading them
+ *          allocates nothing once the vectors holding them have grown.
+ */
+#include <string>
+#include <vector>
+#include <mutex>
+#include <utility>
+#include "bufpool.hpp"
+using namespace std;
+
+// Never destroyed: reactors may still free responses while the process
+// exits, and a thread's own buffers may be recycled after its exit.
+static mutex &poolLock = *new mutex();
+static vector<string> &shared = *new vector<string>();
+static thread_local vector<string> *local = NULL;
+
+/**
+ * Return this thread's buffers.
+ */
+static vector<string> &localBuffers() {
+    if (local == NULL) {
+        local = new vector<string>();
+        local->reserve(BUF_POOL_LOCAL);
+    }
+    return *local;
+}
+
+/**
+ * Empty buffer, giving it a pooled buffer's capacity if it has less.
+ */
+void takeBuffer(string *buffer) {
+    if (buffer->capacity() >= BUF_POOL_RESERVE) {
+        buffer->clear();
+        return;
+    }
+
+    vector<string> &mine = localBuffers();
+    if (mine.empty()) {
+        lock_guard<mutex> guard(poolLock);
+        while (!shared.empty() && mine.size() < BUF_POOL_LOCAL / 2) {
+            mine.push_back(move(shared.back()));
+            shared.pop_back();
+        }
+    }
+    if (mine.empty()) {
+        buffer->reserve(BUF_POOL_RESERVE);
+        return;
+    }
+    *buffer = move(mine.back());
+    mine.pop_back();
+    buffer->clear();
+}
+
+/**
+ * Give buffer's memory back to the pool, leaving buffer empty.
+ */
+void recycleBuffer(string *buffer) {
+    if (buffer->capacity() < BUF_POOL_RESERVE
+            || buffer->capacity() > BUF_POOL_MAX_CAPACITY)
+        return;
+
+    vector<string> &mine = localBuffers();
+    if (mine.size() == BUF_POOL_LOCAL) {
+        lock_guard<mutex> guard(poolLock);
+        if (shared.capacity() == 0)
+            shared.reserve(BUF_POOL_SHARED);
+        while (mine.size() > BUF_POOL_LOCAL / 2) {
+            if (shared.size() < BUF_POOL_SHARED)
+                shared.push_back(move(mine.back()));
+            mine.pop_back();  // Frees it if the shared pool is full
+        }
+    }
+    mine.push_back(move(*buffer));
+    buffer->clear();
+}
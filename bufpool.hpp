@@ -0,0 +1,98 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+/**
+ * File:    bufpool.hpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the interfaces of the response buffer pool.
+ *
+ *          Response headers and trailers are built on the I/O pool and
+ *          freed on a reactor once sent, so a buffer allocated per
+ *          request would cost a malloc() and a free() on different
+ *          threads every time. Instead, headers are built into buffers
+ *          taken from a pool and given back to it when their response is
+ *          destroyed. Each thread keeps a few buffers of its own and
+ *          trades them with a shared pool in batches, so the shared pool's
+ *          lock is taken once per batch rather than once per buffer.
+ *
+ *          RecyclingAllocator does the same for the nodes of a container
+ *          that allocates one per element, such as a std::deque of
+ *          elements of more than 512 bytes.
+ */
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <new>
+
+#define BUF_POOL_RESERVE 256          // Capacity of a new pooled buffer
+#define BUF_POOL_MAX_CAPACITY 4096    // Larger buffers are freed, not kept
+#define BUF_POOL_LOCAL 64             // Buffers a thread keeps to itself
+#define BUF_POOL_SHARED 4096          // Buffers the shared pool keeps
+#define RECYCLE_MAX 64                // Nodes a thread keeps per type
+
+/**
+ * Empty buffer, giving it a pooled buffer's capacity if it has less.
+ */
+void takeBuffer(std::string *buffer);
+
+/**
+ * Give buffer's memory back to the pool, leaving buffer empty. Buffers
+ * too small or too large to pool are left to be freed as usual.
+ */
+void recycleBuffer(std::string *buffer);
+
+// An allocator whose single-block frees are kept per thread and reused
+// by the next allocation of the same size, so a container that frees
+// one node as it allocates another stops calling malloc() once warm.
+// Memory must be freed on the thread that allocated it.
+template <typename T>
+struct RecyclingAllocator {
+    typedef T value_type;
+
+    RecyclingAllocator() {}
+    template <typename U>
+    RecyclingAllocator(const RecyclingAllocator<U> &) {}
+
+    T *allocate(size_t n) {
+        std::vector<void *> &spare = spareBlocks();
+        if (n * sizeof(T) == spareBytes() && !spare.empty()) {
+            void *block = spare.back();
+            spare.pop_back();
+            return (T *)block;
+        }
+        return (T *)::operator new(n * sizeof(T));
+    }
+
+    void deallocate(T *p, size_t n) {
+        std::vector<void *> &spare = spareBlocks();
+        if (spare.empty())
+            spareBytes() = n * sizeof(T);  // Keep the size last freed
+        if (n * sizeof(T) == spareBytes() && spare.size() < RECYCLE_MAX) {
+            spare.push_back(p);
+            return;
+        }
+        ::operator delete(p);
+    }
+
+    bool operator==(const RecyclingAllocator &) const { return true; }
+    bool operator!=(const RecyclingAllocator &) const { return false; }
+
+private:
+    // Never destroyed: a thread's last frees may follow its exit.
+    static std::vector<void *> &spareBlocks() {
+        static thread_local std::vector<void *> *spare = NULL;
+        if (spare == NULL) {
+            spare = new std::vector<void *>();
+            spare->reserve(RECYCLE_MAX);
+        }
+        return *spare;
+    }
+
+    static size_t &spareBytes() {
+        static thread_local size_t bytes = 0;
+        return bytes;
+    }
+};
+
+#endif
@@ -0,0 +1,494 @@
+/**
+ * File:    compress.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the implementation of compressed gets.
+ *
+ *          Compressing a file costs far more than sending it, so a file
+ *          is first judged by its leading GZIP_SAMPLE_LEN bytes at a
+ *          quick level; only if those shrink enough is the whole file
+ *          compressed. Like the hot-file cache's entries, a variant being
+ *          sent holds its entry, so an entry evicted mid-transfer is
+ *          freed once the transfer is done.
+ *
+ *          Files past budget / GZIP_ENTRY_SHARE are streamed: any variant
+ *          larger than that could not be cached, and a smaller file whose
+ *          variant outgrew it would have failed the ratio test anyway.
+ *          A stream keeps its deflate() state and unread input between
+ *          segments, so each fill takes up where the last stopped.
+ */
+#include <string>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cerrno>
+#include <utility>
+#include <unordered_map>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "compress.hpp"
+#include "protocol.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "filecache.hpp"
+using namespace std;
+
+// The compressed variant of one version of a file
+struct GzipEntry {
+    string name;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    string body;  // The gzip stream; empty if the file does not compress
+};
+
+typedef list< shared_ptr<GzipEntry> > LruList;  // Front is most recent
+
+// Never destroyed: pool threads may still compress while the process exits.
+static mutex &gzipLock = *new mutex();
+static size_t budget = (size_t)DEFAULT_GZIP_CACHE_MB << 20;
+static size_t used = 0;    // Bytes of cached variants
+static LruList &lru = *new LruList();
+static unordered_map<string, LruList::iterator> &entries =
+    *new unordered_map<string, LruList::iterator>();
+
+static atomic<unsigned long long> hits(0);
+static atomic<unsigned long long> misses(0);
+static atomic<unsigned long long> skipped(0);
+static atomic<unsigned long long> streamed(0);
+static atomic<unsigned long long> bytesCompressed(0);
+static atomic<unsigned long long> bytesSaved(0);
+
+/**
+ * End the compression and close the file.
+ */
+GzipStream::~GzipStream() {
+    if (zs != NULL) {
+        deflateEnd(zs);
+        delete zs;
+    }
+    if (source.fd != -1)
+        close(source.fd);
+}
+
+/**
+ * Set the budget of compressed variants. A budget of 0 disables
+ * compression.
+ */
+void setGzipBudget(size_t bytes) {
+    lock_guard<mutex> guard(gzipLock);
+    budget = bytes;
+}
+
+/**
+ * Drop the entry at it from the cache.
+ *
+ * @pre gzipLock is held
+ */
+static void dropEntry(LruList::iterator it) {
+    used -= (*it)->body.length();
+    entries.erase((*it)->name);
+    lru.erase(it);
+}
+
+/**
+ * Return if entry was made from the file version stat'ed into info.
+ */
+static bool entryCurrent(const GzipEntry &entry, const struct stat &info) {
+    return entry.dev == info.st_dev && entry.ino == info.st_ino
+        && entry.size == info.st_size
+        && entry.mtime.tv_sec == info.st_mtim.tv_sec
+        && entry.mtime.tv_nsec == info.st_mtim.tv_nsec;
+}
+
+/**
+ * Read up to GZIP_CHUNK body bytes from pos into buffer, and point at
+ * them. The body is always read from its file, never from a cached
+ * mapping: a mapping truncated meanwhile raises SIGBUS.
+ *
+ * @return the number of bytes at *chunk; 0 on a read error
+ */
+static size_t bodyChunk(const Response &body, size_t pos,
+        vector<char> *buffer, const char **chunk) {
+    size_t want = body.length - pos;
+    if (want > GZIP_CHUNK)
+        want = GZIP_CHUNK;
+
+    buffer->resize(GZIP_CHUNK);
+    size_t done = 0;
+    while (done < want) {
+        ssize_t n = pread(body.fd, buffer->data() + done, want - done,
+                body.offset + pos + done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == -1)
+                logErrno("Read for gzip");
+            return 0;
+        }
+        done += n;
+    }
+    *chunk = buffer->data();
+    return done;
+}
+
+/**
+ * Return if the first GZIP_SAMPLE_LEN bytes of body compress to at most
+ * GZIP_MAX_PERCENT of their length at a quick level.
+ */
+static bool sampleCompresses(const Response &body) {
+    vector<char> buffer;
+    const char *chunk;
+    size_t length = bodyChunk(body, 0, &buffer, &chunk);
+    if (length > GZIP_SAMPLE_LEN)
+        length = GZIP_SAMPLE_LEN;
+
+    uLongf packed = compressBound(length);
+    vector<Bytef> out(packed);
+    if (compress2(out.data(), &packed, (const Bytef *)chunk, length,
+                GZIP_SAMPLE_LEVEL) != Z_OK)
+        return false;
+    return packed * 100 <= length * GZIP_MAX_PERCENT;
+}
+
+/**
+ * Prepare zs to compress one gzip stream.
+ */
+static bool startDeflate(z_stream *zs) {
+    // 15 bits of window, plus 16 for a gzip header and trailer
+    return deflateInit2(zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+            Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+/**
+ * Compress body as one gzip stream into out, a chunk at a time.
+ *
+ * @param limit most compressed bytes wanted
+ *
+ * @return false on failure, or if out would be over limit
+ */
+static bool deflateBody(const Response &body, size_t limit, string *out) {
+    z_stream zs = z_stream();
+    if (!startDeflate(&zs))
+        return false;
+
+    vector<char> buffer;
+    vector<char> packed(GZIP_CHUNK);
+    size_t pos = 0;
+    int status = Z_OK;
+    bool fits = true;
+
+    while (status == Z_OK && fits) {
+        const char *chunk = NULL;
+        size_t length = 0;
+        int flush = Z_FINISH;
+        if (pos < body.length) {
+            length = bodyChunk(body, pos, &buffer, &chunk);
+            if (length == 0)
+                break;
+            pos += length;
+            flush = (pos < body.length) ? Z_NO_FLUSH : Z_FINISH;
+        }
+        zs.next_in = (Bytef *)chunk;
+        zs.avail_in = length;
+        do {
+            zs.next_out = (Bytef *)packed.data();
+            zs.avail_out = packed.size();
+            status = deflate(&zs, flush);
+            if (status == Z_BUF_ERROR)  // Only no progress; not an error
+                status = Z_OK;
+            out->append(packed.data(), packed.size() - zs.avail_out);
+        } while (zs.avail_out == 0 && status == Z_OK);
+        fits = out->length() <= limit;
+    }
+    deflateEnd(&zs);
+    return status == Z_STREAM_END && fits;
+}
+
+/**
+ * Point response at the compressed variant in entry.
+ */
+static void fillResponse(const shared_ptr<GzipEntry> &entry,
+        Response *response) {
+    if (response->fd != -1)
+        close(response->fd);
+    bytesSaved += response->length - entry->body.length();
+    response->fd = -1;
+    response->offset = 0;
+    response->data = entry->body.data();
+    response->length = entry->body.length();
+    response->owner = entry;
+}
+
+/**
+ * Return if the file body was read from is still the version entry
+ * was made from.
+ */
+static bool bodyUnchanged(const Response &body, const GzipEntry &entry) {
+    struct stat after;
+    return fstat(body.fd, &after) == 0 && entryCurrent(entry, after);
+}
+
+/**
+ * Cache entry as its file's variant or verdict, replacing any older one.
+ */
+static void cacheEntry(const shared_ptr<GzipEntry> &entry) {
+    lock_guard<mutex> guard(gzipLock);
+    unordered_map<string, LruList::iterator>::iterator found =
+        entries.find(entry->name);
+    if (found != entries.end())  // Another thread compressed it meanwhile
+        dropEntry(found->second);
+
+    lru.push_front(entry);
+    entries[entry->name] = lru.begin();
+    used += entry->body.length();
+    while ((used > budget || entries.size() > GZIP_ENTRIES_MAX)
+            && !lru.empty())
+        dropEntry(--lru.end());
+}
+
+/**
+ * Give response a stream that compresses its body as it is sent, with
+ * the first segment filled and made the body.
+ *
+ * @param entry the file version, with an empty body
+ * @param source the body, open as a file; the stream takes the file
+ *
+ * @return false if the body is left as it is, and the file with source
+ */
+static bool streamBody(const shared_ptr<GzipEntry> &entry,
+        const Response &source, Response *response) {
+    bool compresses;
+    {
+        StageTimer timer(STAGE_COMPRESS);
+        compresses = sampleCompresses(source);
+    }
+    if (!compresses) {
+        if (bodyUnchanged(source, *entry))
+            cacheEntry(entry);  // Not worth it; remember that
+        skipped++;
+        return false;
+    }
+
+    shared_ptr<GzipStream> stream(new GzipStream());
+    stream->zs = new z_stream();
+    if (!startDeflate(stream->zs)) {
+        delete stream->zs;
+        stream->zs = NULL;
+        return false;
+    }
+    stream->source.fd = source.fd;
+    stream->source.offset = source.offset;
+    stream->source.length = source.length;
+    stream->version = entry;
+    fillGzipStream(stream.get());
+    if (stream->failed) {
+        stream->source.fd = -1;  // Still the caller's
+        return false;
+    }
+
+    response->fd = -1;
+    response->offset = 0;
+    response->owner.reset();
+    takeGzipSegment(stream.get(), &response->data, &response->length);
+    response->stream = stream;
+    streamed++;
+    return true;
+}
+
+/**
+ * Replace the whole-file body of response with its gzip compressed
+ * variant, compressing the file unless its current version is cached.
+ */
+bool gzipBody(const string &filename, Response *response) {
+    struct stat before;
+    size_t limit;
+
+    if (response->length < GZIP_MIN_SIZE)
+        return false;
+    // The open file is the version being sent; a cached mapping was
+    // checked against the name just now.
+    bool statted = (response->fd != -1)
+        ? fstat(response->fd, &before) == 0
+        : stat(filename.c_str(), &before) == 0;
+    if (!statted || (size_t)before.st_size != response->length)
+        return false;
+
+    {
+        lock_guard<mutex> guard(gzipLock);
+        if (budget == 0)
+            return false;
+        limit = budget / GZIP_ENTRY_SHARE;
+
+        unordered_map<string, LruList::iterator>::iterator found =
+            entries.find(filename);
+        if (found != entries.end()) {
+            LruList::iterator it = found->second;
+            if (entryCurrent(**it, before)) {
+                lru.splice(lru.begin(), lru, it);  // Now most recent
+                if ((*it)->body.empty()) {
+                    skipped++;
+                    return false;
+                }
+                fillResponse(*it, response);
+                hits++;
+                return true;
+            }
+            dropEntry(it);  // File changed since it was compressed
+        }
+        misses++;
+    }
+
+    shared_ptr<GzipEntry> entry(new GzipEntry());
+    entry->name = filename;
+    entry->dev = before.st_dev;
+    entry->ino = before.st_ino;
+    entry->size = before.st_size;
+    entry->mtime = before.st_mtim;
+
+    // A cached mapping is compressed from its file all the same, reading
+    // it with pread() so a truncation cannot fault.
+    Response source;
+    bool opened = (response->fd == -1);  // Just for compressing
+    source.fd = opened ? cacheOpen(filename, *response) : response->fd;
+    if (source.fd == -1)
+        return false;
+    source.offset = response->offset;
+    source.length = response->length;
+    if (response->length > limit) {
+        if (streamBody(entry, source, response))
+            return true;
+        if (opened)
+            close(source.fd);
+        return false;
+    }
+
+    // Compress outside the lock; it is the slow part. The file is no
+    // larger than limit, so a variant over it fails the ratio test.
+    {
+        StageTimer timer(STAGE_COMPRESS);
+        if (!sampleCompresses(source)
+                || !deflateBody(source, limit, &entry->body)
+                || entry->body.length() * 100
+                    > response->length * GZIP_MAX_PERCENT)
+            entry->body.clear();  // Not worth it; remember that
+    }
+    bytesCompressed += response->length;
+
+    // Cache it only if the file did not change while it was read.
+    bool unchanged = bodyUnchanged(source, *entry);
+    if (opened)
+        close(source.fd);
+    if (!unchanged)
+        return false;
+    cacheEntry(entry);
+    if (entry->body.empty()) {
+        skipped++;
+        return false;
+    }
+    fillResponse(entry, response);
+    return true;
+}
+
+/**
+ * Compress the next segment of stream into next.
+ */
+void fillGzipStream(GzipStream *stream) {
+    StageTimer timer(STAGE_COMPRESS);
+    z_stream &zs = *stream->zs;
+    const Response &body = stream->source;
+    size_t produced = 0;
+
+    // Room for the chunk's length, the chunk, and the empty chunk after
+    stream->next.resize(FRAME_CHUNK_LEN + GZIP_SEGMENT + FRAME_CHUNK_LEN);
+    char *out = stream->next.data() + FRAME_CHUNK_LEN;
+    while (produced < GZIP_SEGMENT && !stream->finished) {
+        // Input left over from the last fill is still in zs
+        if (zs.avail_in == 0 && stream->consumed < body.length) {
+            const char *chunk;
+            size_t length = bodyChunk(body, stream->consumed,
+                    &stream->input, &chunk);
+            if (length == 0) {
+                stream->failed = true;
+                return;
+            }
+            zs.next_in = (Bytef *)chunk;
+            zs.avail_in = length;
+            stream->consumed += length;
+            bytesCompressed += length;
+        }
+        zs.next_out = (Bytef *)out + produced;
+        zs.avail_out = GZIP_SEGMENT - produced;
+        int flush = (stream->consumed < body.length) ? Z_NO_FLUSH : Z_FINISH;
+        int status = deflate(&zs, flush);
+        produced = GZIP_SEGMENT - zs.avail_out;
+        if (status == Z_STREAM_END) {
+            stream->finished = true;
+        }
+        else if (status != Z_OK && status != Z_BUF_ERROR) {
+            stream->failed = true;
+            return;
+        }
+    }
+
+    size_t length = 0;
+    if (produced > 0) {
+        putBigEndian(stream->next.data(), produced, FRAME_CHUNK_LEN);
+        length = FRAME_CHUNK_LEN + produced;
+    }
+    stream->produced += produced;
+    if (stream->finished) {
+        putBigEndian(stream->next.data() + length, 0, FRAME_CHUNK_LEN);
+        length += FRAME_CHUNK_LEN;
+
+        // Judged as a whole like a cached variant, for the next get
+        if (stream->produced < body.length)
+            bytesSaved += body.length - stream->produced;
+        if (stream->produced * 100 > body.length * GZIP_MAX_PERCENT
+                && bodyUnchanged(body, *stream->version))
+            cacheEntry(stream->version);
+    }
+    stream->nextLen = length;
+}
+
+/**
+ * Return if every segment of stream has been taken to be sent.
+ */
+bool gzipStreamEnded(const GzipStream &stream) {
+    return stream.finished && stream.nextLen == 0;
+}
+
+/**
+ * Make the filled segment of stream the one being sent.
+ */
+void takeGzipSegment(GzipStream *stream, const char **data, size_t *length) {
+    swap(stream->current, stream->next);
+    *data = stream->current.data();
+    *length = stream->nextLen;
+    stream->nextLen = 0;
+}
+
+/**
+ * Return the compression counters as "name value" lines.
+ */
+string gzipStats() {
+    size_t bytes, count;
+    {
+        lock_guard<mutex> guard(gzipLock);
+        bytes = used;
+        count = entries.size();
+    }
+    return "gzip_hits " + to_string(hits.load()) + "\n"
+        + "gzip_misses " + to_string(misses.load()) + "\n"
+        + "gzip_skipped " + to_string(skipped.load()) + "\n"
+        + "gzip_streamed " + to_string(streamed.load()) + "\n"
+        + "gzip_bytes_compressed " + to_string(bytesCompressed.load()) + "\n"
+        + "gzip_bytes_saved " + to_string(bytesSaved.load()) + "\n"
+        + "gzip_entries " + to_string((unsigned long long)count) + "\n"
+        + "gzip_bytes " + to_string((unsigned long long)bytes) + "\n";
+}
@@ -0,0 +1,121 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+/**
+ * File:    compress.hpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the interfaces of compressed gets.
+ *
+ *          A client that can decompress gzip says so with its get, and
+ *          is then sent the file gzip compressed when that is smaller.
+ *          The file is compressed on the I/O pool, reading it a chunk at
+ *          a time, and the compressed variant is kept in memory, up to a
+ *          budget and least recently used first out, so later gets of the
+ *          same file send it straight from memory. Variants are validated
+ *          against the file's inode, size and mtime like the hot-file
+ *          cache's entries.
+ *
+ *          A file whose leading bytes barely compress (already compressed
+ *          media and archives) is sent as it is, and that verdict is
+ *          cached too, so it is not tried again until the file changes.
+ *
+ *          A file too large for its variant to be cached is compressed
+ *          while it is sent instead: the I/O pool fills one segment of
+ *          the gzip stream while the reactor sends the other, so at most
+ *          two segments of it are ever held. Its length is not known
+ *          until the end, so the body goes out in chunks (FT_FLAG_CHUNKED).
+ *          Such a file that turns out to compress badly as a whole is
+ *          remembered like one whose leading bytes do.
+ */
+#include <string>
+#include <memory>
+#include <vector>
+#include "ftserver.hpp"
+
+#define DEFAULT_GZIP_CACHE_MB 64  // Default budget of compressed variants
+#define GZIP_LEVEL 6              // zlib level of cached variants
+#define GZIP_SAMPLE_LEVEL 1       // Quick level for the compressibility test
+#define GZIP_MIN_SIZE 512         // Smaller files are sent as they are
+#define GZIP_SAMPLE_LEN (64 * 1024)  // Leading bytes tried first
+#define GZIP_MAX_PERCENT 90       // Sent compressed only if at most this
+                                  // percent of the file
+#define GZIP_CHUNK (256 * 1024)   // File bytes compressed per deflate()
+#define GZIP_ENTRY_SHARE 8        // Larger files than budget / this are
+                                  // streamed, not cached
+#define GZIP_SEGMENT (256 * 1024) // Compressed bytes per streamed segment
+#define GZIP_ENTRIES_MAX 65536    // Files whose variant or verdict is kept
+
+struct GzipEntry;
+struct z_stream_s;
+
+// A gzip body made while it is sent. The I/O pool fills next while the
+// reactor sends current; the two are swapped as each segment is taken.
+// Each segment is one chunk, its length first; the last is followed by
+// the empty chunk that ends the body.
+struct GzipStream {
+    Response source;     // The file body, which the stream now owns
+    z_stream_s *zs;      // Compression state, carried between segments
+    std::vector<char> input;    // File bytes read for compression
+    size_t consumed;     // Source bytes compressed so far
+    uint64_t produced;   // Compressed bytes so far
+    std::vector<char> current;  // Being sent
+    std::vector<char> next;     // Being filled by the I/O pool
+    size_t nextLen;      // Bytes in next, or 0 when none are waiting
+    bool filling;        // A fill is running on the I/O pool
+    bool finished;       // Every segment has been filled
+    bool failed;         // A read or deflate() failed
+    std::shared_ptr<GzipEntry> version;  // Of the file; for the verdict
+
+    GzipStream() : zs(NULL), consumed(0), produced(0), nextLen(0),
+        filling(false), finished(false), failed(false) {}
+    ~GzipStream();  // Ends the compression and closes the file
+};
+
+/**
+ * Set the budget of compressed variants. A budget of 0 disables
+ * compression.
+ *
+ * @param bytes memory budget in bytes
+ */
+void setGzipBudget(size_t bytes);
+
+/**
+ * Replace the whole-file body of response with its gzip compressed
+ * variant, compressing the file unless its current version is cached.
+ * A file too large to cache is given a stream instead, whose first
+ * segment becomes the body. Blocks; runs on the I/O pool.
+ *
+ * @param filename the file the body was read from
+ * @param response a response whose body is the whole file
+ *
+ * @return false if the body is left as it is: the file is too small or
+ *         does not compress well
+ */
+bool gzipBody(const std::string &filename, Response *response);
+
+/**
+ * Compress the next segment of stream into next. Blocks; runs on the
+ * I/O pool. Sets failed if the file cannot be read.
+ */
+void fillGzipStream(GzipStream *stream);
+
+/**
+ * Return if every segment of stream has been taken to be sent.
+ */
+bool gzipStreamEnded(const GzipStream &stream);
+
+/**
+ * Make the filled segment of stream the one being sent, and return its
+ * bytes through data and length.
+ *
+ * @pre nextLen > 0 and no fill is running
+ */
+void takeGzipSegment(GzipStream *stream, const char **data, size_t *length);
+
+/**
+ * Return the compression counters as "name value" lines.
+ */
+std::string gzipStats();
+
+#endif
@@ -0,0 +1,487 @@
+/**
+ * File:    delta.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the implementation of delta gets.
+ *
+ *          With a = 1 + the sum of the window's bytes and b = the sum of
+ *          the running values of a, both mod 65521, the Adler-32 of a
+ *          window of n bytes moves on by one byte in constant time:
+ *
+ *              a' = a - out + in
+ *              b' = b - n * out + a' - 1
+ *
+ *          zlib computes each fresh window's sum, many bytes a step. Most
+ *          windows match no block, so a 64K entry filter of the client's
+ *          weak sums rules them out before the hash table is looked at,
+ *          and the MD5 of a window is only taken when its weak sum is a
+ *          hit.
+ */
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>           // adler32()
+#include <openssl/evp.h>    // MD5
+#include "delta.hpp"
+#include "protocol.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "filecache.hpp"
+using namespace std;
+
+#define ADLER_MOD 65521
+#define NO_BLOCK UINT32_MAX
+#define FILTER_BITS 16  // The filter has an entry per 16-bit folded sum
+
+// A literal run left in the file, to be sent from there
+struct LiteralRun {
+    size_t opsEnd;    // Where in the operations its bytes go
+    uint64_t offset;  // Its first byte in the file
+    uint64_t length;
+};
+
+// A delta being encoded
+struct DeltaOut {
+    string ops;       // The digest, then the encoded operations, with
+                      // the bytes of short literal runs
+    vector<LiteralRun> runs;  // The long literal runs, in order
+    size_t encoded;   // Bytes of the whole delta so far
+    uint64_t copyFirst;  // A copy being gathered, to join the next onto
+    uint64_t copyCount;  // Its blocks, or 0 if there is none
+};
+
+// The file being scanned: a window of it read through a buffer, so a
+// file cut short meanwhile ends the read instead of faulting
+struct FileWindow {
+    int fd;             // The file
+    off_t offset;       // File offset of its first byte
+    size_t size;        // Its length
+    const unsigned char *data;  // The bytes from base on
+    size_t base;        // Position in the file of data[0]
+    size_t filled;      // Bytes at data
+    vector<unsigned char> buffer;  // Holds the window of a file
+    EVP_MD_CTX *md5;    // Digest of every byte read so far
+};
+
+// Keeps the file of a delta open while any part sending from it is
+struct SharedFile {
+    int fd;
+    explicit SharedFile(int fd) : fd(fd) {}
+    ~SharedFile() { close(fd); }
+};
+
+// The client's blocks by weak sum
+struct BlockIndex {
+    vector<uint8_t> filter;                   // Set per folded weak sum
+    unordered_map<uint32_t, uint32_t> heads;  // First block of each sum
+    vector<uint32_t> next;                    // Next block with its sum
+};
+
+/**
+ * Return the value of the hex digits in text, or -1 if any is not one.
+ */
+static long long parseHex(string_view text) {
+    long long value = 0;
+    for (size_t i = 0; i < text.length(); i++) {
+        char c = text[i];
+        int digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else
+            return -1;
+        value = (value << 4) | digit;
+    }
+    return value;
+}
+
+/**
+ * Parse the concatenated hex signatures of a delta get.
+ */
+bool parseSignatures(string_view text, vector<BlockSignature> *signatures) {
+    if (text.length() % DELTA_SIG_HEX_LEN != 0
+            || text.length() / DELTA_SIG_HEX_LEN > DELTA_MAX_BLOCKS)
+        return false;
+
+    signatures->clear();
+    for (size_t i = 0; i < text.length(); i += DELTA_SIG_HEX_LEN) {
+        long long weak = parseHex(text.substr(i, 8));
+        long long high = parseHex(text.substr(i + 8, 8));
+        long long low = parseHex(text.substr(i + 16, 8));
+        if (weak == -1 || high == -1 || low == -1)
+            return false;
+        BlockSignature signature = { (uint32_t)weak,
+            ((uint64_t)high << 32) | (uint64_t)low };
+        signatures->push_back(signature);
+    }
+    return true;
+}
+
+/**
+ * Return the strong hash of length bytes at data.
+ */
+static uint64_t strongSum(const unsigned char *data, size_t length) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLength;
+    uint64_t sum = 0;
+
+    EVP_Digest(data, length, digest, &digestLength, EVP_md5(), NULL);
+    for (int i = 0; i < 8; i++)
+        sum = (sum << 8) | digest[i];
+    return sum;
+}
+
+/**
+ * Fold a weak sum to its entry in the filter.
+ */
+static inline uint32_t filterBit(uint32_t weak) {
+    return (weak ^ (weak >> FILTER_BITS)) & ((1 << FILTER_BITS) - 1);
+}
+
+/**
+ * Index the client's blocks by weak sum, each sum's blocks in order.
+ */
+static void indexBlocks(const vector<BlockSignature> &signatures,
+        BlockIndex *index) {
+    index->filter.assign(1 << FILTER_BITS, 0);
+    index->next.assign(signatures.size(), NO_BLOCK);
+    for (size_t i = signatures.size(); i-- > 0;) {
+        uint32_t weak = signatures[i].weak;
+        index->filter[filterBit(weak)] = 1;
+        unordered_map<uint32_t, uint32_t>::iterator head =
+            index->heads.find(weak);
+        if (head != index->heads.end()) {
+            index->next[i] = head->second;
+            head->second = i;
+        }
+        else {
+            index->heads[weak] = i;
+        }
+    }
+}
+
+/**
+ * Return the client's block that the window at data matches, preferring
+ * the one after prev so runs of blocks coalesce; NO_BLOCK if none does.
+ *
+ * @pre the filter has weak's entry set
+ */
+static uint32_t findBlock(const BlockIndex &index,
+        const vector<BlockSignature> &signatures, uint32_t weak,
+        const unsigned char *data, size_t blockSize, uint32_t prev) {
+    unordered_map<uint32_t, uint32_t>::const_iterator head =
+        index.heads.find(weak);
+    if (head == index.heads.end())
+        return NO_BLOCK;
+
+    uint64_t strong = strongSum(data, blockSize);
+    uint32_t found = NO_BLOCK;
+    for (uint32_t i = head->second; i != NO_BLOCK; i = index.next[i]) {
+        if (signatures[i].strong != strong)
+            continue;
+        if (i == prev + 1)
+            return i;
+        if (found == NO_BLOCK)
+            found = i;
+    }
+    return found;
+}
+
+/**
+ * Make the window hold the file bytes from keep up to end, moving what
+ * it holds from keep on to the front of the buffer and reading more
+ * after it. Every byte read is added to the digest, once, in order.
+ *
+ * @pre base <= keep <= base + filled, and end - keep fits the buffer
+ *
+ * @return false if the file could not be read, or has shrunk
+ */
+static bool readWindow(FileWindow *w, size_t keep, size_t end) {
+    if (end <= w->base + w->filled)
+        return true;
+
+    unsigned char *buf = w->buffer.data();
+    size_t kept = w->base + w->filled - keep;
+    memmove(buf, buf + (keep - w->base), kept);
+    w->base = keep;
+    w->filled = kept;
+    w->data = buf;
+
+    size_t want = min(w->buffer.size(), w->size - keep);
+    while (w->filled < want) {
+        ssize_t n = pread(w->fd, buf + w->filled, want - w->filled,
+                w->offset + w->base + w->filled);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == -1)
+                logErrno("Read for delta");
+            return false;
+        }
+        EVP_DigestUpdate(w->md5, buf + w->filled, n);
+        w->filled += n;
+    }
+    return end <= w->base + w->filled;
+}
+
+/**
+ * Return where the window holds the byte of the file at pos.
+ */
+static inline const unsigned char *windowAt(const FileWindow &w, size_t pos) {
+    return w.data + (pos - w.base);
+}
+
+/**
+ * Encode the copy being gathered, if any.
+ */
+static void flushCopy(DeltaOut *out) {
+    char field[FT_DELTA_COPY_LEN];
+
+    if (out->copyCount == 0)
+        return;
+    field[0] = FT_DELTA_COPY;
+    putBigEndian(field + 1, out->copyFirst, 4);
+    putBigEndian(field + 5, out->copyCount, 4);
+    out->ops.append(field, FT_DELTA_COPY_LEN);
+    out->copyCount = 0;
+}
+
+/**
+ * Add a copy of the client's block, joining it onto the copy before it
+ * when it follows on.
+ */
+static void addCopy(DeltaOut *out, uint32_t block) {
+    if (out->copyCount > 0 && out->copyFirst + out->copyCount == block) {
+        out->copyCount++;
+        return;
+    }
+    flushCopy(out);
+    out->copyFirst = block;
+    out->copyCount = 1;
+    out->encoded += FT_DELTA_COPY_LEN;
+}
+
+/**
+ * Add the literal bytes of the file from start up to end. A short run
+ * is copied in among the operations; a longer one is left in the file
+ * and sent from there.
+ *
+ * @pre the window holds a short run
+ */
+static void addLiteral(DeltaOut *out, const FileWindow &w, size_t start,
+        size_t end) {
+    char field[FT_DELTA_LITERAL_LEN];
+
+    flushCopy(out);
+    field[0] = FT_DELTA_LITERAL;
+    putBigEndian(field + 1, end - start, 8);
+    out->ops.append(field, FT_DELTA_LITERAL_LEN);
+    if (end - start < DELTA_INLINE_MAX) {
+        out->ops.append((const char *)windowAt(w, start), end - start);
+    }
+    else {
+        LiteralRun run = { out->ops.length(), start, end - start };
+        out->runs.push_back(run);
+    }
+    out->encoded += FT_DELTA_LITERAL_LEN + (end - start);
+}
+
+/**
+ * Encode the operations that rebuild the file in w from the client's
+ * blocks, and finish the file's digest.
+ *
+ * @param limit most bytes the encoded delta may take
+ *
+ * @return false if the delta would take more than limit, or the file
+ *         could not be read
+ */
+static bool encodeDelta(FileWindow *w, size_t blockSize,
+        const vector<BlockSignature> &signatures, size_t limit,
+        DeltaOut *out) {
+    BlockIndex index;
+    indexBlocks(signatures, &index);
+
+    size_t size = w->size;
+    size_t literalStart = 0;
+    size_t pos = 0;
+    uint32_t a = 0;
+    uint32_t b = 0;
+    bool summed = false;  // a and b are the window at pos
+    uint32_t prev = NO_BLOCK;
+    const uint8_t *filter = index.filter.data();
+
+    out->ops.assign(FT_DELTA_DIGEST_LEN, '\0');  // Filled in at the end
+    out->encoded = FT_DELTA_DIGEST_LEN;
+
+    // n * out mod 65521 for each byte out, so a roll needs no division
+    uint32_t outTerm[256];
+    for (int i = 0; i < 256; i++)
+        outTerm[i] = (uint32_t)((blockSize % ADLER_MOD) * i % ADLER_MOD);
+
+    while (pos + blockSize <= size) {
+        // The block at pos and the byte after it, and a short literal
+        // run that ends here
+        size_t keep = pos - min(pos - literalStart, (size_t)DELTA_INLINE_MAX);
+        if (!readWindow(w, keep, min(pos + blockSize + 1, size)))
+            return false;
+        const unsigned char *window = windowAt(*w, pos);
+        if (!summed) {
+            uint32_t sum = adler32(1, window, blockSize);
+            a = sum & 0xffff;
+            b = sum >> 16;
+            summed = true;
+        }
+        uint32_t weak = (b << 16) | a;
+        uint32_t block = !filter[filterBit(weak)] ? NO_BLOCK
+            : findBlock(index, signatures, weak, window, blockSize, prev);
+        if (block != NO_BLOCK) {
+            if (pos > literalStart)
+                addLiteral(out, *w, literalStart, pos);
+            addCopy(out, block);
+            pos += blockSize;
+            literalStart = pos;
+            summed = false;
+            prev = block;
+            continue;
+        }
+
+        // No block starts here: the byte at pos is literal.
+        if (out->encoded + FT_DELTA_LITERAL_LEN + (pos + 1 - literalStart)
+                > limit)
+            return false;
+        if (pos + blockSize == size)
+            break;
+        unsigned char gone = window[0];
+        unsigned char in = window[blockSize];
+        a += ADLER_MOD + in - gone;  // Below 3 * 65521 throughout
+        while (a >= ADLER_MOD)
+            a -= ADLER_MOD;
+        b += 2 * ADLER_MOD + a - 1 - outTerm[gone];
+        while (b >= ADLER_MOD)
+            b -= ADLER_MOD;
+        pos++;
+    }
+
+    if (literalStart < size) {
+        size_t keep = min(literalStart, w->base + w->filled);
+        if (size - literalStart < DELTA_INLINE_MAX
+                && !readWindow(w, keep, size))
+            return false;
+        addLiteral(out, *w, literalStart, size);
+    }
+    flushCopy(out);
+    if (out->encoded > limit)
+        return false;
+
+    // The rest of the file, for its digest
+    while (w->base + w->filled < size) {
+        size_t at = w->base + w->filled;
+        if (!readWindow(w, at, min(size, at + w->buffer.size())))
+            return false;
+    }
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLength;
+    EVP_DigestFinal_ex(w->md5, digest, &digestLength);
+    out->ops.replace(0, FT_DELTA_DIGEST_LEN, (const char *)digest,
+            FT_DELTA_DIGEST_LEN);
+    return true;
+}
+
+/**
+ * Return a part of a delta that sends length bytes of the encoded
+ * operations from pos on.
+ */
+static Response opsPart(const shared_ptr<string> &ops, size_t pos,
+        size_t length) {
+    Response part;
+    part.data = ops->data() + pos;
+    part.length = length;
+    part.owner = ops;
+    return part;
+}
+
+/**
+ * Replace the whole-file body of response with its delta against the
+ * client's copy.
+ */
+bool deltaBody(const string &filename, size_t blockSize,
+        const vector<BlockSignature> &signatures, Response *response) {
+    size_t size = response->length;
+    if (signatures.empty() || size < blockSize)
+        return false;
+
+    // A cached mapping is scanned through its file all the same, so a
+    // truncation ends the read rather than faulting.
+    StageTimer timer(STAGE_DELTA);
+    bool opened = (response->fd == -1);  // Just for the delta
+    FileWindow w;
+    w.fd = opened ? cacheOpen(filename, *response) : response->fd;
+    if (w.fd == -1)
+        return false;
+    w.offset = response->offset;
+    w.size = size;
+    w.data = NULL;
+    w.base = 0;
+    w.filled = 0;
+    w.buffer.resize(max(2 * blockSize, blockSize + DELTA_WINDOW));
+    w.md5 = EVP_MD_CTX_new();
+    bool encoded = false;
+    DeltaOut out;
+    out.copyFirst = 0;
+    out.copyCount = 0;
+    if (w.md5 != NULL && EVP_DigestInit_ex(w.md5, EVP_md5(), NULL)) {
+        posix_fadvise(w.fd, w.offset, size, POSIX_FADV_SEQUENTIAL);
+        encoded = encodeDelta(&w, blockSize, signatures,
+                size / 100 * DELTA_MAX_PERCENT, &out);
+    }
+    EVP_MD_CTX_free(w.md5);
+    if (!encoded) {
+        if (opened)
+            close(w.fd);
+        return false;
+    }
+    addCounter(CTR_DELTAS, 1);
+    addCounter(CTR_DELTA_SAVED, size - out.encoded);
+
+    // The operations go out from memory, and the long literal runs
+    // between them from the file
+    shared_ptr<string> ops(new string());
+    ops->swap(out.ops);
+    shared_ptr<const void> file(new SharedFile(w.fd));
+    vector<Response> &parts = response->parts;
+    parts.reserve(2 * out.runs.size());
+    size_t head = out.runs.empty() ? ops->length() : out.runs[0].opsEnd;
+    size_t from = head;
+    for (size_t i = 0; i < out.runs.size(); i++) {
+        const LiteralRun &run = out.runs[i];
+        Response literal;
+        literal.fd = w.fd;
+        literal.fdShared = true;
+        literal.offset = w.offset + run.offset;
+        literal.length = run.length;
+        literal.owner = file;
+        parts.push_back(literal);
+
+        size_t to = (i + 1 < out.runs.size())
+            ? out.runs[i + 1].opsEnd : ops->length();
+        if (to > from)
+            parts.push_back(opsPart(ops, from, to - from));
+        from = to;
+    }
+    response->fd = -1;
+    response->offset = 0;
+    response->data = ops->data();
+    response->length = head;
+    response->owner = ops;
+    return true;
+}
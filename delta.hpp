@@ -0,0 +1,68 @@
+#ifndef DELTA_H
+#define DELTA_H
+/**
+ * File:    delta.hpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the interfaces of delta gets.
+ *
+ *          A client holding an older copy of a file splits it into
+ *          blocks and sends the signature of each whole block with its
+ *          get: a weak checksum (Adler-32) that can be rolled along the
+ *          file a byte at a time, and a strong hash (the first 8 bytes
+ *          of its MD5). The server slides a block-sized window over the
+ *          current file, looking each window's weak checksum up among the
+ *          client's blocks and confirming a hit with the strong hash. The
+ *          answer is the file as runs of the client's blocks and literal
+ *          bytes, so a small edit to a large file costs about a block
+ *          plus the literal bytes.
+ *
+ *          The file, even one in the hot-file cache, is scanned through
+ *          a window read into a buffer, and only the encoded operations
+ *          are held in memory: long literal runs are sent from the file
+ *          itself, as parts of the response between the operations, like
+ *          the members of a batch.
+ */
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+#include "ftserver.hpp"
+
+#define DELTA_MIN_BLOCK 512          // Smallest block a client may use
+#define DELTA_MAX_BLOCK (16 << 20)   // Largest block
+#define DELTA_MAX_BLOCKS 2048        // Most signatures in one get; they
+                                     // must fit in one command
+#define DELTA_SIG_HEX_LEN 24         // Hex digits of a weak and a strong sum
+#define DELTA_MAX_PERCENT 75         // Delta sent only if at most this
+                                     // percent of the file
+#define DELTA_WINDOW (1 << 20)       // File bytes read ahead of the block
+                                     // being matched
+#define DELTA_INLINE_MAX 256         // Shorter literal runs are copied in
+                                     // among the operations
+
+/**
+ * Parse the concatenated hex signatures of a delta get.
+ *
+ * @return false if text is not whole signatures, or too many
+ */
+bool parseSignatures(std::string_view text,
+        std::vector<BlockSignature> *signatures);
+
+/**
+ * Replace the whole-file body of response with its delta against the
+ * client's copy. Blocks; runs on the I/O pool.
+ *
+ * @param filename the file the body was read from
+ * @param blockSize the length of each of the client's blocks
+ * @param signatures the client's blocks, in file order
+ * @param response a response whose body is the whole file
+ *
+ * @return false if the body is left as it is: the delta would not be
+ *         enough smaller than the file, or the file could not be read
+ */
+bool deltaBody(const std::string &filename, size_t blockSize,
+        const std::vector<BlockSignature> &signatures, Response *response);
+
+#endif
@@ -0,0 +1,161 @@
+/**
+ * File:    dirindex.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the implementation of the directory index.
+ *
+ *          The watch is added before the initial scan, so every change
+ *          after the scan is seen by the inotify thread; applying a
+ *          create or delete twice is harmless. Listings are rebuilt
+ *          lazily by the first "list" after a change, so a burst of
+ *          changes costs one rebuild, not one per event.
+ */
+#include <string>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <unistd.h>
+#include <dirent.h>         // directory services
+#include <sys/inotify.h>
+#include "dirindex.hpp"
+#include "protocol.hpp"
+#include "logger.hpp"
+#include "upload.hpp"
+using namespace std;
+
+static mutex indexLock;
+static unordered_set<string> names;  // Every entry in the directory,
+                                     // but uploads not yet renamed
+
+// Prebuilt listings; NULL until the next request after a change
+static shared_ptr<const string> legacyListing;
+static shared_ptr<const string> framedListing;
+
+/**
+ * Replace the index with a fresh scan of the current directory.
+ *
+ * @pre indexLock is held
+ */
+static void rescan() {
+    struct dirent *dirStream;
+    DIR *thisDir = opendir(".");
+    if (!thisDir) {
+        logErrno("Opendir");
+        return;
+    }
+
+    names.clear();
+    while ((dirStream = readdir(thisDir)) != NULL) {
+        if (!uploadTempName(dirStream->d_name))
+            names.insert(dirStream->d_name);
+    }
+    closedir(thisDir);
+
+    legacyListing.reset();
+    framedListing.reset();
+}
+
+/**
+ * Apply one batch of inotify events.
+ */
+static void applyEvents(const char *buf, ssize_t len) {
+    lock_guard<mutex> guard(indexLock);
+    const struct inotify_event *event;
+
+    for (const char *p = buf; p < buf + len;
+            p += sizeof(struct inotify_event) + event->len) {
+        event = (const struct inotify_event *)p;
+        if (event->mask & IN_Q_OVERFLOW) {  // Events were lost
+            rescan();
+            continue;
+        }
+        if (event->len == 0 || uploadTempName(event->name))
+            continue;
+        if (event->mask & (IN_CREATE | IN_MOVED_TO))
+            names.insert(event->name);
+        else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+            names.erase(event->name);
+    }
+    legacyListing.reset();
+    framedListing.reset();
+}
+
+/**
+ * Inotify thread body: apply changes until the descriptor fails.
+ */
+static void watchDirectory(int fd) {
+    // Aligned as inotify_event requires
+    static char buf[INOTIFY_BUF_LEN]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (true) {
+        ssize_t len = read(fd, buf, sizeof buf);
+        if (len == -1) {
+            logErrno("inotify read");
+            return;
+        }
+        applyEvents(buf, len);
+    }
+}
+
+/**
+ * Scan the current directory and start watching it.
+ *
+ * @return false if inotify is unavailable
+ */
+bool startDirIndex() {
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd == -1) {
+        logErrno("inotify_init1");
+        return false;
+    }
+    if (inotify_add_watch(fd, ".",
+                IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) == -1) {
+        logErrno("inotify_add_watch");
+        close(fd);
+        return false;
+    }
+
+    {
+        lock_guard<mutex> guard(indexLock);
+        rescan();
+    }
+    thread(watchDirectory, fd).detach();
+    return true;
+}
+
+/**
+ * Search the index for name
+ */
+bool dirIndexContains(const string &name) {
+    lock_guard<mutex> guard(indexLock);
+    return names.count(name) > 0;
+}
+
+/**
+ * Return the serialized listing of the current directory
+ */
+shared_ptr<const string> dirIndexListing(int proto) {
+    lock_guard<mutex> guard(indexLock);
+    shared_ptr<const string> &listing =
+        (proto == PROTO_FRAMED) ? framedListing : legacyListing;
+
+    if (!listing) {
+        shared_ptr<string> built(new string());
+        for (unordered_set<string>::const_iterator it = names.begin();
+                it != names.end(); ++it) {
+            if (proto == PROTO_FRAMED) {
+                built->append(*it);
+                built->push_back('\0');
+            }
+            else {
+                built->append("<item>");
+                built->append(*it);
+                built->append("</item>");
+            }
+        }
+        listing = built;
+    }
+    return listing;
+}
@@ -0,0 +1,48 @@
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+/**
+ * File:    dirindex.hpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the interfaces of the directory index.
+ *
+ *          The index holds the names in the current directory in a hash
+ *          set and keeps the serialized "list" responses prebuilt, so
+ *          neither a "get" nor a "list" scans the directory. An inotify
+ *          thread applies creates, deletes and renames as they happen.
+ */
+#include <string>
+#include <memory>
+
+// Inotify events read per read() call
+#define INOTIFY_BUF_LEN (64 * 1024)
+
+/**
+ * Scan the current directory and start watching it.
+ *
+ * @return false if inotify is unavailable; lookups then scan the
+ *         directory on every call
+ */
+bool startDirIndex();
+
+/**
+ * Search the index for name
+ *
+ * @param name a file or directory name
+ *
+ * @return if name exists in the current directory
+ */
+bool dirIndexContains(const std::string &name);
+
+/**
+ * Return the serialized listing of the current directory
+ *
+ * @param proto the protocol version negotiated on the connection
+ *
+ * @return tag-delimited (protocol 1) or NUL-terminated (protocol 2)
+ *         names. The buffer is immutable and shared between requests.
+ */
+std::shared_ptr<const std::string> dirIndexListing(int proto);
+
+#endif
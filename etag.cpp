@@ -0,0 +1,404 @@
+/**
+ * File:    etag.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the implementation of file content hashes.
+ *
+ *          XXH64 consumes 32-byte stripes in four independent lanes, so
+ *          the multiplies of one stripe overlap in the pipeline and it
+ *          runs at several GB/s without SIMD. Files are hashed a buffer
+ *          at a time as they are read, with the hash state carried
+ *          between reads, so memory use does not grow with the file and
+ *          a file truncated meanwhile only ends the read early. A file in
+ *          the hot-file cache is read the same way, not through its
+ *          mapping, which would raise SIGBUS on a truncation instead.
+ *
+ *          The cache is keyed by device and inode. An entry whose size
+ *          or mtime no longer match the file is a stale version, and is
+ *          replaced when the file is hashed again.
+ */
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "etag.hpp"
+#include "logger.hpp"
+#include "filecache.hpp"
+using namespace std;
+
+#define HASH_READ_LEN (1 << 16)  // Bytes of a file read per pread()
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+// The version of a file a hash was computed for
+struct FileVersion {
+    off_t size;
+    struct timespec mtime;
+    uint64_t etag;
+};
+
+// (device, inode) of a file
+typedef pair<dev_t, ino_t> FileId;
+
+struct FileIdHash {
+    size_t operator()(const FileId &id) const {
+        return hash<unsigned long long>()(
+                ((unsigned long long)id.first << 32) ^ id.second);
+    }
+};
+
+static mutex etagLock;
+static unordered_map<FileId, FileVersion, FileIdHash> versions;
+
+static atomic<unsigned long long> hits(0);
+static atomic<unsigned long long> misses(0);
+static atomic<unsigned long long> bytesHashed(0);
+
+// An XXH64 hash in progress: its four lanes, and the bytes of a stripe
+// not yet complete
+struct HashState {
+    uint64_t v1, v2, v3, v4;
+    uint64_t total;               // Bytes added so far
+    unsigned char stripe[32];
+    size_t buffered;              // Bytes in stripe
+};
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof v);  // Little-endian hosts only, like XXH64's spec
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline uint64_t xxRound(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t xxMerge(uint64_t acc, uint64_t lane) {
+    acc ^= xxRound(0, lane);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+/**
+ * Start an XXH64 hash, with seed 0.
+ */
+static void hashStart(HashState *state) {
+    state->v1 = PRIME64_1 + PRIME64_2;
+    state->v2 = PRIME64_2;
+    state->v3 = 0;
+    state->v4 = 0 - PRIME64_1;
+    state->total = 0;
+    state->buffered = 0;
+}
+
+/**
+ * Fold the whole 32-byte stripes from p up to end into the lanes of
+ * state, returning the first byte not consumed.
+ */
+static const unsigned char *hashStripes(HashState *state,
+        const unsigned char *p, const unsigned char *end) {
+    uint64_t v1 = state->v1;
+    uint64_t v2 = state->v2;
+    uint64_t v3 = state->v3;
+    uint64_t v4 = state->v4;
+
+    for (; p + 32 <= end; p += 32) {
+        v1 = xxRound(v1, read64(p));
+        v2 = xxRound(v2, read64(p + 8));
+        v3 = xxRound(v3, read64(p + 16));
+        v4 = xxRound(v4, read64(p + 24));
+    }
+    state->v1 = v1;
+    state->v2 = v2;
+    state->v3 = v3;
+    state->v4 = v4;
+    return p;
+}
+
+/**
+ * Add length bytes at data to the hash. A partial stripe is held in
+ * state until the next call completes it.
+ */
+static void hashUpdate(HashState *state, const void *data, size_t length) {
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + length;
+
+    state->total += length;
+    if (state->buffered > 0) {
+        size_t take = 32 - state->buffered;
+        if (take > length)
+            take = length;
+        memcpy(state->stripe + state->buffered, p, take);
+        state->buffered += take;
+        p += take;
+        if (state->buffered < 32)
+            return;
+        hashStripes(state, state->stripe, state->stripe + 32);
+        state->buffered = 0;
+    }
+    p = hashStripes(state, p, end);
+    memcpy(state->stripe, p, end - p);
+    state->buffered = end - p;
+}
+
+/**
+ * Return the hash of every byte added to state.
+ */
+static uint64_t hashDigest(const HashState *state) {
+    const unsigned char *p = state->stripe;
+    const unsigned char *end = p + state->buffered;
+    uint64_t h;
+
+    if (state->total >= 32) {
+        h = rotl64(state->v1, 1) + rotl64(state->v2, 7)
+            + rotl64(state->v3, 12) + rotl64(state->v4, 18);
+        h = xxMerge(h, state->v1);
+        h = xxMerge(h, state->v2);
+        h = xxMerge(h, state->v3);
+        h = xxMerge(h, state->v4);
+    }
+    else {
+        h = PRIME64_5;
+    }
+    h += state->total;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxRound(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    // Avalanche
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/**
+ * Return the XXH64 hash, with seed 0, of length bytes at data.
+ */
+uint64_t contentHash(const void *data, size_t length) {
+    HashState state;
+    hashStart(&state);
+    hashUpdate(&state, data, length);
+    return hashDigest(&state);
+}
+
+/**
+ * Return if version describes the file stat'ed into info.
+ */
+static bool versionCurrent(const FileVersion &version,
+        const struct stat &info) {
+    return version.size == info.st_size
+        && version.mtime.tv_sec == info.st_mtim.tv_sec
+        && version.mtime.tv_nsec == info.st_mtim.tv_nsec;
+}
+
+/**
+ * Look up the cached ETag of the file stat'ed into info.
+ */
+static bool lookupVersion(const struct stat &info, uint64_t *etag) {
+    lock_guard<mutex> guard(etagLock);
+    unordered_map<FileId, FileVersion, FileIdHash>::iterator found =
+        versions.find(FileId(info.st_dev, info.st_ino));
+    if (found == versions.end() || !versionCurrent(found->second, info))
+        return false;
+    *etag = found->second.etag;
+    return true;
+}
+
+/**
+ * Look up the ETag of filename's current contents without reading them.
+ *
+ * @return false if this version of the file has not been hashed yet
+ */
+bool cachedETag(const string &filename, uint64_t *etag) {
+    struct stat info;
+
+    if (stat(filename.c_str(), &info) == -1 || !S_ISREG(info.st_mode))
+        return false;
+    if (lookupVersion(info, etag)) {
+        hits++;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Hash the size bytes of the file open as fd, reading them through one
+ * buffer. A file cut short while it is read hashes what was there; its
+ * changed size keeps that hash out of the cache.
+ */
+static uint64_t hashFile(int fd, off_t size) {
+    char buffer[HASH_READ_LEN];
+    HashState state;
+    off_t pos = 0;
+
+    hashStart(&state);
+    posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+    while (pos < size) {
+        size_t want = sizeof buffer;
+        if ((off_t)want > size - pos)
+            want = size - pos;
+        ssize_t n = pread(fd, buffer, want, pos);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            logErrno("Read for ETag");
+            break;
+        }
+        if (n == 0)
+            break;
+        hashUpdate(&state, buffer, n);
+        pos += n;
+    }
+    return hashDigest(&state);
+}
+
+/**
+ * Return the ETag of the size bytes of the file open as fd, hashing it
+ * and caching the result unless its current version is cached already.
+ */
+static uint64_t fdETag(int fd, off_t size) {
+    struct stat before;
+    struct stat after;
+    uint64_t etag;
+
+    bool statted = fstat(fd, &before) == 0;
+    if (statted && lookupVersion(before, &etag)) {
+        hits++;
+        return etag;
+    }
+    misses++;
+
+    etag = hashFile(fd, size);
+    bytesHashed += size;
+
+    // Cache it only if the file did not change while it was read.
+    if (!statted || fstat(fd, &after) == -1
+            || after.st_ino != before.st_ino
+            || after.st_size != before.st_size
+            || after.st_mtim.tv_sec != before.st_mtim.tv_sec
+            || after.st_mtim.tv_nsec != before.st_mtim.tv_nsec)
+        return etag;
+
+    lock_guard<mutex> guard(etagLock);
+    FileId id(before.st_dev, before.st_ino);
+    if (versions.size() >= ETAG_CACHE_MAX && !versions.count(id))
+        versions.erase(versions.begin());
+    FileVersion &version = versions[id];
+    version.size = before.st_size;
+    version.mtime = before.st_mtim;
+    version.etag = etag;
+    return etag;
+}
+
+/**
+ * Return the ETag of the file body of response, hashing it and caching
+ * the result unless its current version is cached already.
+ */
+uint64_t responseETag(const string &filename, const Response &response) {
+    if (response.fd != -1)
+        return fdETag(response.fd, response.offset + response.length);
+
+    // A cached mapping is hashed through its file all the same, so a
+    // truncation ends the read rather than faulting. A file changed
+    // since it was mapped is hashed as it is now.
+    int fd = cacheOpen(filename, response);
+    if (fd == -1)
+        fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        logErrno("Open for ETag");
+        return 0;
+    }
+    uint64_t etag = fdETag(fd, response.length);
+    close(fd);
+    return etag;
+}
+
+/**
+ * Return etag as ETAG_HEX_LEN lowercase hex digits.
+ */
+string etagHex(uint64_t etag) {
+    static const char digits[] = "0123456789abcdef";
+    string hex(ETAG_HEX_LEN, '0');
+    for (int i = ETAG_HEX_LEN - 1; i >= 0; i--) {
+        hex[i] = digits[etag & 0xf];
+        etag >>= 4;
+    }
+    return hex;
+}
+
+/**
+ * Parse the hex form of an ETag.
+ *
+ * @return false if text is not ETAG_HEX_LEN hex digits
+ */
+bool parseETag(string_view text, uint64_t *etag) {
+    uint64_t value = 0;
+
+    if (text.length() != ETAG_HEX_LEN)
+        return false;
+    for (size_t i = 0; i < text.length(); i++) {
+        char c = text[i];
+        int digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else
+            return false;
+        value = (value << 4) | digit;
+    }
+    *etag = value;
+    return true;
+}
+
+/**
+ * Return the ETag cache counters as "name value" lines.
+ */
+string etagStats() {
+    size_t count;
+    {
+        lock_guard<mutex> guard(etagLock);
+        count = versions.size();
+    }
+    return "etag_hits " + to_string(hits.load()) + "\n"
+        + "etag_misses " + to_string(misses.load()) + "\n"
+        + "etag_bytes_hashed " + to_string(bytesHashed.load()) + "\n"
+        + "etag_entries " + to_string((unsigned long long)count) + "\n";
+}
@@ -0,0 +1,68 @@
+#ifndef ETAG_H
+#define ETAG_H
+/**
+ * File:    etag.hpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the interfaces of file content hashes
+ *          (ETags).
+ *
+ *          A file's ETag is the 64-bit xxHash (XXH64) of its contents.
+ *          Hashing a file means reading all of it, so each hash is
+ *          cached against the version of the file it was computed for:
+ *          its device, inode, size and mtime. A later request for the
+ *          same version is answered from the cache with one stat(), and
+ *          a changed file is hashed again.
+ *
+ *          A client that already holds a file sends the ETag it knows
+ *          with its get command; if it still matches, the server answers
+ *          "not modified" without opening the file.
+ */
+#include <string>
+#include <string_view>
+#include <stdint.h>
+#include "ftserver.hpp"
+
+#define ETAG_CACHE_MAX 65536  // File versions whose hash is cached
+#define ETAG_HEX_LEN 16       // Hex digits of an ETag
+
+/**
+ * Return the XXH64 hash, with seed 0, of length bytes at data.
+ */
+uint64_t contentHash(const void *data, size_t length);
+
+/**
+ * Look up the ETag of filename's current contents without reading them.
+ *
+ * @return false if this version of the file has not been hashed yet
+ */
+bool cachedETag(const std::string &filename, uint64_t *etag);
+
+/**
+ * Return the ETag of the file body of response, hashing it and caching
+ * the result unless its current version is cached already.
+ *
+ * @param filename the file the body was read from
+ * @param response a response whose body is the whole file
+ */
+uint64_t responseETag(const std::string &filename, const Response &response);
+
+/**
+ * Return etag as ETAG_HEX_LEN lowercase hex digits.
+ */
+std::string etagHex(uint64_t etag);
+
+/**
+ * Parse the hex form of an ETag.
+ *
+ * @return false if text is not ETAG_HEX_LEN hex digits
+ */
+bool parseETag(std::string_view text, uint64_t *etag);
+
+/**
+ * Return the ETag cache counters as "name value" lines.
+ */
+std::string etagStats();
+
+#endif
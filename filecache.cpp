@@ -0,0 +1,228 @@
+/**
+ * File:    filecache.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the implementation of the hot-file cache.
+ *
+ *          Entries are reference counted: a response being sent holds
+ *          its entry, so an entry evicted or invalidated mid-transfer is
+ *          unmapped only once the transfer is done.
+ */
+#include <cstdio>
+#include <string>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "filecache.hpp"
+#include "logger.hpp"
+using namespace std;
+
+// One cached file. The mapping lives as long as the entry.
+struct CacheEntry {
+    string name;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    void *map;
+
+    ~CacheEntry() {
+        munmap(map, size);
+    }
+};
+
+typedef list< shared_ptr<CacheEntry> > LruList;  // Front is most recent
+
+static mutex cacheLock;
+static size_t budget = (size_t)DEFAULT_CACHE_MB << 20;
+static size_t used = 0;    // Bytes mapped by cached entries
+static LruList lru;
+static unordered_map<string, LruList::iterator> entries;
+
+static atomic<unsigned long long> hits(0);
+static atomic<unsigned long long> misses(0);
+static atomic<unsigned long long> evictions(0);
+static atomic<unsigned long long> invalidations(0);
+
+/**
+ * Set the cache budget. A budget of 0 disables the cache.
+ */
+void setCacheBudget(size_t bytes) {
+    lock_guard<mutex> guard(cacheLock);
+    budget = bytes;
+}
+
+/**
+ * Drop the entry at it from the cache.
+ *
+ * @pre cacheLock is held
+ */
+static void dropEntry(LruList::iterator it) {
+    used -= (*it)->size;
+    entries.erase((*it)->name);
+    lru.erase(it);
+}
+
+/**
+ * Map the file behind fd as a new cache entry.
+ *
+ * @return the entry, or NULL if it cannot be mapped
+ */
+static shared_ptr<CacheEntry> mapEntry(const string &name, int fd,
+        const struct stat &info) {
+    void *map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        logErrno("mmap");
+        return shared_ptr<CacheEntry>();
+    }
+    // Fault the file in now rather than during the first send
+    madvise(map, info.st_size, MADV_WILLNEED);
+
+    shared_ptr<CacheEntry> entry(new CacheEntry());
+    entry->name = name;
+    entry->dev = info.st_dev;
+    entry->ino = info.st_ino;
+    entry->size = info.st_size;
+    entry->mtime = info.st_mtim;
+    entry->map = map;
+    return entry;
+}
+
+/**
+ * Return if entry still describes the file stat'ed into info.
+ */
+static bool entryCurrent(const CacheEntry &entry, const struct stat &info) {
+    return entry.dev == info.st_dev && entry.ino == info.st_ino
+        && entry.size == info.st_size
+        && entry.mtime.tv_sec == info.st_mtim.tv_sec
+        && entry.mtime.tv_nsec == info.st_mtim.tv_nsec;
+}
+
+/**
+ * Point response at the mapped contents of entry.
+ */
+static void fillResponse(const shared_ptr<CacheEntry> &entry,
+        Response *response) {
+    response->fd = -1;
+    response->data = (const char *)entry->map;
+    response->length = entry->size;
+    response->owner = entry;
+}
+
+/**
+ * Fill response with the cached contents of filename, caching the file
+ * if it is not cached yet.
+ */
+bool cacheLookup(const string &filename, Response *response) {
+    struct stat info;
+
+    if (stat(filename.c_str(), &info) == -1 || !S_ISREG(info.st_mode))
+        return false;
+
+    {
+        lock_guard<mutex> guard(cacheLock);
+        if (budget == 0)
+            return false;
+
+        unordered_map<string, LruList::iterator>::iterator found =
+            entries.find(filename);
+        if (found != entries.end()) {
+            LruList::iterator it = found->second;
+            if (entryCurrent(**it, info)) {
+                lru.splice(lru.begin(), lru, it);  // Now most recent
+                fillResponse(*it, response);
+                hits++;
+                return true;
+            }
+            dropEntry(it);  // File changed since it was cached
+            invalidations++;
+        }
+        misses++;
+
+        // Empty files cannot be mapped; huge ones would flush the cache.
+        if (info.st_size == 0
+                || (size_t)info.st_size > budget / CACHE_ENTRY_SHARE)
+            return false;
+    }
+
+    // Map outside the lock; opening the file can block on the disk.
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode)
+            || info.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    shared_ptr<CacheEntry> entry = mapEntry(filename, fd, info);
+    close(fd);  // The mapping keeps the file
+    if (!entry)
+        return false;
+
+    lock_guard<mutex> guard(cacheLock);
+    unordered_map<string, LruList::iterator>::iterator found =
+        entries.find(filename);
+    if (found != entries.end())  // Another thread cached it meanwhile
+        dropEntry(found->second);
+
+    lru.push_front(entry);
+    entries[filename] = lru.begin();
+    used += entry->size;
+    while (used > budget && !lru.empty()) {
+        dropEntry(--lru.end());
+        evictions++;
+    }
+
+    fillResponse(entry, response);
+    return true;
+}
+
+/**
+ * Open the file whose cached mapping is the body of response, to read
+ * it with pread().
+ */
+int cacheOpen(const string &filename, const Response &response) {
+    struct stat info;
+
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &info) == 0) {
+        lock_guard<mutex> guard(cacheLock);
+        unordered_map<string, LruList::iterator>::iterator found =
+            entries.find(filename);
+        if (found != entries.end()
+                && found->second->get() == response.owner.get()
+                && entryCurrent(**found->second, info))
+            return fd;
+    }
+    close(fd);
+    return -1;
+}
+
+/**
+ * Return the cache counters as "name value" lines.
+ */
+string cacheStats() {
+    size_t bytes, count, limit;
+    {
+        lock_guard<mutex> guard(cacheLock);
+        bytes = used;
+        count = entries.size();
+        limit = budget;
+    }
+    return "cache_hits " + to_string(hits.load()) + "\n"
+        + "cache_misses " + to_string(misses.load()) + "\n"
+        + "cache_evictions " + to_string(evictions.load()) + "\n"
+        + "cache_invalidations " + to_string(invalidations.load()) + "\n"
+        + "cache_entries " + to_string((unsigned long long)count) + "\n"
+        + "cache_bytes " + to_string((unsigned long long)bytes) + "\n"
+        + "cache_budget_bytes " + to_string((unsigned long long)limit) + "\n";
+}
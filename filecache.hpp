@@ -0,0 +1,59 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+/**
+ * File:    filecache.hpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the interfaces of the hot-file cache.
+ *
+ *          Frequently requested files are kept mmap'd, up to a memory
+ *          budget, and evicted least recently used first. A hit sends
+ *          straight from the mapping with no read syscalls. Entries are
+ *          validated against the file's inode, size and mtime on every
+ *          lookup, so a changed file is never served stale.
+ */
+#include <string>
+#include "ftserver.hpp"
+
+#define DEFAULT_CACHE_MB 64  // Default cache budget
+#define CACHE_ENTRY_SHARE 8  // No file larger than budget / this is cached
+
+/**
+ * Set the cache budget. A budget of 0 disables the cache.
+ *
+ * @param bytes memory budget in bytes
+ */
+void setCacheBudget(size_t bytes);
+
+/**
+ * Fill response with the cached contents of filename, caching the file
+ * if it is not cached yet.
+ *
+ * @param filename The relative path of the file to send
+ * @param response receives the mapped body on success
+ *
+ * @return false if the file is not (and will not be) cached; the
+ *         caller then streams it from disk
+ */
+bool cacheLookup(const std::string &filename, Response *response);
+
+/**
+ * Open the file whose cached mapping is the body of response, to read
+ * it with pread(). Reading the mapping itself raises SIGBUS if the file
+ * is truncated meanwhile; pread() only comes up short.
+ *
+ * @param filename The relative path the body was looked up by
+ * @param response a response filled by cacheLookup()
+ *
+ * @return a descriptor of the version that was mapped, or -1 if the
+ *         file has changed or its entry has left the cache since
+ */
+int cacheOpen(const std::string &filename, const Response &response);
+
+/**
+ * Return the cache counters as "name value" lines.
+ */
+std::string cacheStats();
+
+#endif
@@ -5,6 +5,8 @@
 This module connects to the ftserver and reads contents of server directory
 or transfers a text file.
 
+ftclient.py also uploads a file to the server with -p.
+
 ftclient.py uses 2 tcp connections: 1 to connect to server and send a command, 
 the other, to accept the server data connection on a specified port.
 
@@ -14,12 +16,24 @@ Example:
 """
 import argparse
 import socket
+import struct
 import re
+import time
+import os
+import threading
+import zlib
+import hashlib
 
 #Command identifiers. Go inside html style <\> tags to be sent to server. 
 MAX_RECV = 8096
 GET_COMMAND = "g"
 LIST_COMMAND = "l"
+BATCH_COMMAND = "b"
+BATCH_SEPARATOR = "/"
+PUT_COMMAND = "p"
+SIZE_TAG = "size"
+STORED_TAG = "stored"
+BUSY_TAG = "busy"
 OK_TAG = "ok"
 FILE_TAG = "file"
 ERROR_TAG = "error"
@@ -27,6 +41,49 @@ LIST_TAG = "list"
 ITEM_TAG = "item"
 NAME_TAG = "name"
 DATA_TAG = "data"
+PROTO_TAG = "proto"
+READY_TAG = "ready"
+ETAG_TAG = "etag"
+ENCODING_TAG = "encoding"
+SIGNATURES_TAG = "sigs"
+BLOCKSIZE_TAG = "blocksize"
+NOT_MODIFIED_TAG = "notmodified"
+CURSOR_TAG = "cursor"
+LIMIT_TAG = "limit"
+PREFIX_TAG = "prefix"
+MATCH_TAG = "match"
+STAT_TAG = "stat"
+OFFSET_TAG = "offset"
+LENGTH_TAG = "length"
+
+# Protocol 2 response header: magic, version, status, name length, flags,
+# content length (big-endian). See protocol.hpp.
+PROTO_FRAMED = 2
+FRAME_HEADER = struct.Struct('>2sBBHHQ')
+STATUS_FILE = 0
+STATUS_LIST = 1
+STATUS_ERROR = 2
+STATUS_NOT_MODIFIED = 3
+STATUS_BATCH_END = 4
+STATUS_STORED = 5
+STATUS_BUSY = 6
+STATUS_DELTA = 7
+FLAG_ETAG = 0x1
+FLAG_CURSOR = 0x2
+FLAG_STAT = 0x4
+FLAG_RANGE = 0x8
+FLAG_GZIP = 0x10
+FLAG_CHUNKED = 0x20
+CHUNK = struct.Struct('>I')
+ETAG = struct.Struct('>Q')
+CURSOR = struct.Struct('>Q')
+ENTRY_STAT = struct.Struct('>QQ')
+RANGE = struct.Struct('>QQ')
+DELTA_COPY = struct.Struct('>II')
+DELTA_LITERAL = struct.Struct('>Q')
+DELTA_DIGEST_LEN = 16
+DELTA_MIN_BLOCK = 1024   # Smallest block signed for a delta get
+DELTA_MAX_BLOCKS = 2048  # Most blocks the server takes signatures of
 
 def main():
     # get valid command line input
@@ -41,10 +98,45 @@ def main():
     # Verify Server address and contact server
     initContact(args, cntrl)
 
+    # Ask for binary framing unless told to speak the old protocol
+    proto = 1
+    if not args.legacy:
+        proto = negotiateProtocol(cntrl)
+
     # Create formatted command message
     commandMSG = parseCommand(args)
 
+    # Striped and resumed gets open a connection pair per stream
+    if args.g and (args.streams > 1 or args.resume):
+        if proto != PROTO_FRAMED:
+            print("Striped and resumed gets need protocol 2.")
+            exit(1)
+        cntrl.close()
+        stripedGet(args)
+        exit(0)
+
+    # A put sends its body once the server connects
+    if args.p:
+        openDataListener(dataSocket, args)
+        sendCommand(cntrl, commandMSG +
+            '<' + READY_TAG + '>' + str(args.DATA_PORT) + '</' + READY_TAG + '>')
+        putFile(dataSocket, args, proto)
+        cntrl.close()
+        dataSocket.close()
+        exit(0)
+
     # Open TCP client socket conn with server
+    if proto == PROTO_FRAMED:
+        # Listen first, so the server's first connect succeeds, and
+        # say so; the server otherwise retries until we listen.
+        openDataListener(dataSocket, args)
+        sendCommand(cntrl, commandMSG +
+            '<' + READY_TAG + '>' + str(args.DATA_PORT) + '</' + READY_TAG + '>')
+        receiveFramed(dataSocket, args)
+        cntrl.close()
+        dataSocket.close()
+        exit(0)
+
     sendCommand(cntrl, commandMSG)
 
     # Open TCP server socket on specified port.
@@ -90,6 +182,67 @@ def cliHandler():
         metavar='FILENAME',
         type=str,
         help='retrieve <FILENAME> from server')
+
+    # A batch: several files, or a glob, over one data connection
+    group.add_argument(
+        '-b',
+        metavar='FILENAME',
+        type=str,
+        nargs='+',
+        help='retrieve every <FILENAME>, or the files matching a glob')
+
+    # Upload: the body follows on the data connection
+    group.add_argument(
+        '-p',
+        metavar='FILENAME',
+        type=str,
+        help='store local <FILENAME> on the server')
+
+    parser.add_argument('--no-size', action='store_true',
+        help='with -p, do not send the file size; the body ends when '
+             'the client shuts down its side of the data connection')
+
+    parser.add_argument(
+        '--legacy',
+        action='store_true',
+        help='use the tag-delimited protocol 1 responses')
+
+    # With no value, only ask for the file's ETag
+    parser.add_argument(
+        '--etag',
+        metavar='ETAG',
+        nargs='?',
+        const='',
+        help='print the file\'s ETag; with ETAG, skip the transfer if '
+             'the server\'s copy is unchanged')
+
+    parser.add_argument('--gzip', action='store_true',
+        help='with -g, let the server send the file gzip compressed')
+    parser.add_argument('--delta', action='store_true',
+        help='with -g, get only what changed from the local copy')
+
+    # Byte ranges of a get
+    parser.add_argument('--offset', type=int,
+        help='with -g, get the file from byte OFFSET on')
+    parser.add_argument('--length', type=int,
+        help='with -g, get at most LENGTH bytes')
+    parser.add_argument('--streams', type=int, default=1,
+        help='with -g, get disjoint ranges over STREAMS connections at '
+             'once, on data ports DATA_PORT to DATA_PORT + STREAMS - 1')
+    parser.add_argument('--resume', action='store_true',
+        help='with -g, get only what the local copy is missing')
+
+    # Paged listings: any of these makes "-l" return one page
+    parser.add_argument('--limit', type=int,
+        help='with -l, list at most LIMIT names')
+    parser.add_argument('--cursor', type=str,
+        help='with -l, continue the listing where the last page ended')
+    parser.add_argument('--prefix', type=str,
+        help='with -l, list only names starting with PREFIX')
+    parser.add_argument('--match', type=str,
+        help='with -l, list only names matching glob MATCH')
+    parser.add_argument('--long', action='store_true',
+        help='with -l, show the size and mtime of each entry')
     
     args = parser.parse_args()
    
@@ -136,6 +289,413 @@ def sendCommand(s, commandMSG):
             print("Socket Exception")
             exit(1)
 
+# Request protocol 2 framing on the control connection
+# @param s the connected control socket
+# @return the protocol version the server agreed to
+def negotiateProtocol(s):
+    s.sendall('<' + PROTO_TAG + '>' + str(PROTO_FRAMED) + '</' + PROTO_TAG + '>')
+    reply = ''
+    # Servers without protocol 2 never answer
+    s.settimeout(2)
+    try:
+        while ('</' + PROTO_TAG + '>') not in reply:
+            received = s.recv(64)
+            if not received:
+                break
+            reply += received
+    except socket.timeout:
+        pass
+    s.settimeout(None)
+    if ('<' + BUSY_TAG + '>') in reply:
+        print("Server busy; try again later.")
+        s.close()
+        exit(1)
+    version = parseTag(PROTO_TAG, reply) if PROTO_TAG in reply else None
+    if version and version[0] == str(PROTO_FRAMED):
+        return PROTO_FRAMED
+    return 1
+
+# Read exactly n bytes from s
+# @return the bytes, or fewer if the server closed the connection
+def recvExactly(s, n):
+    chunks = []
+    while n > 0:
+        received = s.recv(min(n, MAX_RECV))
+        if not received:
+            break
+        chunks.append(received)
+        n -= len(received)
+    return ''.join(chunks)
+
+# Open the data listener on DATA_PORT
+# @param dataSocket tcp socket object
+# @param args contains all commandline arguments
+def openDataListener(dataSocket, args):
+    host = socket.gethostname()
+    try:
+        dataSocket.bind((host, int(args.DATA_PORT)))
+    except socket.error as e:
+        print("Socket error: " + str(e))
+        exit(1)
+    dataSocket.listen(1)
+
+# Accept the server data connection and handle one protocol 2 response.
+# File bodies are streamed to disk; nothing is buffered whole.
+# @param dataSocket listening tcp socket object
+# @param args contains all commandline arguments
+def receiveFramed(dataSocket, args):
+    data, serverAddr = dataSocket.accept()
+    if args.b:
+        receiveBatch(data, args)
+        data.close()
+        return
+
+    raw = recvExactly(data, FRAME_HEADER.size)
+    if len(raw) < FRAME_HEADER.size:
+        print("No response from server.")
+        return
+    magic, version, status, nameLen, flags, length = FRAME_HEADER.unpack(raw)
+    if magic != 'FT' or version != PROTO_FRAMED:
+        print("Server Message is in an unrecognized format")
+        return
+    name = recvExactly(data, nameLen)
+    if flags & FLAG_ETAG:
+        etag = ETAG.unpack(recvExactly(data, ETAG.size))[0]
+        print "ETag: %016x" % etag
+    offset = None
+    if flags & FLAG_RANGE:
+        offset, fileSize = RANGE.unpack(recvExactly(data, RANGE.size))
+
+    if status == STATUS_NOT_MODIFIED:
+        print "\"" + name + "\" not modified."
+    elif status == STATUS_DELTA:
+        print "Receiving changes to \"" + args.g + "\" from", args.SERVER_HOST + ":" + args.DATA_PORT
+        received = length
+        written = applyDelta(data, name, length, args.blockSize)
+        if written:
+            print ("Delta transfer complete: " + str(received) +
+                " bytes received for " + str(written) + " byte file.")
+    elif status == STATUS_FILE:
+        print "Receiving \"" + args.g + "\" from", args.SERVER_HOST + ":" + args.DATA_PORT
+        if offset is None:
+            newFile = open(name, 'wb')
+        else:
+            # A range lands in place in the local copy
+            newFile = openInPlace(name)
+            newFile.seek(offset)
+        # A gzip body is inflated as it arrives
+        inflater = zlib.decompressobj(16 + zlib.MAX_WBITS) \
+            if flags & FLAG_GZIP else None
+        chunked = flags & FLAG_CHUNKED
+        while True:
+            if chunked:
+                # Each chunk carries its length; an empty one ends the body
+                raw = recvExactly(data, CHUNK.size)
+                if len(raw) < CHUNK.size:
+                    break
+                length = CHUNK.unpack(raw)[0]
+                if length == 0:
+                    break
+            while length > 0:
+                received = data.recv(min(length, MAX_RECV))
+                if not received:
+                    break
+                length -= len(received)
+                if inflater:
+                    received = inflater.decompress(received)
+                newFile.write(received)
+            if not chunked or length > 0:
+                break
+        if inflater:
+            newFile.write(inflater.flush())
+        newFile.close()
+        print "File transfer complete."
+    elif status == STATUS_LIST:
+        cursor = None
+        if flags & FLAG_CURSOR:
+            cursor = CURSOR.unpack(recvExactly(data, CURSOR.size))[0]
+        print "Receiving Directory structure from", args.SERVER_HOST + ":" + args.DATA_PORT 
+        body = recvExactly(data, length)
+        if flags & FLAG_STAT:
+            pos = 0
+            while pos < len(body):
+                end = body.index('\0', pos)
+                size, mtime = ENTRY_STAT.unpack_from(body, end + 1)
+                printEntry(body[pos:end], size, mtime)
+                pos = end + 1 + ENTRY_STAT.size
+        else:
+            for i in body.split('\0')[:-1]:
+                print(i)
+        if cursor is not None:
+            print "Next page: --cursor " + str(cursor)
+    else:
+        print(recvExactly(data, length))
+    data.close()
+
+# Accept the server data connection, send the file to put over it and
+# print the server's reply, which comes once the file is stored.
+# @param dataSocket listening tcp socket object
+# @param args contains all commandline arguments
+# @param proto the protocol version the server agreed to
+def putFile(dataSocket, args, proto):
+    data, serverAddr = dataSocket.accept()
+    print "Sending \"" + args.p + "\" to", args.SERVER_HOST + ":" + args.DATA_PORT
+    localFile = open(args.p, 'rb')
+    try:
+        while True:
+            chunk = localFile.read(1 << 20)
+            if not chunk:
+                break
+            data.sendall(chunk)
+        if args.no_size:
+            data.shutdown(socket.SHUT_WR)
+    except socket.error as e:
+        # Refused up front (eg. a bad name); the reply says why
+        pass
+    localFile.close()
+
+    if proto == PROTO_FRAMED:
+        raw = recvExactly(data, FRAME_HEADER.size)
+        if len(raw) < FRAME_HEADER.size:
+            print("No response from server.")
+        else:
+            magic, version, status, nameLen, flags, length = \
+                FRAME_HEADER.unpack(raw)
+            name = recvExactly(data, nameLen)
+            if status == STATUS_STORED:
+                print "\"" + name + "\" stored."
+            else:
+                print(recvExactly(data, length))
+    else:
+        reply = ''
+        while ('</' + STORED_TAG + '>') not in reply and \
+                ('</' + ERROR_TAG + '>') not in reply and \
+                ('</' + BUSY_TAG + '>') not in reply:
+            received = data.recv(MAX_RECV)
+            if not received:
+                break
+            reply += received
+        if ('<' + STORED_TAG + '>') in reply:
+            print ("\"" + parseTag(NAME_TAG, reply)[0] + "\" stored, " +
+                parseTag(SIZE_TAG, reply)[0] + " bytes.")
+        elif ('<' + ERROR_TAG + '>') in reply:
+            printError(reply)
+        elif ('<' + BUSY_TAG + '>') in reply:
+            print(parseTag(BUSY_TAG, reply)[0])
+        else:
+            print("No response from server.")
+    data.close()
+
+# Return the block size and block signatures of the local copy of args.g,
+# as the tags of a delta get. Each whole block is signed by its Adler-32
+# and the first 8 bytes of its MD5; the block size is kept in
+# args.blockSize to apply the delta with.
+def blockSignatures(args):
+    size = os.path.getsize(args.g)
+    blockSize = max(DELTA_MIN_BLOCK,
+        (size + DELTA_MAX_BLOCKS - 1) // DELTA_MAX_BLOCKS)
+    args.blockSize = blockSize
+    signatures = []
+    with open(args.g, 'rb') as local:
+        while True:
+            block = local.read(blockSize)
+            if len(block) < blockSize:
+                break
+            signatures.append('%08x' % (zlib.adler32(block) & 0xffffffff) +
+                hashlib.md5(block).hexdigest()[:16])
+    return ('<' + BLOCKSIZE_TAG + '>' + str(blockSize) + '</' +
+        BLOCKSIZE_TAG + '><' + SIGNATURES_TAG + '>' + ''.join(signatures) +
+        '</' + SIGNATURES_TAG + '>')
+
+# Rebuild name from its local copy and a delta body of length bytes,
+# then replace the copy if the result matches the server's digest.
+# @param data the connected data socket
+# @return bytes of the new file
+def applyDelta(data, name, length, blockSize):
+    digest = recvExactly(data, DELTA_DIGEST_LEN)
+    length -= DELTA_DIGEST_LEN
+    check = hashlib.md5()
+    written = 0
+    temp = name + '.ftdelta'
+    with open(name, 'rb') as old, open(temp, 'wb') as new:
+        while length > 0:
+            code = recvExactly(data, 1)
+            if code == 'C':
+                first, count = DELTA_COPY.unpack(
+                    recvExactly(data, DELTA_COPY.size))
+                length -= 1 + DELTA_COPY.size
+                old.seek(first * blockSize)
+                rest = count * blockSize
+                while rest > 0:
+                    chunk = old.read(min(rest, 1 << 20))
+                    if not chunk:
+                        break
+                    rest -= len(chunk)
+                    written += len(chunk)
+                    check.update(chunk)
+                    new.write(chunk)
+            elif code == 'L':
+                rest = DELTA_LITERAL.unpack(
+                    recvExactly(data, DELTA_LITERAL.size))[0]
+                length -= 1 + DELTA_LITERAL.size + rest
+                while rest > 0:
+                    chunk = data.recv(min(rest, MAX_RECV))
+                    if not chunk:
+                        break
+                    rest -= len(chunk)
+                    written += len(chunk)
+                    check.update(chunk)
+                    new.write(chunk)
+            else:
+                break
+    if check.digest() != digest:
+        os.remove(temp)
+        print "Delta did not rebuild \"" + name + "\"; get it again."
+        return 0
+    os.rename(temp, name)
+    return written
+
+# Open name for writing without truncating it, creating it if needed
+def openInPlace(name):
+    if not os.path.exists(name):
+        open(name, 'wb').close()
+    return open(name, 'r+b')
+
+# Get one byte range of args.g over a control and data connection of its
+# own, writing it in place in the local copy.
+# @param stream index of the stream; its data port is DATA_PORT + stream
+# @param results receives (file size, bytes received) or an error
+#        message at index stream
+def fetchRange(args, stream, offset, length, results):
+    port = int(args.DATA_PORT) + stream
+    try:
+        cntrl = socket.create_connection((args.SERVER_HOST, args.SERVER_PORT))
+        if negotiateProtocol(cntrl) != PROTO_FRAMED:
+            results[stream] = "Server does not speak protocol 2."
+            return
+        listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        listener.bind((socket.gethostname(), port))
+        listener.listen(1)
+        cntrl.sendall('<' + GET_COMMAND + '>' + args.g + '</' + GET_COMMAND + '>' +
+            '<' + OFFSET_TAG + '>' + str(offset) + '</' + OFFSET_TAG + '>' +
+            '<' + LENGTH_TAG + '>' + str(length) + '</' + LENGTH_TAG + '>' +
+            '<dataport>' + str(port) + '</dataport>' +
+            '<' + READY_TAG + '>' + str(port) + '</' + READY_TAG + '>')
+        data, serverAddr = listener.accept()
+        listener.close()
+    except socket.error as e:
+        results[stream] = "Stream " + str(stream) + ": " + str(e)
+        return
+
+    magic, version, status, nameLen, flags, length = FRAME_HEADER.unpack(
+        recvExactly(data, FRAME_HEADER.size))
+    name = recvExactly(data, nameLen)
+    if status != STATUS_FILE or not flags & FLAG_RANGE:
+        results[stream] = recvExactly(data, length)
+        return
+    offset, fileSize = RANGE.unpack(recvExactly(data, RANGE.size))
+
+    newFile = openInPlace(name)
+    newFile.seek(offset)
+    received = 0
+    while received < length:
+        chunk = data.recv(min(length - received, 1 << 20))
+        if not chunk:
+            break
+        newFile.write(chunk)
+        received += len(chunk)
+    newFile.close()
+    data.close()
+    cntrl.close()
+    results[stream] = (fileSize, received)
+
+# Get args.g as args.streams disjoint ranges in parallel. The first byte
+# still missing is fetched alone first, which gives the file size.
+# @param args contains all commandline arguments
+def stripedGet(args):
+    start = 0
+    if args.resume and os.path.exists(args.g):
+        start = os.path.getsize(args.g)
+
+    results = [None]
+    fetchRange(args, 0, start, 1, results)
+    if not isinstance(results[0], tuple):
+        print(results[0])
+        return
+    fileSize, received = results[0]
+    start += received
+
+    # Split the rest evenly; the last stream takes the remainder
+    streams = max(1, min(args.streams, fileSize - start))
+    stripe = (fileSize - start) // streams
+    results = [None] * streams
+    lengths = []
+    threads = []
+    print "Receiving \"" + args.g + "\" over", streams, "streams"
+    for i in range(streams):
+        offset = start + i * stripe
+        lengths.append(stripe if i < streams - 1 else fileSize - offset)
+        if lengths[i] == 0:
+            results[i] = (fileSize, 0)
+            continue
+        thread = threading.Thread(target=fetchRange,
+            args=(args, i, offset, lengths[i], results))
+        thread.start()
+        threads.append(thread)
+    for thread in threads:
+        thread.join()
+
+    # Keep only the bytes received without a gap, so --resume can
+    # continue from the end of the local copy.
+    complete = start
+    for i in range(streams):
+        if not isinstance(results[i], tuple):
+            print(results[i])
+            break
+        complete += results[i][1]
+        if results[i][1] < lengths[i]:
+            break
+    newFile = openInPlace(args.g)
+    newFile.truncate(complete)
+    newFile.close()
+    if complete < fileSize:
+        print "Transfer incomplete; finish it with --resume."
+    else:
+        print "File transfer complete (" + str(fileSize) + " bytes)."
+
+# Save each file of a protocol 2 batch until its end marker
+# @param data the connected data socket
+# @param args contains all commandline arguments
+def receiveBatch(data, args):
+    print "Receiving batch from", args.SERVER_HOST + ":" + args.DATA_PORT
+    count = 0
+    while True:
+        raw = recvExactly(data, FRAME_HEADER.size)
+        if len(raw) < FRAME_HEADER.size:
+            print("Batch cut short by server.")
+            return
+        magic, version, status, nameLen, flags, length = FRAME_HEADER.unpack(raw)
+        if magic != 'FT' or status == STATUS_BATCH_END:
+            break
+        name = recvExactly(data, nameLen)
+        if status == STATUS_FILE:
+            newFile = open(name, 'wb')
+            while length > 0:
+                received = data.recv(min(length, MAX_RECV))
+                if not received:
+                    break
+                newFile.write(received)
+                length -= len(received)
+            newFile.close()
+            count += 1
+        else:
+            message = recvExactly(data, length)
+            print((name + ": " if name else "") + message)
+            if status == STATUS_BUSY:
+                return
+    print str(count) + " files transferred."
+
 # wait on server socket for ftserver to connect and send response
 # @param dataSocket tcp socket object
 # @param args contains all commandline arguments
@@ -173,6 +733,13 @@ def receiveData(dataSocket, args):
 def parseServerData(serverMessage, args):
     if not serverMessage:
         print("No response from server.")
+    elif serverMessage.startswith('<' + BUSY_TAG + '>'):
+        print(parseTag(BUSY_TAG, serverMessage)[0])
+    elif serverMessage.startswith('<batch>'):
+        saveBatch(serverMessage, args)
+    elif NOT_MODIFIED_TAG in serverMessage:
+        print "ETag: " + parseTag(ETAG_TAG, serverMessage)[0]
+        print "\"" + parseTag(NAME_TAG, serverMessage)[0] + "\" not modified."
     elif OK_TAG in serverMessage:
         if LIST_TAG in serverMessage:
             printList(serverMessage, args)
@@ -192,8 +759,22 @@ def parseServerData(serverMessage, args):
 def printList(serverMessage, args):
     filenames = parseTag(ITEM_TAG, serverMessage)
     print "Receiving Directory structure from", args.SERVER_HOST + ":" + args.DATA_PORT 
-    for i in filenames:
-        print(i)
+    if args.long:
+        stats = parseTag(STAT_TAG, serverMessage)
+        for name, stat in zip(filenames, stats):
+            size, mtime = stat.split()
+            printEntry(name, int(size), int(mtime))
+    else:
+        for i in filenames:
+            print(i)
+    if ('<' + CURSOR_TAG + '>') in serverMessage:
+        print "Next page: --cursor " + parseTag(CURSOR_TAG, serverMessage)[0]
+
+# Print one entry of a listing with its size and mtime
+# @param mtime nanoseconds since the epoch
+def printEntry(name, size, mtime):
+    stamp = time.strftime('%Y-%m-%d %H:%M:%S', time.localtime(mtime // 10**9))
+    print "%12d  %s  %s" % (size, stamp, name)
 
 # Save requested file in local directory
 # @param serverMessage the raw server message
@@ -203,6 +784,8 @@ def printList(serverMessage, args):
 def saveFile(serverMessage, args):
     filename = parseTag(NAME_TAG, serverMessage)
     fileData = parseTag(DATA_TAG, serverMessage)
+    if ('<' + ETAG_TAG + '>') in serverMessage.split('<' + DATA_TAG + '>')[0]:
+        print "ETag: " + parseTag(ETAG_TAG, serverMessage)[0]
     
     # Do not create empty file
     if not fileData:
@@ -213,6 +796,22 @@ def saveFile(serverMessage, args):
     newFile.close()
     print "File transfer complete."
 
+# Save each file of a protocol 1 batch
+# @param serverMessage the raw server message
+# @param args contains all commandline arguments
+def saveBatch(serverMessage, args):
+    print "Receiving batch from", args.SERVER_HOST + ":" + args.DATA_PORT
+    files = re.findall('<ok><name>(.*?)</name><data>(.*?)</data></ok>',
+        serverMessage, re.DOTALL)
+    for name, fileData in files:
+        newFile = open(name, 'w+')
+        newFile.write(fileData)
+        newFile.close()
+    for name, message in re.findall('<error><name>(.*?)</name>(.*?)</error>',
+            serverMessage, re.DOTALL):
+        print(name + ": " + message)
+    print str(len(files)) + " files transferred."
+
 #Print server error message
 # @param serverMessage the raw server message
 # @pre serverMessage contains matched ERROR_TAG tag pair
@@ -226,8 +825,42 @@ def printError(serverMessage):
 def parseCommand(args):
     if (args.l):
         command = '<' + LIST_COMMAND + '>  </' + LIST_COMMAND + '>'
+        if args.limit is not None:
+            command += '<' + LIMIT_TAG + '>' + str(args.limit) + '</' + LIMIT_TAG + '>'
+        if args.cursor is not None:
+            command += '<' + CURSOR_TAG + '>' + args.cursor + '</' + CURSOR_TAG + '>'
+        if args.prefix is not None:
+            command += '<' + PREFIX_TAG + '>' + args.prefix + '</' + PREFIX_TAG + '>'
+        if args.match is not None:
+            command += '<' + MATCH_TAG + '>' + args.match + '</' + MATCH_TAG + '>'
+        if args.long:
+            command += '<' + STAT_TAG + '></' + STAT_TAG + '>'
+    elif args.b:
+        # A lone name with glob characters is matched by the server
+        if len(args.b) == 1 and re.search(r'[*?[]', args.b[0]):
+            command = ('<' + BATCH_COMMAND + '></' + BATCH_COMMAND + '><' +
+                MATCH_TAG + '>' + args.b[0] + '</' + MATCH_TAG + '>')
+        else:
+            command = ('<' + BATCH_COMMAND + '>' + BATCH_SEPARATOR.join(args.b) +
+                '</' + BATCH_COMMAND + '>')
+    elif args.p:
+        command = ('<' + PUT_COMMAND + '>' + os.path.basename(args.p) +
+            '</' + PUT_COMMAND + '>')
+        if not args.no_size:
+            command += ('<' + SIZE_TAG + '>' + str(os.path.getsize(args.p)) +
+                '</' + SIZE_TAG + '>')
     else:
         command = '<' + GET_COMMAND + '>' + args.g + '</' + GET_COMMAND + '>'
+        if args.offset is not None:
+            command += '<' + OFFSET_TAG + '>' + str(args.offset) + '</' + OFFSET_TAG + '>'
+        if args.length is not None:
+            command += '<' + LENGTH_TAG + '>' + str(args.length) + '</' + LENGTH_TAG + '>'
+        if args.etag is not None:
+            command += '<' + ETAG_TAG + '>' + args.etag + '</' + ETAG_TAG + '>'
+        if args.gzip:
+            command += '<' + ENCODING_TAG + '>gzip</' + ENCODING_TAG + '>'
+        if args.delta and os.path.isfile(args.g):
+            command += blockSignatures(args)
     return command + '<dataport>' + str(args.DATA_PORT) + '</dataport>'
 
 # Return contents of specified tag label
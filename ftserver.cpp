@@ -6,30 +6,80 @@
  * Descr:   This file contains the implementation of ftserver, a simple 
  *          server-client file transfer application.
  *
- *          ftserver provides 2 services: 1) "list": list the contents of the
- *          current directory 2) "Get File": Get the requested file by name.
+ *          ftserver provides 3 services: 1) "list": list the contents of the
+ *          current directory 2) "Get File": Get the requested file by name
+ *          3) "Put File": store a file sent over the data connection.
  *
  *          ftserver fulfills requests over a second tcp connection on a 
  *          port specified by the client. 
  *
- *          ftserver will wait on the specified port until a client connects
- *          or a keyboard interrupt is received.  
+ *          ftserver serves any number of clients concurrently on the
+ *          specified port until a keyboard interrupt is received.  
  */
 #include <iostream>    
 #include <stdio.h>
 #include <string>
 #include <cstring>
-#include <fstream>      // file io
 #include <dirent.h>     // directory services
 #include <stdexcept>    // exception handling  
+#include <string_view>
 #include <netdb.h>      // socket-related data structures (addrinfo etc)
 #include <arpa/inet.h>  // inet_ntoa()
 #include <csignal>      // signal handling
+#include <unistd.h>     // close(), getcwd()
+#include <fcntl.h>      // open()
+#include <sys/stat.h>   // fstat()
 #include "ftserver.hpp"
+#include "parser.hpp"
+#include "protocol.hpp"
+#include <thread>
+#include <vector>
+#include <memory>
+#include <pthread.h>    // CPU affinity
+#include "reactor.hpp"
+#include "iopool.hpp"
+#include "dirindex.hpp"
+#include "filecache.hpp"
+#include "compress.hpp"
+#include "delta.hpp"
+#include "logger.hpp"
+#include "resolver.hpp"
+#include "metrics.hpp"
+#include "etag.hpp"
+#include "listing.hpp"
+#include "ratelimit.hpp"
+#include "bufpool.hpp"
+#include "prefetch.hpp"
 using namespace std;
 
 bool notKilled = true; // Do not gracefully quit
+static bool indexed = false;  // The directory index is live
 
+ServerOptions serverOptions = {
+    1,                   // workers
+    DEFAULT_IO_THREADS,  // ioThreads
+    DEFAULT_CACHE_MB,    // cacheMB
+    DEFAULT_GZIP_CACHE_MB,  // gzipCacheMB
+    0,                   // resolveTtl
+    NULL,                // statsFile
+    DEFAULT_STATS_INTERVAL,  // statsInterval
+    LOG_INFO,            // logLevel
+    false,               // ioUring
+    DURABILITY_FILE,     // durability
+    0,                   // clientRate
+    0,                   // totalRate
+    0,                   // maxClients
+    0,                   // maxTransfers
+    DEFAULT_HEADER_TIMEOUT,   // headerTimeout
+    DEFAULT_IDLE_TIMEOUT,     // idleTimeout
+    DEFAULT_CONNECT_TIMEOUT,  // connectTimeout
+    DEFAULT_SEND_TIMEOUT,     // sendTimeout
+    DEFAULT_PREFETCH_MB,      // prefetchMB
+    DEFAULT_PREFETCH_RATE     // prefetchRate
+};
+
+// Benchmarks link this file for the request path, without main()
+#ifndef FTSERVER_NO_MAIN
 // Handle keyboard interrupt.
 // Print status message
 // Set notKilled to false 
@@ -44,17 +94,29 @@ int main(int argc, char** argv) {
     // Connect signal handler to gracefully close server socket on interrupt
     signal(SIGINT, signalHandler);   
 
+    // A client that drops its data connection must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
     // Get valid port number argument
     if ((portno = getPort(argc, argv)) == -1)
 	    return 0;  // Gracefully close on invalid port argument.
+
+    // Get valid optional arguments
+    if (getOptions(argc, argv) == -1)
+	    return 0;
 	
-	cout << "Server open on " << portno << "\n";
+	cout << "Server open on " << portno << endl;
+
+    // Records are written by a background thread; flush them on exit.
+    startLogger(serverOptions.logLevel);
+    atexit(stopLogger);
     
     //Call server function on port arg.
 	waitForClient(to_string((long long)portno).c_str(), &notKilled);
 
 	return 0;
 }
+#endif
 
 /**
  * Process commandline args
@@ -65,7 +127,7 @@ int main(int argc, char** argv) {
 int getPort(int argc, char **argv) {
 	int portno = 0;
 
-	if (argc != 2) { //Invalid num args.
+	if (argc < 2) { //Invalid num args.
 		cout << "Invalid Command Line Arguments\n" << USAGE;
 		return -1;
 	}
@@ -92,8 +154,180 @@ int getPort(int argc, char **argv) {
 		return portno;
 }
 
+/**
+ * Parse a positive integer option value.
+ *
+ * @return the value, or -1 if it is not a positive integer
+ */
+static int positiveArg(const char *name, const char *value) {
+    int n = -1;
+	try {
+		n = stoi(value);
+	}
+	catch (const exception &e) // non-integer entered.
+	{
+	}
+    if (n < 1)
+		cout << name << " requires a positive integer.\n" << USAGE;
+    return n < 1 ? -1 : n;
+}
+
+/**
+ * Parse a non-negative integer option value.
+ *
+ * @return the value, or -1 if it is not a non-negative integer
+ */
+static int countArg(const char *name, const char *value) {
+    int n = -1;
+	try {
+		n = stoi(value);
+	}
+	catch (const exception &e) // non-integer entered.
+	{
+	}
+    if (n < 0)
+		cout << name << " requires a non-negative integer.\n" << USAGE;
+    return n;
+}
+
+/**
+ * Process the optional commandline arguments into serverOptions.
+ *
+ * @param argv Commandline argument array
+ * @return 0 on success or -1 on invalid
+ */
+int getOptions(int argc, char **argv) {
+    for (int i = 2; i < argc; i++) {
+        string opt(argv[i]);
+        if (i + 1 >= argc) {
+		    cout << "Missing value for " << opt << "\n" << USAGE;
+            return -1;
+        }
+        const char *value = argv[++i];
+
+        if (opt == "--workers") {
+            if ((serverOptions.workers = positiveArg(argv[i - 1], value)) == -1)
+                return -1;
+        }
+        else if (opt == "--io-threads") {
+            if ((serverOptions.ioThreads = positiveArg(argv[i - 1], value)) == -1)
+                return -1;
+        }
+        else if (opt == "--cache-mb") {
+            if ((serverOptions.cacheMB = countArg(argv[i - 1], value)) == -1)
+                return -1;
+        }
+        else if (opt == "--gzip-cache-mb") {
+            if ((serverOptions.gzipCacheMB = countArg(argv[i - 1], value))
+                    == -1)
+                return -1;
+        }
+        else if (opt == "--resolve-ttl") {
+            if ((serverOptions.resolveTtl = countArg(argv[i - 1], value)) == -1)
+                return -1;
+        }
+        else if (opt == "--stats-file") {
+            serverOptions.statsFile = value;
+        }
+        else if (opt == "--stats-interval") {
+            if ((serverOptions.statsInterval = positiveArg(argv[i - 1], value))
+                    == -1)
+                return -1;
+        }
+        else if (opt == "--log-level") {
+            if (!parseLogLevel(value, &serverOptions.logLevel)) {
+		        cout << opt << " must be error, warn, info or debug.\n"
+                    << USAGE;
+                return -1;
+            }
+        }
+        else if (opt == "--io-backend") {
+            string backend(value);
+            if (backend != "epoll" && backend != "io_uring") {
+		        cout << opt << " must be epoll or io_uring.\n" << USAGE;
+                return -1;
+            }
+            serverOptions.ioUring = (backend == "io_uring");
+        }
+        else if (opt == "--client-rate") {
+            if ((serverOptions.clientRate = countArg(argv[i - 1], value)) == -1)
+                return -1;
+        }
+        else if (opt == "--total-rate") {
+            if ((serverOptions.totalRate = countArg(argv[i - 1], value)) == -1)
+                return -1;
+        }
+        else if (opt == "--max-clients") {
+            if ((serverOptions.maxClients = countArg(argv[i - 1], value)) == -1)
+                return -1;
+        }
+        else if (opt == "--max-transfers") {
+            if ((serverOptions.maxTransfers = countArg(argv[i - 1], value))
+                    == -1)
+                return -1;
+        }
+        else if (opt == "--header-timeout") {
+            if ((serverOptions.headerTimeout = countArg(argv[i - 1], value))
+                    == -1)
+                return -1;
+        }
+        else if (opt == "--idle-timeout") {
+            if ((serverOptions.idleTimeout = countArg(argv[i - 1], value))
+                    == -1)
+                return -1;
+        }
+        else if (opt == "--connect-timeout") {
+            if ((serverOptions.connectTimeout = countArg(argv[i - 1], value))
+                    == -1)
+                return -1;
+        }
+        else if (opt == "--send-timeout") {
+            if ((serverOptions.sendTimeout = countArg(argv[i - 1], value))
+                    == -1)
+                return -1;
+        }
+        else if (opt == "--prefetch-mb") {
+            if ((serverOptions.prefetchMB = countArg(argv[i - 1], value))
+                    == -1)
+                return -1;
+        }
+        else if (opt == "--prefetch-rate") {
+            if ((serverOptions.prefetchRate = countArg(argv[i - 1], value))
+                    == -1)
+                return -1;
+        }
+        else if (opt == "--durability") {
+            if (!parseDurability(value, &serverOptions.durability)) {
+		        cout << opt << " must be none, file or group.\n" << USAGE;
+                return -1;
+            }
+        }
+        else {
+		    cout << "Unknown option " << opt << "\n" << USAGE;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Worker thread body: pin to a core and run a reactor on its own
+ * SO_REUSEPORT listener.
+ */
+static void runWorker(int id, int s, bool *notKilled) {
+    unsigned cores = thread::hardware_concurrency();
+    if (cores > 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(id % cores, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+    }
+    runReactor(s, notKilled);
+    close(s);
+}
+
 /*
- * Wait on a socket for a client to connect.   
+ * Serve clients on a socket until interrupted.
  * 
  * @param portno port number to listen on.
  * @param notKilled whether keyboard interrupt has been received
@@ -101,392 +335,704 @@ int getPort(int argc, char **argv) {
  * @pre portno is valid.
  */
 int waitForClient(const char *portno, bool *notKilled) {
-	
-	int status;
-    int  s = 0;  // The server socket
-	int c = 0; // The client in the control connection.
-    int dataPortNo = 0;  // Connecting client's specified receiving port
-	int recvRetVal; // Bytes read or error
+    int s = 0;  // The server socket
+    bool multi = serverOptions.workers > 1;
+    vector<thread> workers;
+
+    startIoPool(serverOptions.ioThreads);
+    setGlobalRate((uint64_t)serverOptions.totalRate * 1024);
+    setCacheBudget((size_t)serverOptions.cacheMB << 20);
+    setGzipBudget((size_t)serverOptions.gzipCacheMB << 20);
+    startPrefetcher((size_t)serverOptions.prefetchMB << 20,
+            (uint64_t)serverOptions.prefetchRate * 1024);
+
+    // Client hostnames are looked up off the accept path, if at all
+    if (serverOptions.resolveTtl > 0)
+        startResolver(serverOptions.resolveTtl);
+    if (serverOptions.durability == DURABILITY_GROUP)
+        startCommitter();
+
+    if (serverOptions.statsFile != NULL)
+        startStatsDump(serverOptions.statsFile, serverOptions.statsInterval,
+                serverStats);
+
+    // Without inotify, every lookup falls back to scanning the directory
+    indexed = startDirIndex();
 
     // Obtained much socket data structure help from Beej's Guide: 
     // https://beej.us/guide/bgnet/output/html/multipage/ipstructsdata.html
-    socklen_t addrlen = sizeof(struct sockaddr_storage);
-	struct addrinfo hints;
-	struct addrinfo *servinfo;  // will point to the results
-	struct addrinfo *next;  // Next in linked list of ip addresses
-    struct sockaddr_storage c_addr;  // Address info about client
-	char buffer[RECV_BUF_LEN];  // holds incoming data
-    char clientHost[MAX_HOST_LEN]; // The connecting client hostname
-
-    memset(&clientHost, 0, MAX_HOST_LEN);  // Zero-out clientHost
-    memset(&hints, 0, sizeof hints); // Zero-out hints
-	hints.ai_family = AF_INET;  // ipv4 socket
-	hints.ai_socktype = SOCK_STREAM; // TCP, not UDP
-	hints.ai_flags = AI_PASSIVE; // fill in my ip for me
-
-    // Fill in socket info from hints into servinfo
-	if ((status = getaddrinfo(NULL, portno, &hints, &servinfo)) != 0) {
-		perror("Error with getaddrinfo");
-		return 0;
-	}
-    
-    // The following for loop heavily borrowed from Beej's guide (link above)
-	// Walk the linked list of struct addrinfos in order to find a valid one. 
-	for (next = servinfo; next != NULL; next = next->ai_next) {
-        // Init the server socket
-        if ((s = socket(
-                next->ai_family, 
-                next->ai_socktype, 
-                next->ai_protocol))
-                == -1) {
-            // Call to socket failed. 
-            // Report error, but try the next addrinfo in linked list.
-            perror("Server socket");
-            continue;
-        }
-
-	    // Bind socket to port (specified in struct addrinfo hints)
-	    if (bind(s, servinfo->ai_addr, servinfo->ai_addrlen) == -1) {
-            close(s);
-            // Call to bind() failed. 
-            // Report error, but try the next addrinko in linked list.
-            perror("Bind");
-            continue;
-        }
-    }
-
-    // Free the memory for servinfo now that it's not needed
-    freeaddrinfo(servinfo);
-
-    // Prepare socket s to accept clients
-	if ((listen(s, MAX_INCOMING_CONNECTIONS)) == -1) {
-	    perror("Listen");
+    // Listeners are opened up front so a bad port fails before any
+    // worker starts.
+    vector<int> listeners;
+    for (int i = 0; i < serverOptions.workers; i++) {
+        if ((s = openListener(portno, multi)) == -1) {
+            for (size_t j = 0; j < listeners.size(); j++)
+                close(listeners[j]);
+            return 0;
+        }
+        listeners.push_back(s);
+    }
+
+    // Accept and serve clients until interrupt is received. 
+    if (!multi) {
+        runReactor(s, notKilled);
+        close(s);
         return 0;
     }
-	
-	// Accept clients until interrupt is received. 
-	while (*notKilled) {
-
-        // Client has attempted to connect
-		if ((c = accept(s, (struct sockaddr *)&c_addr, &addrlen)) == -1) {	
-			perror("Accept");
-            close(s);
-			return 0;
-		}
-        
-        // Cast first item in c_addr as sockaddr *
-        struct sockaddr * clientAddr = (struct sockaddr *)&c_addr; 
-        
-        // Fill client's hostname (clientHost) using the info in clientAddr
-        getnameinfo(clientAddr, addrlen, clientHost, MAX_HOST_LEN, NULL, 0, 0);
-        
-        // std::string repr of clientHost (For ease of passing as argument)
-        string cHostname(clientHost);  
-        cout << "Connection from " << cHostname << endl;
-		
-        // Help for the following do-while loop obtained at msdn:
-        // msdn.microsoft.com/en-us/windows/desktop/bb530746(v=vs.85).aspx 
-        
-		// Loop recv until no more data to read.
-		do {
-			dataPortNo = 0;
-			recvRetVal = recv(c, buffer, RECV_BUF_LEN, 0);
-			if (recvRetVal > 0) {  // Data has been received
-                
-                // Create a std::string from the buffer
-                string bufString(buffer);
-				
-                // Ensure that no junk data is included in bufString
-                bufString = bufString.substr(0, recvRetVal);
-
-                // get a formatted response to send to client
-                string response = parseCommand(bufString, &dataPortNo, cHostname);
-                
-                // Check for abort condition
-                if (dataPortNo == -1) {  // Problem with client port
-                    close(c);
-                    break;
-                }
-                // Allow client time to open a socket and listen.   
-                sleep(1);
-
-                // Send response to client on client-specified port 
-                sendResponse(
-                        response, 
-                        (struct sockaddr*)&c_addr, 
-                        (socklen_t*) &addrlen, 
-                        dataPortNo);
-			}
-
-            // All data has been received
-			else if (recvRetVal == 0) {
-                close(c);
-		    }	
-
-            // -1 indicates an error condition
-            else {
-			    perror("Recv");
-                close(c); 
-			}
-		} while (recvRetVal > 0);  // More data to read on socket
-	}
+    for (int i = 0; i < serverOptions.workers; i++)
+        workers.push_back(thread(runWorker, i, listeners[i], notKilled));
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    return 0;
+}
 
-    // Close server and client sockets.
-    close(c);
-	close(s);
+/**
+ * Fill response with an error message in the given protocol
+ *
+ * @param response the response to fill
+ * @param message the error text for the client
+ * @param proto the protocol version negotiated on the connection
+ */
+static void errorResponse(Response *response, string_view message,
+        int proto) {
+    response->status = FT_STATUS_ERROR;
+    takeBuffer(&response->header);
+    if (proto == PROTO_FRAMED)
+        appendFrameHeader(&response->header, FT_STATUS_ERROR, "",
+                message.length());
+    else
+        response->header += "<error>";
+    response->header += message;
+    if (proto != PROTO_FRAMED)
+        response->header += "</error>";
+}
 
-	return 0;
+/**
+ * Give the header and trailer back to the buffer pool.
+ */
+Response::~Response() {
+    recycleBuffer(&header);
+    recycleBuffer(&trailer);
+}
+
+/**
+ * Drop the file body attached to response, and anything else it holds.
+ */
+static void dropBody(Response *response) {
+    if (response->fd != -1)
+        close(response->fd);
+    *response = Response();
+}
+
+/**
+ * Return the body length of response: its own, and for a delta, that of
+ * every part its body runs on through.
+ */
+static uint64_t bodyLength(const Response &response) {
+    uint64_t length = response.length;
+    if (response.status == FT_STATUS_DELTA) {
+        for (size_t i = 0; i < response.parts.size(); i++)
+            length += response.parts[i].length;
+    }
+    return length;
 }
 
 /**
- *  Send response to client on specified port
+ * Narrow the whole-file body of response to range.
  *
- *  @param response the entire data to send
- *  @param clientAddr ip address of client
- *  @param portno the port specified by client 
+ * @param place receives where the body now lies in the file
+ *
+ * @return false if range starts past the end of the file
  */
-int sendResponse(
-        string response, 
-        struct sockaddr* clientAddr, 
-        socklen_t* addrlen, 
-        int portNo){
-   
-    //Create data structures for connection
-	int dataSocket = 0; // Socket descriptor
-    int totalSent = 0;  // Total bytes sent
-    int sent = 0;       // Bytes sent this iteration
-    int toSend = 0;     // Bytes to send this iteration
-    int responseLength = response.length();
+static bool narrowToRange(Response *response, const ByteRange &range,
+        BodyRange *place) {
+    uint64_t fileSize = response->length;
+    if (!range.valid || range.offset > fileSize)
+        return false;
+    uint64_t rest = fileSize - range.offset;
+    uint64_t length = (range.length == 0 || range.length > rest)
+        ? rest : range.length;
 
-	/* 
-     * Much of the socket code in this function is paraphrased from Beej's guide
-     * I tried to make this my original work, but I fully attribute any 
-     * similarities of this file to Beej's guide to the author of that 
-     * guide. 
-	 * Source: https://beej.us/guide/bgnet/output/html/multipage/(continued)
-     * (continuation)syscalls.html#getpeername
-     */
-	struct addrinfo hints;  // Address struct to fill for socket
-    
-    //The client program is the "server" for this data connection.
-	struct addrinfo *serverInfo; 
+    if (response->fd != -1)
+        response->offset += range.offset;
+    else
+        response->data += range.offset;
+    response->length = length;
+    place->offset = range.offset;
+    place->fileSize = fileSize;
+    return true;
+}
+
+/**
+ * Make response the "not modified" answer to a conditional get, dropping
+ * any file body already attached.
+ *
+ * @param etag the ETag the client holds, which is still current
+ */
+static void notModifiedResponse(Response *response, const string &filename,
+        uint64_t etag, int proto) {
+    dropBody(response);
+    response->status = FT_STATUS_NOT_MODIFIED;
+    takeBuffer(&response->header);
+    if (proto == PROTO_FRAMED) {
+        appendFrameHeader(&response->header, FT_STATUS_NOT_MODIFIED,
+                filename, 0, &etag);
+    }
+    else {
+        response->header.append("<notmodified><name>").append(filename)
+            .append("</name><" ETAG_TAG ">").append(etagHex(etag))
+            .append("</" ETAG_TAG "></notmodified>");
+    }
+}
 
-    // Zero-out the memory of hints.
-	memset(&hints, 0, sizeof(hints));
+/**
+ * Fill response with one page of a paged listing
+ *
+ * @param list the page to return
+ * @param proto the protocol version negotiated on the connection
+ */
+static void listPageResponse(Response *response, const ListQuery &list,
+        int proto) {
+    uint64_t next;
+    bool more;
 
-	hints.ai_family = AF_UNSPEC;  
-	hints.ai_socktype = SOCK_STREAM;  // TCP socket
-    
-    /*
-	 * Ip address parsing help obtained from accepted answer here:
-	 * http://stackoverflow.com/questions/1276294/(continued)
-     * (continuation)getting-ipv4-address-from-a-sockaddr-structure
-	 */
-    
-    // convert byte order from network byte order (for portability)
-	char *ip = inet_ntoa(((sockaddr_in*)clientAddr)->sin_addr);
-    
-    // Get portnumber into a cstring for use in getaddrinfo()
-    string portNumber = to_string((long long)portNo);
-    
-    // Set up serverInfo struct
-	if ((getaddrinfo(ip, portNumber.c_str(), &hints, &serverInfo))!= 0) {
-        perror("getaddrinfo");
-        return 0;
+    shared_ptr<const string> page = listPage(list, proto, &next, &more);
+    if (!page) {
+        errorResponse(response, "CANNOT LIST DIRECTORY", proto);
+        return;
+    }
+    response->data = page->data();
+    response->length = page->length();
+    response->owner = page;
+    response->status = FT_STATUS_LIST;
+    takeBuffer(&response->header);
+    if (proto == PROTO_FRAMED) {
+        appendListPageHeader(&response->header, page->length(),
+                more ? &next : NULL, list.withStat);
+    }
+    else {
+        response->header = "<ok><list>";
+        response->trailer = " </list>";
+        if (more)
+            response->trailer += "<" CURSOR_TAG ">" + to_string(next)
+                + "</" CURSOR_TAG ">";
+        response->trailer += "</ok>";
     }
+}
 
-    // Create client socket on serverInfo struct info
-	dataSocket = socket(
-            serverInfo->ai_family, 
-            serverInfo->ai_socktype, 
-            serverInfo->ai_protocol);
-	
-    // Create TCP connection
-    if (connect(dataSocket, serverInfo->ai_addr, serverInfo->ai_addrlen) != 0) {
-        perror("Connect");
-        close(dataSocket);
-        return 0;
-    }    
-
-    // socket info no longer needed.
-    free(serverInfo);
-
-    // Send the response to client
-    // MSG_NOSIGNAL prevents broken pipe signal
-    while (totalSent < responseLength) {
-        toSend = responseLength - totalSent;
-
-        // Either send MAX_SEND_LEN bytes or remaining bytes, whichever is less
-        toSend = (toSend < MAX_SEND_LEN) ? toSend : MAX_SEND_LEN;
-        sent = send(
-            dataSocket, 
-            response.substr(totalSent).c_str(), 
-            toSend, 
-            MSG_NOSIGNAL);
-        if (sent == -1) {
-            perror("Send");
-            close(dataSocket);
-            return 0; 
-        } 
+/**
+ * Attach the contents of filename to response: from the hot-file cache,
+ * or else straight from the page cache.
+ *
+ * @return if the file could be read
+ */
+static bool readFile(const string &filename, Response *response) {
+    StageTimer timer(STAGE_READ);
+    return cacheLookup(filename, response) || openFile(filename, response);
+}
+
+/**
+ * Return the names a batch asks for: its '/' separated list, or the
+ * files in this directory that match its glob.
+ *
+ * @return false if there are more than BATCH_MAX_FILES
+ */
+static bool batchNames(const Request &request, vector<string> *names) {
+    if (request.list.match.empty()) {
+        size_t start = 0;
+        const string &list = request.filename;
+        while (start <= list.length()) {
+            size_t end = list.find(BATCH_SEPARATOR, start);
+            if (end == string::npos)
+                end = list.length();
+            if (end > start)
+                names->push_back(list.substr(start, end - start));
+            start = end + 1;
+        }
+        return names->size() <= BATCH_MAX_FILES;
+    }
+
+    // One page of matching names, read straight from the directory
+    ListQuery query;
+    query.match = request.list.match;
+    query.limit = BATCH_MAX_FILES;
+    uint64_t next;
+    bool more;
+    shared_ptr<const string> page = listPage(query, PROTO_FRAMED, &next,
+            &more);
+    if (!page || more)
+        return false;
+    for (size_t start = 0; start < page->length(); ) {
+        size_t end = page->find('\0', start);
+        string name = page->substr(start, end - start);
+        if (name != "." && name != "..")
+            names->push_back(name);
+        start = end + 1;
+    }
+    return true;
+}
+
+/**
+ * Fill response with a batch: each named file, or an error naming it,
+ * then the end of the batch. The files are sent as they would be by a
+ * get, from the hot-file cache or straight from the page cache.
+ *
+ * @param names the files of the batch
+ * @param proto the protocol version negotiated on the connection
+ */
+static void batchResponse(Response *response, const vector<string> &names,
+        int proto) {
+    static const string notFound = "FILE NOT FOUND";
+
+    response->status = FT_STATUS_FILE;
+    if (proto != PROTO_FRAMED)
+        response->header = "<batch>";
+    response->parts.reserve(names.size() + 1);
+    prefetchFiles(names);  // Read ahead of the members' turns
+    for (size_t i = 0; i < names.size(); i++) {
+        const string &name = names[i];
+        Response member;
+        takeBuffer(&member.header);
+        if (fileExists(name) && readFile(name, &member)) {
+            member.status = FT_STATUS_FILE;
+            if (proto == PROTO_FRAMED) {
+                appendFrameHeader(&member.header, FT_STATUS_FILE, name,
+                        member.length);
+            }
+            else {
+                member.header.append("<ok><name>").append(name)
+                    .append("</name><data>");
+                member.trailer = "</data></ok>";
+            }
+        }
         else {
-            totalSent += sent;
+            member.status = FT_STATUS_ERROR;
+            if (proto == PROTO_FRAMED) {
+                appendFrameHeader(&member.header, FT_STATUS_ERROR, name,
+                        notFound.length());
+                member.header += notFound;
+            }
+            else {
+                member.header.append("<error><name>").append(name)
+                    .append("</name>").append(notFound).append("</error>");
+            }
         }
+        response->parts.push_back(move(member));
     }
-       
-	close(dataSocket);
-	return 1;
+
+    Response end;
+    end.status = FT_STATUS_BATCH_END;
+    if (proto == PROTO_FRAMED)
+        appendFrameHeader(&end.header, FT_STATUS_BATCH_END, "", 0);
+    else
+        end.header = "</batch>";
+    response->parts.push_back(move(end));
 }
 
 /**
- * Return contents of tag or empty string
+ * Turn the response of a put whose upload has ended into its reply:
+ * stored, or the upload's error.
  *
- * @param tag the string inside xml style '<>' braces to find
- * @param msg The unprocessed client request string
+ * @param proto the protocol version negotiated on the connection
+ */
+void storedResponse(Response *response, int proto) {
+    const Upload &upload = *response->upload;
+
+    if (!upload.stored) {
+        errorResponse(response, upload.error.empty()
+                ? "COULD NOT STORE FILE" : upload.error, proto);
+        return;
+    }
+    response->status = FT_STATUS_STORED;
+    takeBuffer(&response->header);
+    if (proto == PROTO_FRAMED) {
+        appendFrameHeader(&response->header, FT_STATUS_STORED, upload.name,
+                0);
+    }
+    else {
+        response->header.append("<" STORED_TAG "><name>").append(upload.name)
+            .append("</name><" SIZE_TAG ">")
+            .append(to_string(upload.received))
+            .append("</" SIZE_TAG "></" STORED_TAG ">");
+    }
+}
+
+/**
+ * Return the response to a command refused because the server is at
+ * its --max-transfers limit.
+ */
+Response busyResponse(int proto) {
+    static const string message = "SERVER BUSY";
+    Response response;
+
+    response.status = FT_STATUS_BUSY;
+    takeBuffer(&response.header);
+    if (proto == PROTO_FRAMED) {
+        appendFrameHeader(&response.header, FT_STATUS_BUSY, "",
+                message.length());
+        response.header += message;
+    }
+    else {
+        response.header.append("<" BUSY_TAG ">").append(message)
+            .append("</" BUSY_TAG ">");
+    }
+    return response;
+}
+
+/**
+ * Return every server counter as "name value" lines.
+ */
+string serverStats() {
+    return cacheStats() + etagStats() + gzipStats() + prefetchStats()
+        + metricsStats();
+}
+
+/**
+ * Read the paging and filter elements of a list command into request.
  *
- * @return  The string between the first instance of openTag and 
- *          closeTag
+ * @return false if the cursor or limit is not a number
  */
-string parseTag(string tag, string msg) {
-    int dataLength = 0;  // Character length of content between tags
-    
-    // Add braces to tag to differentiate open and close tags
-    const string openTag("<" + tag + ">");
-    const string closeTag("</" + tag + ">");
+static bool parseListQuery(const Message &message, Request *request) {
+    ListQuery &list = request->list;
+    bool found = false;
+    bool paged = false;
+    uint64_t limit = LIST_PAGE_DEFAULT;
+    string_view text;
 
-    // Calculate length of content
-    dataLength = msg.find(closeTag) - msg.find(openTag) - openTag.length();
-    
-    // Verify content length and cut out tags.
-    if ( dataLength > 0)
-        return msg.substr((msg.find(openTag) + openTag.length()), dataLength);
-    else 
-        return "";
+    text = message.field(CURSOR_TAG, &found);
+    if (found && !parseNumber(text, &list.cursor))
+        return false;
+    paged |= found;
+    text = message.field(LIMIT_TAG, &found);
+    if (found && !parseNumber(text, &limit))
+        return false;
+    paged |= found;
+    list.limit = (limit == 0 || limit > LIST_PAGE_MAX) ? LIST_PAGE_MAX : limit;
+
+    text = message.field(PREFIX_TAG, &found);
+    list.prefix.assign(text.data(), text.length());
+    paged |= found;
+    text = message.field(MATCH_TAG, &found);
+    list.match.assign(text.data(), text.length());
+    paged |= found;
+    message.field(STAT_TAG, &found);
+    list.withStat = found;
+    paged |= found;
+
+    request->paged = paged;
+    return true;
+}
+
+/**
+ * Return if the ',' separated encodings a client can decode include gzip.
+ */
+static bool acceptsGzip(string_view encodings) {
+    while (!encodings.empty()) {
+        size_t comma = encodings.find(',');
+        string_view encoding = encodings.substr(0, comma);
+        while (!encoding.empty() && encoding.front() == ' ')
+            encoding.remove_prefix(1);
+        if (encoding == ENCODING_GZIP)
+            return true;
+        if (comma == string_view::npos)
+            break;
+        encodings.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+/**
+ * Extract the command from a parsed client message
+ *
+ * @param message the parsed fields of one client command
+ * @param request receives the command, its argument and data port
+ *
+ * @return false if the client sent an invalid data port number
+ */
+bool parseRequest(const Message &message, Request *request) {
+    bool found = false;
+    string_view argument;
+
+    // Port number from client message
+    if ((request->dataPortNo = parsePort(message.field(PORT_TAG))) == -1) {
+        return false;
+    }
+
+    // Check for "Get file" command, then "list" command.
+    argument = message.field(GET_COMMAND, &found);
+    if (found && !argument.empty()) {
+        request->verb = VERB_GET;
+        request->filename.assign(argument.data(), argument.length());
+    }
+    else if ((argument = message.field(BATCH_COMMAND, &found)), found) {
+        request->verb = VERB_BATCH;
+        request->filename.assign(argument.data(), argument.length());
+        argument = message.field(MATCH_TAG);
+        request->list.match.assign(argument.data(), argument.length());
+    }
+    else if ((argument = message.field(PUT_COMMAND, &found)), found) {
+        request->verb = VERB_PUT;
+        request->filename.assign(argument.data(), argument.length());
+        argument = message.field(SIZE_TAG, &found);
+        request->sized = found;
+        request->sizeValid = !found || parseNumber(argument, &request->size);
+    }
+    else if (message.field(LIST_COMMAND, &found), found) {
+        request->verb = VERB_LIST;
+        request->list.valid = parseListQuery(message, request);
+    }
+    else {
+        request->verb = VERB_UNKNOWN;
+        request->command.assign(message.tags[0].data(),
+                message.tags[0].length());
+    }
+
+    // "<etag></etag>" asks for the ETag; a known one makes the get
+    // conditional. One that does not parse can never match.
+    argument = message.field(ETAG_TAG, &found);
+    request->wantETag = found;
+    request->conditional = found && parseETag(argument, &request->etag);
+
+    // "<encoding>gzip</encoding>" accepts the file compressed
+    argument = message.field(ENCODING_TAG, &found);
+    request->gzip = found && acceptsGzip(argument);
+
+    // "<blocksize>N</blocksize><sigs>...</sigs>" gets the file as a delta
+    // from the client's copy
+    argument = message.field(SIGNATURES_TAG, &found);
+    request->delta = found;
+    if (found) {
+        request->deltaValid = parseSignatures(argument, &request->signatures)
+            && parseNumber(message.field(BLOCKSIZE_TAG), &request->blockSize)
+            && request->blockSize >= DELTA_MIN_BLOCK
+            && request->blockSize <= DELTA_MAX_BLOCK;
+    }
+
+    // "<offset>N</offset><length>N</length>" gets part of the file
+    ByteRange &range = request->range;
+    argument = message.field(OFFSET_TAG, &found);
+    request->ranged = found;
+    if (found && !parseNumber(argument, &range.offset))
+        range.valid = false;
+    argument = message.field(LENGTH_TAG, &found);
+    request->ranged |= found;
+    if (found && !parseNumber(argument, &range.length))
+        range.valid = false;
+    return true;
 }
 
 /**
  * Process response based on client request
  *
- * @param msg Client request message
- * @param portNo the client's requested response port
+ * @param request the client's parsed command
  * @param cHostname the clien's hostname(for status messages)
+ * @param proto the protocol version negotiated on the connection
  *
  * @return formatted data to send back to client 
- * @return portNo* is now the int value of the client's requested data port
  */
-string parseCommand(string message, int *portNo, string cHostname) {
-    string tagContents;
-    string port;
-	string returnMSG = "";
-    string filename;
-    int * portno = portNo; 
-    // String port number from client message
-    port = parseTag(PORT_TAG, message);
-
-	/* 
-     * Help for exception handling: 
-	 * http://www.cplusplus.com/reference/stdexcept/invalid_argument/
-	 */
-	try {
-		*portno = stoi(port);
-	}
-	catch (const invalid_argument &e) // non-integer entered.
-	{
-        *portno = -1;
-	}
+Response parseCommand(const Request &request, const string &cHostname,
+        int proto) {
+    StageTimer timer(STAGE_PARSE);
+	Response returnMSG;
+    const string &filename = request.filename;
+    int port = request.dataPortNo;
+    uint64_t etag = 0;
 
-	if (*portno < 1024 || *portno > 65535) {
-		cout << "Client sent invalid data port number" << endl;
-        *portno = -1;
-        return "";
-    }
     // Check for "Get file" command
-	if ((tagContents = parseTag(GET_COMMAND, message)).compare("") != 0) 
+	if (request.verb == VERB_GET) 
     {
-		filename = tagContents;
-
         // Client sent "Get" command. 
         // Validate filename and add file to return message.
 
-        // Print status message to terminal.
-        cout << "File \"" << filename << "\" requested on port " << port << ".\n";
+        logMessage(LOG_DEBUG, "File \"%s\" requested on port %d",
+                filename.c_str(), port);
         
-        // If valid filename, add file to return string.
-        if(fileExists(filename)) {  // File exists in current directory
-            returnMSG = 
-                "<ok><name>"            + 
-                filename                + 
-                "</name><data>"         + 
-                fileAsString(filename)  + // Entire file as string. 
-                "</data></ok>";
-
-            // Print status message to terminal.
-            cout << "Sending \"" << filename << "\" to ";
-            cout << cHostname << ":" << port << endl ; 
+        if (request.delta && !request.deltaValid) {
+            errorResponse(&returnMSG, "INVALID SIGNATURES", proto);
+        }
+        // A conditional get whose ETag is cached and still matches is
+        // answered without opening the file.
+        else if (request.conditional && fileExists(filename)
+                && cachedETag(filename, &etag) && etag == request.etag) {
+            notModifiedResponse(&returnMSG, filename, etag, proto);
+            logMessage(LOG_DEBUG, "\"%s\" not modified for %s:%d",
+                    filename.c_str(), cHostname.c_str(), port);
+        }
+        // If valid filename, the file itself follows the header: from
+        // the hot-file cache, or else straight from the page cache.
+        else if(fileExists(filename) && readFile(filename, &returnMSG)) {
+            returnMSG.status = FT_STATUS_FILE;
+            if (request.wantETag)
+                etag = responseETag(filename, returnMSG);
+
+            // The ETag is of the whole file, so a range is cut after it
+            BodyRange place;
+            if (request.conditional && etag == request.etag) {
+                // Not hashed before, but unchanged all the same
+                notModifiedResponse(&returnMSG, filename, etag, proto);
+            }
+            else if (request.ranged
+                    && !narrowToRange(&returnMSG, request.range, &place)) {
+                dropBody(&returnMSG);
+                errorResponse(&returnMSG, "INVALID RANGE", proto);
+            }
+            else if (proto == PROTO_FRAMED) {
+                // A range is of the file's own bytes, so is sent as is. A
+                // delta no smaller than most of the file is not worth it.
+                int flags = 0;
+                if (request.delta && !request.ranged
+                        && deltaBody(filename, request.blockSize,
+                            request.signatures, &returnMSG))
+                    returnMSG.status = FT_STATUS_DELTA;
+                else if (request.gzip && !request.ranged
+                        && gzipBody(filename, &returnMSG))
+                    flags = FT_FLAG_GZIP;
+                // A streamed body's length is not known until its end
+                if (returnMSG.stream)
+                    flags |= FT_FLAG_CHUNKED;
+                takeBuffer(&returnMSG.header);
+                appendFrameHeader(&returnMSG.header, returnMSG.status,
+                        filename, returnMSG.stream ? 0 : bodyLength(returnMSG),
+                        request.wantETag ? &etag : NULL,
+                        request.ranged ? &place : NULL, flags);
+            }
+            else {
+                string &header = returnMSG.header;
+                takeBuffer(&header);
+                header.append("<ok><name>").append(filename).append("</name>");
+                if (request.wantETag)
+                    header.append("<" ETAG_TAG ">").append(etagHex(etag))
+                        .append("</" ETAG_TAG ">");
+                if (request.ranged)
+                    header.append("<" OFFSET_TAG ">")
+                        .append(to_string(place.offset))
+                        .append("</" OFFSET_TAG "><" FILESIZE_TAG ">")
+                        .append(to_string(place.fileSize))
+                        .append("</" FILESIZE_TAG ">");
+                header += "<data>";
+                returnMSG.trailer = "</data></ok>";
+            }
+
+            // Read ahead of the send, while the data connection opens
+            if (returnMSG.fd != -1)
+                warmHead(returnMSG.fd, returnMSG.offset, returnMSG.length);
+
+            logMessage(LOG_DEBUG, "Sending \"%s\" to %s:%d",
+                    filename.c_str(), cHostname.c_str(), port);
         }
         else {  // filename is invalid
             // Add error message to return string
-            returnMSG = "<error>FILE NOT FOUND</error>";
+            errorResponse(&returnMSG, "FILE NOT FOUND", proto);
 
-            // Print status message to terminal
-            cout << "File not found. Sending error message to ";
-            cout << cHostname << ":" << port << endl;
+            logMessage(LOG_DEBUG, "File not found. Sending error message "
+                    "to %s:%d", cHostname.c_str(), port);
         }
 	}  // End "Get file" command
+
+    // Check for "batch" command: many files over one data connection
+    else if (request.verb == VERB_BATCH)
+    {
+        vector<string> names;
+        logMessage(LOG_DEBUG, "Batch requested on port %d", port);
+        if (batchNames(request, &names)) {
+            batchResponse(&returnMSG, names, proto);
+            logMessage(LOG_DEBUG, "Sending %zu files to %s:%d",
+                    names.size(), cHostname.c_str(), port);
+        }
+        else {
+            errorResponse(&returnMSG, "BATCH OVER " +
+                    to_string(BATCH_MAX_FILES) + " FILES", proto);
+        }
+    }
 	
+    // Check for "put" command: the body follows on the data connection,
+    // and is answered once stored.
+    else if (request.verb == VERB_PUT)
+    {
+        string error;
+        logMessage(LOG_DEBUG, "Upload of \"%s\" on port %d",
+                filename.c_str(), port);
+        if (!request.sizeValid) {
+            errorResponse(&returnMSG, "INVALID SIZE", proto);
+        }
+        else if (!(returnMSG.upload = openUpload(filename, request.sized,
+                        request.size, &error))) {
+            errorResponse(&returnMSG, error, proto);
+        }
+    }
+
     // Check for "list" command.
-    else if ((tagContents = parseTag(LIST_COMMAND, message)).compare("") != 0) 
+    else if (request.verb == VERB_LIST) 
     { 
-        // Print status message to terminal
-        cout << "List directory requested on port " << port << " \n";    
+        logMessage(LOG_DEBUG, "List directory requested on port %d", port);
+
+        if (!request.list.valid) {
+            errorResponse(&returnMSG, "INVALID CURSOR OR LIMIT", proto);
+            return returnMSG;
+        }
+        if (request.paged) {
+            listPageResponse(&returnMSG, request.list, proto);
+            logMessage(LOG_DEBUG, "Sending a directory page to %s:%d",
+                    cHostname.c_str(), port);
+            return returnMSG;
+        }
 		
-        // List files in current directory into a tag-delimited string
-		string fileNames = lsCWD();
+        // List files in current directory into a delimited string.
+        // The listing is shared, not copied, into the response.
+		shared_ptr<const string> fileNames = lsCWD(proto);
+        returnMSG.data = fileNames->data();
+        returnMSG.length = fileNames->length();
+        returnMSG.owner = fileNames;
+        returnMSG.status = FT_STATUS_LIST;
 	
         //encapsulate directory object names into a message
-		returnMSG = "<ok><list>" + fileNames + " </list></ok>";
-        // Print status message to terminal.
-        cout << "Sending directory contents to ";
-        cout << cHostname << ":" << port << endl ; 
+        if (proto == PROTO_FRAMED) {
+            takeBuffer(&returnMSG.header);
+            appendFrameHeader(&returnMSG.header, FT_STATUS_LIST, "",
+                    fileNames->length());
+        }
+        else {
+		    returnMSG.header = "<ok><list>";
+            returnMSG.trailer = " </list></ok>";
+        }
+        logMessage(LOG_DEBUG, "Sending directory contents to %s:%d",
+                cHostname.c_str(), port);
 	}
 	else { 
 		//encapsulate error message into a message
-		returnMSG = "<error>Command " + tagContents + " not recognized</error>";
+        errorResponse(&returnMSG,
+                "Command " + request.command + " not recognized", proto);
 	}
 	return returnMSG;
 }
 
 /**
- * Return string representation of file
+ * Open a regular file as the body of response
  *
- * @param filename The relative path of the file to read
- * 
+ * @param filename The relative path of the file to send
+ * @param response receives the open descriptor and file length
+ *
+ * @return if the file could be opened
  */
-string fileAsString(string filename) {
-   
-    // File stream refresher provided by:
-    // www.cplusplus.com/doc/tutorial/files
-   
-    string line, fileString;
-   
-    // Attempt to open filename.
-    // ifstream default flag is RDONLY
-    ifstream file(filename);
-
-   if (file.is_open()) {
-        // Below while loop obtained from source (above)
-        // Read line-by-line from file until EOF
-        while (getline(file, line))
-            fileString.append(line + "\n"); // replace stripped newlines
-        file.close();
+bool openFile(const string &filename, Response *response) {
+    struct stat info;
+
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        logErrno("Open");
+        return false;
+    }
+    // Directories and devices have no bytes to send.
+    if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode)) {
+        close(fd);
+        return false;
     }
 
-    else
-        cout << "Error reading file";
-    
-    // While loop adds an unnecessary newline; remove that.
-    fileString = fileString.substr(0, fileString.size() -1);
-    
-    return fileString;  
+    adviseSequential(fd);
+    response->fd = fd;
+    response->offset = 0;
+    response->length = info.st_size;
+    return true;
 }
 
 /**
@@ -496,21 +1042,30 @@ string fileAsString(string filename) {
  * 
  * @return if fileName exists in this directory
  */
-bool fileExists(string fileName) {
+bool fileExists(const string &fileName) {
+    StageTimer timer(STAGE_LOOKUP);
     bool fileFound = false;
 
+    // An upload's temporary file is not there until it is renamed
+    if (uploadTempName(fileName.c_str()))
+        return false;
+    if (indexed)
+        return dirIndexContains(fileName);
+
     // Will contain path. Memory allocated by getcwd()
     char *cwd = NULL;
     struct dirent *dirStream;
     string returnString = "";
     
     // Get cwd path. Dynamically allocated.
-    cwd = getcwd(cwd, NULL);
+    cwd = getcwd(cwd, 0);
     
     // Open the current directory  
     DIR *thisDir = opendir(cwd);
     if (!thisDir) {
-        perror ("Opendir");
+        logErrno("Opendir");
+        free(cwd);
+        return false;
     }
 
     // Help obtained from the accepted answer at SO here:
@@ -535,21 +1090,29 @@ bool fileExists(string fileName) {
 /**
  * Return a listing of files in this directory
  *
- * @return string tag-delimited file and directory listing
+ * @param proto the protocol version negotiated on the connection
+ * @return string tag-delimited (protocol 1) or NUL-terminated
+ *         (protocol 2) file and directory listing
  */
-string lsCWD() {
+shared_ptr<const string> lsCWD(int proto) {
+    StageTimer timer(STAGE_LOOKUP);
+    if (indexed)
+        return dirIndexListing(proto);
+
     // Will hold path. Allocated by getcwd()
     char *cwd = NULL;
     struct dirent *dirStream;
-    string returnString = "";
+    shared_ptr<string> returnString(new string());
     
     //Get cwd path. Dynamically allocated.
-    cwd = getcwd(cwd, NULL);  
+    cwd = getcwd(cwd, 0);  
     
     //Open the current directory
     DIR *thisDir = opendir(cwd);
     if (!thisDir) {
-        perror ("Opendir");
+        logErrno("Opendir");
+        free(cwd);
+        return returnString;
     }
     
     // Help obtained from the accepted answer at SO here:
@@ -558,9 +1121,17 @@ string lsCWD() {
     // Add the string representation of each object in thisDir
     // to returnString.
     while ((dirStream = readdir(thisDir)) != NULL){
-        returnString.append("<item>");
-        returnString.append(dirStream->d_name);
-        returnString.append("</item>");
+        if (uploadTempName(dirStream->d_name))
+            continue;  // Half-written upload
+        if (proto == PROTO_FRAMED) {
+            returnString->append(dirStream->d_name);
+            returnString->push_back('\0');
+        }
+        else {
+            returnString->append("<item>");
+            returnString->append(dirStream->d_name);
+            returnString->append("</item>");
+        }
     }
      
     // Path buffer must be freed.
@@ -8,35 +8,240 @@
  * Descr:   This file contains the interfaces of ftserver, a simple 
  *          server-client file transfer application.
  *
- *          ftserver provides 2 services: 1) "list": list the contents of the
- *          current directory 2) "Get File": Get the requested file by name.
+ *          ftserver provides 3 services: 1) "list": list the contents of the
+ *          current directory 2) "Get File": Get the requested file by name
+ *          3) "Put File": store a file sent over the data connection.
  *
  *          ftserver fulfills requests over a second tcp connection on a 
  *          port specified by the client. 
  *
- *          ftserver will wait on the specified port until a client connects
- *          or a keyboard interrupt is received.  
+ *          ftserver serves any number of clients concurrently on the
+ *          specified port until a keyboard interrupt is received.  
  */
 
+#include <string>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+#include "logger.hpp"
+#include "upload.hpp"
+
 // Valid ftserver port ranges
 #define PORT_MAX 65535
 #define PORT_MIN 1024
-#define USAGE "Usage: ./ftserver <int PORTNO (1024 - 65535)>\n"
+#define USAGE "Usage: ./ftserver <int PORTNO (1024 - 65535)> [options]\n" \
+    "  --workers N     reactor threads, one per core (default 1)\n" \
+    "  --io-threads N  threads for blocking disk reads (default 4)\n" \
+    "  --cache-mb N    hot-file cache budget, 0 disables (default 64)\n" \
+    "  --gzip-cache-mb N  budget of gzip compressed files, 0 disables\n" \
+    "                  compression (default 64)\n" \
+    "  --resolve-ttl N resolve client hostnames, caching them N s\n" \
+    "                  (default 0: numeric addresses only)\n" \
+    "  --stats-file F  write server stats to file F periodically\n" \
+    "  --stats-interval N  seconds between stats writes (default 10)\n" \
+    "  --log-level L   error, warn, info or debug (default info)\n" \
+    "  --io-backend B  epoll or io_uring; io_uring falls back to epoll\n" \
+    "                  where the kernel lacks it (default epoll)\n" \
+    "  --durability D  none, file or group: when uploads are synced\n" \
+    "                  to disk before they are answered (default file)\n" \
+    "  --client-rate N cap each client's sends at N KiB/s (default 0:\n" \
+    "                  unlimited)\n" \
+    "  --total-rate N  cap all sends together at N KiB/s (default 0)\n" \
+    "  --max-clients N turn away control connections over N (default 0:\n" \
+    "                  unlimited)\n" \
+    "  --max-transfers N  answer commands busy while N are in progress\n" \
+    "                  (default 0: unlimited)\n" \
+    "  --header-timeout N  seconds to finish sending a command (10)\n" \
+    "  --idle-timeout N    seconds a client may sit idle (300)\n" \
+    "  --connect-timeout N seconds to open a data connection (5)\n" \
+    "  --send-timeout N    seconds a transfer may make no progress (60)\n" \
+    "                  A timeout of 0 never expires.\n" \
+    "  --prefetch-mb N budget of files read ahead of their gets, 0\n" \
+    "                  disables prefetching (default 64)\n" \
+    "  --prefetch-rate N  cap prefetch reads at N KiB/s (default 65536;\n" \
+    "                  0: unlimited)\n"
 
-// ftserver can only accomodate 1 concurrent connection while not
-// multi-threaded
-#define MAX_INCOMING_CONNECTIONS 1
+// Pending connections the kernel queues before accept()
+#define LISTEN_BACKLOG 4096
 
 #define RECV_BUF_LEN 1024  // Socket incoming buffer
 
 #define MAX_SEND_LEN 8096  // Max send buffer 
+#define SENDFILE_CHUNK (1 << 20)  // Max file bytes per sendfile() call
 #define MAX_HOST_LEN 256  // Client hostname buffer size
 
 // Intentifiers from client which delimit client commands inside
 // of '<>' braces (eg. "<dataport>44444</dataport>").
 #define GET_COMMAND "g" 
 #define LIST_COMMAND "l"
+#define BATCH_COMMAND "b"  // Names separated by '/', or empty with a match
+#define BATCH_SEPARATOR '/'
+#define BATCH_MAX_FILES 256  // Most files in one batch
+#define PUT_COMMAND "p"  // Store a file, sent on the data connection
+#define SIZE_TAG "size"  // With a put, the body length; without one the
+                         // body ends when the client shuts down its side
+#define STORED_TAG "stored"  // Protocol 1 reply to a put
+#define BUSY_TAG "busy"  // Overload: a refused command, or on the control
+                         // socket, a refused connection
 #define PORT_TAG "dataport"
+#define READY_TAG "ready"  // Client's data listener is open
+#define SESSION_TAG "session"  // Keep one data connection open
+#define STATS_TAG "stats"  // Server counters, answered on the control socket
+#define ETAG_TAG "etag"  // With a get: empty asks for the file's ETag, a
+                         // known ETag makes the get conditional
+#define ENCODING_TAG "encoding"  // With a get, the ',' separated encodings
+                                 // the client can decode
+#define ENCODING_GZIP "gzip"
+#define SIGNATURES_TAG "sigs"  // With a get, the signatures of the blocks
+                               // of the client's copy: a delta get
+#define BLOCKSIZE_TAG "blocksize"  // The length of those blocks
+
+// With a get, a byte range of the file
+#define OFFSET_TAG "offset"   // First byte
+#define LENGTH_TAG "length"   // Bytes from there; 0 or absent to the end
+#define FILESIZE_TAG "filesize"  // Whole file length, in protocol 1 replies
+
+// With a list, any of these asks for a paged listing
+#define CURSOR_TAG "cursor"  // Where the page starts, from the last page
+#define LIMIT_TAG "limit"    // Most names in the page
+#define PREFIX_TAG "prefix"  // Only names starting with this
+#define MATCH_TAG "match"    // Only names matching this glob
+#define STAT_TAG "stat"      // Each name with its size and mtime
+
+// Produces a compressed body while it is sent (compress.hpp)
+struct GzipStream;
+
+// A formatted response: the header, then length body bytes, then the
+// trailer. The body comes from fd starting at offset, or from data in
+// memory (kept alive by owner). Without a body, the header is the whole
+// response. A batch continues with each of parts, in order, on the same
+// data connection. A put first receives its upload, then answers. With
+// a stream, the body is the segment being sent, and the segments that
+// follow it come from the stream. A delta's body runs on through its
+// parts, which share its file.
+struct Response {
+    std::string header;
+    int fd;               // Open file supplying the body, or -1
+    bool fdShared;        // fd is kept open by owner, not by this
+    off_t offset;         // File offset of the first body byte
+    const char *data;     // In-memory body when fd is -1
+    size_t length;        // Body length in bytes
+    std::shared_ptr<const void> owner;  // Owns data
+    std::string trailer;
+    int status;           // FT_STATUS_* kind of response
+    std::vector<Response> parts;  // Batch members after this one
+    std::shared_ptr<Upload> upload;  // Body to receive before answering
+    std::shared_ptr<GzipStream> stream;  // Body made while it is sent
+
+    Response() : fd(-1), fdShared(false), offset(0), data(NULL), length(0),
+        status(0) {}
+    Response(const Response &) = default;
+    Response(Response &&) = default;
+    Response &operator=(const Response &) = default;
+    Response &operator=(Response &&) = default;
+    ~Response();  // Gives the header and trailer back to the buffer pool
+};
+
+// Client commands
+enum Verb {
+    VERB_GET,
+    VERB_LIST,
+    VERB_BATCH,
+    VERB_PUT,
+    VERB_UNKNOWN
+};
+
+// Which page of a paged listing to return
+struct ListQuery {
+    uint64_t cursor;     // Directory offset to resume at; 0 for the first
+    size_t limit;        // Most names returned
+    std::string prefix;  // Names must start with this
+    std::string match;   // Glob names must match, or empty
+    bool withStat;       // Return each entry's size and mtime
+    bool valid;          // The cursor and limit were numbers
+
+    ListQuery() : cursor(0), limit(0), withStat(false), valid(true) {}
+};
+
+// Bytes of a file to get
+struct ByteRange {
+    uint64_t offset;  // First byte
+    uint64_t length;  // Bytes from offset; 0 for the rest of the file
+    bool valid;       // The offset and length were numbers
+
+    ByteRange() : offset(0), length(0), valid(true) {}
+};
+
+// Checksums of one block of a client's copy, for a delta get
+struct BlockSignature {
+    uint32_t weak;    // Adler-32
+    uint64_t strong;  // First 8 bytes of the MD5, big-endian
+};
+
+// One client command, copied out of the receive buffer
+struct Request {
+    Verb verb;
+    std::string filename;  // File to get or put, or a batch's names
+    std::string command;   // Tag of an unrecognized command
+    int dataPortNo;        // Port to send the response to
+    bool wantETag;         // Return the file's ETag with it
+    bool conditional;      // Skip the file if its ETag is still etag
+    uint64_t etag;         // The client's ETag, when conditional
+    bool gzip;             // The client can decode a gzip body
+    bool ranged;           // Get only range of the file
+    ByteRange range;
+    bool delta;            // Get the file as a delta from the client's copy
+    bool deltaValid;       // The block size and signatures parsed
+    uint64_t blockSize;    // Length of each of the client's blocks
+    std::vector<BlockSignature> signatures;  // The client's whole blocks
+    bool paged;            // List one page, as given by list
+    ListQuery list;        // Also the match of a batch
+    bool sized;            // The client gave the length of a put
+    uint64_t size;         // The length, when sized
+    bool sizeValid;        // The length was a number
+
+    Request() : verb(VERB_UNKNOWN), dataPortNo(-1), wantETag(false),
+        conditional(false), etag(0), gzip(false), ranged(false),
+        delta(false), deltaValid(true), blockSize(0), paged(false),
+        sized(false), size(0), sizeValid(true) {}
+};
+
+struct Message;
+
+// Settings from the optional commandline arguments
+struct ServerOptions {
+    int workers;    // Reactor threads; each has its own listener
+    int ioThreads;  // Threads in the blocking I/O pool
+    int cacheMB;    // Hot-file cache budget in MiB
+    int gzipCacheMB;  // Budget of compressed variants in MiB; 0 = none
+    int resolveTtl; // Seconds client hostnames are cached; 0 = numeric
+    const char *statsFile;  // Periodic stats dump, or NULL
+    int statsInterval;      // Seconds between stats dumps
+    LogLevel logLevel;  // Most verbose records written
+    bool ioUring;       // Serve with io_uring rather than epoll
+    Durability durability;  // When uploads reach the disk
+    int clientRate;     // KiB/s each connection may send; 0 = unlimited
+    int totalRate;      // KiB/s every connection together may send
+    int maxClients;     // Control connections served at once; 0 = any
+    int maxTransfers;   // Commands in progress at once; 0 = any
+    int headerTimeout;  // Seconds from a command's first byte to its last
+    int idleTimeout;    // Seconds a client may go without a command
+    int connectTimeout; // Seconds to connect to a client's data port
+    int sendTimeout;    // Seconds a transfer may go without progress
+    int prefetchMB;     // Budget of warmed, unrequested files; 0 = none
+    int prefetchRate;   // KiB/s the prefetcher may read; 0 = unlimited
+};
+
+extern ServerOptions serverOptions;
+
+/*
+ * Process the optional commandline arguments into serverOptions.
+ * @param argc number of commandline arguments
+ * @param argv array of argument strings
+ * @return 0 on success or -1 on invalid
+ */
+int getOptions(int argc, char** argv);
 
 /*
  * Process commandline port argument.
@@ -47,7 +252,7 @@
 int getPort(int argc, char** argv);
 
 /*
- * Wait on a socket for a client to connect.   
+ * Serve clients on a socket until interrupted.
  * 
  * @param portno port number to listen on.
  * @param notKilled whether keyboard interrupt has been received
@@ -56,72 +261,75 @@ int getPort(int argc, char** argv);
  */
 int waitForClient(const char *portno, bool *notKilled);
 
-
 /**
- *  Send response to client on specified port
+ * Extract the command from a parsed client message
+ *
+ * @param message the parsed fields of one client command
+ * @param request receives the command, its argument and data port
  *
- *  @param response the entire data to send
- *  @param clientAddr ip address of client
- *  @param portno the port specified by client 
+ * @return false if the client sent an invalid data port number
  */
-int sendResponse(
-        std::string response, 
-        struct sockaddr *clientAddr, 
-        socklen_t *addrlen, 
-        int portNo);
+bool parseRequest(const Message &message, Request *request);
 
 /**
  * Process response based on client request
  *
- * @param msg Client request message
- * @param portNo the client's requested response port
+ * @param request the client's parsed command
  * @param cHostname the client's hostname 
+ * @param proto the protocol version negotiated on the connection
  *
  * @return formatted data to send back to client 
  */
-std::string parseCommand(std::string msg, int *portNo, std::string cHostname);
+Response parseCommand(const Request &request, const std::string &cHostname,
+        int proto);
 
 /**
- * Return a listing of files in this directory
+ * Turn the response of a put whose upload has ended into its reply:
+ * stored, or the upload's error.
  *
- * @return string tag-delimited file and directory listing
+ * @param proto the protocol version negotiated on the connection
  */
-std::string lsCWD();
+void storedResponse(Response *response, int proto);
 
 /**
- * Search this directory for filename
+ * Return the response to a command refused because the server is at
+ * its --max-transfers limit.
  *
- * @param fileName a file or directory name
- * 
- * @return if fileName exists in this directory
+ * @param proto the protocol version negotiated on the connection
  */
-bool fileExists(std::string filename);
+Response busyResponse(int proto);
 
 /**
- * Return string representation of file
- *
- * @param filename The relative path of the file to read
- * 
+ * Return every server counter as "name value" lines.
  */
-std::string fileAsString(std::string);
+std::string serverStats();
 
 /**
- * Return contents of tag or empty string
+ * Return a listing of files in this directory
  *
- * @param tag the string inside xml style '<>' braces to find
- * @param msg The unprocessed client request string
+ * @param proto the protocol version negotiated on the connection
+ * @return string tag-delimited (protocol 1) or NUL-terminated
+ *         (protocol 2) file and directory listing
+ */
+std::shared_ptr<const std::string> lsCWD(int proto);
+
+/**
+ * Search this directory for filename
  *
- * @return  The string between the first instance of openTag and 
- *          closeTag
+ * @param fileName a file or directory name
+ * 
+ * @return if fileName exists in this directory
  */
-std::string parseTag(std::string tag, std::string msg);
+bool fileExists(const std::string &filename);
 
 /**
- * Return a listing of files in this directory
+ * Open a regular file as the body of response
+ *
+ * @param filename The relative path of the file to send
+ * @param response receives the open descriptor and file length
  *
- * @param cHostname client hostname (for status message)
- * @return string tag-delimited file and directory listing
+ * @return if the file could be opened
  */
-std::string lsCWD();
+bool openFile(const std::string &filename, Response *response);
 
 #endif
@@ -0,0 +1,166 @@
+/**
+ * File:    iopool.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the implementation of the blocking I/O pool
+ *          and the mailboxes reactors use to receive its completions.
+ *
+ *          Jobs wait in a ring that only grows, and a mailbox swaps its
+ *          queue with a second vector that keeps its capacity, so once
+ *          both have grown to the load, handing a job to the pool and
+ *          its completion back allocates nothing beyond the closures
+ *          themselves, which are moved rather than copied.
+ */
+#include <cstdio>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "iopool.hpp"
+#include "logger.hpp"
+using namespace std;
+
+struct Mailbox {
+    int fd;                            // eventfd; readable when non-empty
+    mutex lock;
+    vector< function<void()> > queue;  // Completions not yet run
+    vector< function<void()> > ready;  // Being run; owner thread only
+};
+
+struct IoJob {
+    Mailbox *box;
+    function<void()> work;
+    function<void()> done;
+};
+
+// Never destroyed: pool threads still wait on these while exit() runs
+// static destructors, and destroying a waited-on condition hangs.
+static mutex &poolLock = *new mutex();
+static condition_variable &poolReady = *new condition_variable();
+static vector<IoJob> &jobs = *new vector<IoJob>(IO_QUEUE_INITIAL);
+static size_t jobHead = 0;   // Index of the oldest job in the ring
+static size_t jobCount = 0;  // Jobs waiting
+
+/**
+ * Add job to the ring, doubling it if full.
+ *
+ * @pre poolLock is held
+ */
+static void pushJob(IoJob &job) {
+    if (jobCount == jobs.size()) {
+        vector<IoJob> bigger(jobs.size() * 2);
+        for (size_t i = 0; i < jobCount; i++)
+            bigger[i] = move(jobs[(jobHead + i) % jobs.size()]);
+        jobs.swap(bigger);
+        jobHead = 0;
+    }
+    jobs[(jobHead + jobCount) % jobs.size()] = move(job);
+    jobCount++;
+}
+
+/**
+ * Pool thread body: run jobs forever.
+ */
+static void ioThread() {
+    while (true) {
+        IoJob job;
+        {
+            unique_lock<mutex> guard(poolLock);
+            while (jobCount == 0)
+                poolReady.wait(guard);
+            job = move(jobs[jobHead]);
+            jobHead = (jobHead + 1) % jobs.size();
+            jobCount--;
+        }
+        job.work();
+        postToMailbox(job.box, move(job.done));
+    }
+}
+
+/**
+ * Start the pool threads.
+ *
+ * @param threads number of blocking I/O threads
+ */
+void startIoPool(int threads) {
+    for (int i = 0; i < threads; i++)
+        thread(ioThread).detach();
+}
+
+/**
+ * Run work on a pool thread, then done on the owning reactor thread.
+ */
+void submitIo(Mailbox *box, function<void()> work, function<void()> done) {
+    IoJob job;
+    job.box = box;
+    job.work = move(work);
+    job.done = move(done);
+    {
+        lock_guard<mutex> guard(poolLock);
+        pushJob(job);
+    }
+    poolReady.notify_one();
+}
+
+/**
+ * Create a mailbox and its eventfd.
+ *
+ * @return new mailbox or NULL on error
+ */
+Mailbox *createMailbox() {
+    Mailbox *box = new Mailbox();
+    box->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (box->fd == -1) {
+        perror("eventfd");
+        delete box;
+        return NULL;
+    }
+    return box;
+}
+
+/**
+ * Return the mailbox eventfd, readable when completions are waiting.
+ */
+int mailboxFd(Mailbox *box) {
+    return box->fd;
+}
+
+/**
+ * Queue fn to run on the thread that owns box and wake that thread.
+ */
+void postToMailbox(Mailbox *box, function<void()> fn) {
+    uint64_t one = 1;
+    bool wasEmpty;
+    {
+        lock_guard<mutex> guard(box->lock);
+        wasEmpty = box->queue.empty();
+        box->queue.push_back(move(fn));
+    }
+    // Only the first completion of a batch needs to wake the reactor
+    if (wasEmpty && write(box->fd, &one, sizeof one) == -1)
+        logErrno("eventfd write");
+}
+
+/**
+ * Run every completion waiting in box.
+ */
+void drainMailbox(Mailbox *box) {
+    uint64_t count;
+    vector< function<void()> > &ready = box->ready;
+
+    if (read(box->fd, &count, sizeof count) == -1) {
+        // EAGAIN: another wakeup already consumed the counter
+    }
+    {
+        lock_guard<mutex> guard(box->lock);
+        ready.swap(box->queue);
+    }
+    for (size_t i = 0; i < ready.size(); i++)
+        ready[i]();
+    ready.clear();  // Keeps its capacity for the next swap
+}
@@ -0,0 +1,63 @@
+#ifndef IOPOOL_H
+#define IOPOOL_H
+/**
+ * File:    iopool.hpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the interfaces of the blocking I/O pool.
+ *
+ *          Disk reads can block for milliseconds, which would stall every
+ *          client of a reactor. The pool runs such work on its own
+ *          threads and hands the completion back to the reactor that
+ *          submitted it, so completions always run on the reactor thread.
+ */
+#include <functional>
+
+#define DEFAULT_IO_THREADS 4  // Threads in the blocking I/O pool
+#define IO_QUEUE_INITIAL 256  // Jobs the pool queue holds before growing
+
+// Receives completions from the pool on a reactor thread.
+struct Mailbox;
+
+/**
+ * Start the pool threads.
+ *
+ * @param threads number of blocking I/O threads
+ */
+void startIoPool(int threads);
+
+/**
+ * Run work on a pool thread, then done on the owning reactor thread.
+ *
+ * @param box mailbox of the submitting reactor
+ * @param work blocking work; runs on a pool thread
+ * @param done completion; runs on the reactor that owns box
+ */
+void submitIo(Mailbox *box, std::function<void()> work,
+        std::function<void()> done);
+
+/**
+ * Create a mailbox and its eventfd.
+ *
+ * @return new mailbox or NULL on error
+ */
+Mailbox *createMailbox();
+
+/**
+ * Return the mailbox eventfd, readable when completions are waiting.
+ */
+int mailboxFd(Mailbox *box);
+
+/**
+ * Run every completion waiting in box.
+ */
+void drainMailbox(Mailbox *box);
+
+/**
+ * Queue fn to run on the thread that owns box and wake that thread.
+ * Safe to call from any thread.
+ */
+void postToMailbox(Mailbox *box, std::function<void()> fn);
+
+#endif
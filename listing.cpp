@@ -0,0 +1,141 @@
+/**
+ * File:    listing.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the implementation of paged directory
+ *          listings.
+ *
+ *          Each getdents64() call fills a LIST_DENTS_BUF batch of
+ *          entries, so even a directory of millions of names is read in
+ *          a few hundred system calls and never held whole. Every entry
+ *          carries the offset just past it; the page ends on an entry
+ *          boundary, and the offset there is the next cursor.
+ */
+#include <string>
+#include <memory>
+#include <vector>
+#include <cstring>
+#include <fnmatch.h>
+#include <dirent.h>     // struct dirent64, as getdents64() fills it
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "listing.hpp"
+#include "protocol.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "upload.hpp"
+using namespace std;
+
+/**
+ * Return if name passes the prefix and glob filters of query. Uploads
+ * not yet renamed never do.
+ */
+static bool selected(const ListQuery &query, const char *name) {
+    if (uploadTempName(name))
+        return false;
+    if (strncmp(name, query.prefix.c_str(), query.prefix.length()) != 0)
+        return false;
+    return query.match.empty()
+        || fnmatch(query.match.c_str(), name, FNM_PERIOD) == 0;
+}
+
+/**
+ * Append one entry to body in the given protocol.
+ *
+ * @param dirFd the directory, for the stat() of the entry
+ */
+static void appendEntry(string *body, const ListQuery &query, int dirFd,
+        const char *name, int proto) {
+    struct stat info;
+    bool statted = query.withStat
+        && fstatat(dirFd, name, &info, AT_SYMLINK_NOFOLLOW) == 0;
+    uint64_t size = statted ? info.st_size : 0;
+    uint64_t mtime = statted ? (uint64_t)info.st_mtim.tv_sec * 1000000000
+        + info.st_mtim.tv_nsec : 0;
+
+    if (proto == PROTO_FRAMED) {
+        body->append(name);
+        body->push_back('\0');
+        if (query.withStat) {
+            char buf[FRAME_STAT_LEN];
+            putBigEndian(buf, size, 8);
+            putBigEndian(buf + 8, mtime, 8);
+            body->append(buf, FRAME_STAT_LEN);
+        }
+    }
+    else {
+        body->append("<item>");
+        body->append(name);
+        body->append("</item>");
+        if (query.withStat) {
+            body->append("<" STAT_TAG ">" + to_string(size) + " "
+                    + to_string(mtime) + "</" STAT_TAG ">");
+        }
+    }
+}
+
+/**
+ * Return one page of the current directory's listing
+ *
+ * @param query where the page starts, its size and its filters
+ * @param proto the protocol version negotiated on the connection
+ * @param next receives the cursor of the next page
+ * @param more receives whether entries remain after this page
+ *
+ * @return the page body, or NULL if the directory could not be read
+ *         (eg. the cursor is not a valid offset)
+ */
+shared_ptr<const string> listPage(const ListQuery &query, int proto,
+        uint64_t *next, bool *more) {
+    StageTimer timer(STAGE_LOOKUP);
+    shared_ptr<string> body(new string());
+    vector<char> batch(LIST_DENTS_BUF);
+    size_t count = 0;
+    uint64_t pos = query.cursor;  // Just past the last entry consumed
+
+    int dirFd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd == -1) {
+        logErrno("Open directory");
+        return NULL;
+    }
+    if (lseek(dirFd, (off_t)query.cursor, SEEK_SET) == -1) {
+        logErrno("lseek directory");
+        close(dirFd);
+        return NULL;
+    }
+
+    *more = false;
+    while (!*more) {
+        long n = syscall(SYS_getdents64, dirFd, batch.data(), batch.size());
+        if (n == -1) {
+            logErrno("getdents64");
+            close(dirFd);
+            return NULL;
+        }
+        if (n == 0)
+            break;  // End of directory
+
+        for (long off = 0; off < n; ) {
+            struct dirent64 *entry =
+                (struct dirent64 *)(batch.data() + off);
+            if (selected(query, entry->d_name)) {
+                // A full page ends before the next match, so the last
+                // page is never empty unless nothing matches.
+                if (count == query.limit) {
+                    *more = true;
+                    break;
+                }
+                appendEntry(body.get(), query, dirFd, entry->d_name, proto);
+                count++;
+            }
+            pos = (uint64_t)entry->d_off;
+            off += entry->d_reclen;
+        }
+    }
+    close(dirFd);
+    *next = pos;
+    return body;
+}
@@ -0,0 +1,47 @@
+#ifndef LISTING_H
+#define LISTING_H
+/**
+ * File:    listing.hpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the interfaces of paged directory listings.
+ *
+ *          A plain "list" returns every name in the directory in one
+ *          response. A paged list returns at most a limit of names,
+ *          optionally filtered by a prefix or a glob and with each
+ *          entry's size and mtime, plus a cursor where the next page
+ *          starts. Memory and time to the first byte are bounded by the
+ *          page, however large the directory; a session client streams
+ *          a whole listing by sending the next page request as each one
+ *          arrives.
+ *
+ *          Pages are read straight from the directory with getdents64()
+ *          in large batches. The cursor is the directory offset the
+ *          kernel reports, so a page resumes with one lseek() and stays
+ *          valid while entries are added or removed.
+ */
+#include <string>
+#include <memory>
+#include <stdint.h>
+#include "ftserver.hpp"
+
+#define LIST_DENTS_BUF (256 * 1024)  // Bytes of entries per getdents64()
+#define LIST_PAGE_DEFAULT 1000       // Names per page when unspecified
+#define LIST_PAGE_MAX 100000         // Most names per page
+
+/**
+ * Return one page of the current directory's listing
+ *
+ * @param query where the page starts, its size and its filters
+ * @param proto the protocol version negotiated on the connection
+ * @param next receives the cursor of the next page
+ * @param more receives whether entries remain after this page
+ *
+ * @return the page body, or NULL if the directory could not be read
+ *         (eg. the cursor is not a valid offset)
+ */
+std::shared_ptr<const std::string> listPage(const ListQuery &query,
+        int proto, uint64_t *next, bool *more);
+
+#endif
@@ -0,0 +1,292 @@
+/**
+ * File:    logger.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the implementation of the asynchronous
+ *          logger.
+ *
+ *          Each ring has one producer, its thread, and one consumer, the
+ *          drain thread, so head and tail need no lock: the owner only
+ *          advances head and the drain thread only advances tail. The
+ *          registry of rings is locked only when a thread logs for the
+ *          first time and when the drain thread takes a snapshot of it.
+ */
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <unistd.h>
+#include "logger.hpp"
+using namespace std;
+
+#define LOG_BATCH_LEN 65536  // Bytes written to stdout per write()
+
+// One formatted record
+struct LogRecord {
+    long long timeNs;   // Wall clock time the record was made
+    LogLevel level;
+    unsigned length;    // Bytes of text
+    char text[LOG_RECORD_LEN];
+};
+
+// Single producer, single consumer ring of records
+struct LogRing {
+    atomic<size_t> head;   // Next slot to fill; advanced by the owner
+    atomic<size_t> tail;   // Next slot to drain; advanced by the drain thread
+    atomic<bool> retired;  // The owner thread has exited
+    LogRecord slots[LOG_RING_SLOTS];
+};
+
+// Marks the thread's ring retired when the thread exits, so the drain
+// thread can free it once empty.
+struct RingOwner {
+    LogRing *ring;
+
+    RingOwner() : ring(NULL) {}
+    ~RingOwner() {
+        if (ring)
+            ring->retired.store(true, memory_order_release);
+    }
+};
+
+static const char *levelNames[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+static atomic<int> maxLevel(LOG_INFO);
+static atomic<unsigned long long> dropped(0);  // Records lost to full rings
+
+static mutex ringsLock;
+static vector<LogRing*> rings;
+static thread_local RingOwner owner;
+
+static thread drainThread;
+static atomic<bool> stopRequested(false);
+
+/**
+ * Parse a level name ("error", "warn", "info" or "debug").
+ */
+bool parseLogLevel(const string &name, LogLevel *level) {
+    static const char *names[] = { "error", "warn", "info", "debug" };
+
+    for (int i = LOG_ERROR; i <= LOG_DEBUG; i++) {
+        if (name == names[i]) {
+            *level = (LogLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Return if records at level are written.
+ */
+bool logEnabled(LogLevel level) {
+    return level <= maxLevel.load(memory_order_relaxed);
+}
+
+/**
+ * Return this thread's ring, registering it on first use.
+ */
+static LogRing *threadRing() {
+    if (owner.ring == NULL) {
+        LogRing *ring = new LogRing();
+        ring->head.store(0);
+        ring->tail.store(0);
+        ring->retired.store(false);
+
+        lock_guard<mutex> guard(ringsLock);
+        rings.push_back(ring);
+        owner.ring = ring;
+    }
+    return owner.ring;
+}
+
+/**
+ * Queue a record, formatted from format and args, at level.
+ */
+static void queueRecord(LogLevel level, const char *format, va_list args) {
+    LogRing *ring = threadRing();
+    size_t head = ring->head.load(memory_order_relaxed);
+
+    if (head - ring->tail.load(memory_order_acquire) == LOG_RING_SLOTS) {
+        dropped.fetch_add(1, memory_order_relaxed);  // Never wait
+        return;
+    }
+
+    LogRecord &record = ring->slots[head % LOG_RING_SLOTS];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record.timeNs = (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    record.level = level;
+
+    int n = vsnprintf(record.text, LOG_RECORD_LEN, format, args);
+    if (n < 0)
+        n = 0;
+    record.length = (n < LOG_RECORD_LEN) ? n : LOG_RECORD_LEN - 1;
+
+    ring->head.store(head + 1, memory_order_release);  // Publish
+}
+
+/**
+ * Queue a printf style record at level.
+ */
+void logMessage(LogLevel level, const char *format, ...) {
+    if (!logEnabled(level))
+        return;
+
+    va_list args;
+    va_start(args, format);
+    queueRecord(level, format, args);
+    va_end(args);
+}
+
+/**
+ * Queue "what: <error text of errno>" at LOG_ERROR, like perror().
+ */
+void logErrno(const char *what) {
+    char reason[128];
+    logMessage(LOG_ERROR, "%s: %s", what,
+            strerror_r(errno, reason, sizeof reason));
+}
+
+/**
+ * Write all of out to stdout and empty it.
+ */
+static void writeOut(string *out) {
+    size_t done = 0;
+    while (done < out->length()) {
+        ssize_t n = write(STDOUT_FILENO, out->data() + done,
+                out->length() - done);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            break;  // Nowhere left to report it
+        }
+        done += n;
+    }
+    out->clear();
+}
+
+/**
+ * Append record to out as one line: time, level, then the text with
+ * control characters masked, so a client cannot forge log lines.
+ */
+static void formatRecord(const LogRecord &record, string *out) {
+    char stamp[64];
+    struct tm parts;
+    time_t seconds = record.timeNs / 1000000000;
+
+    gmtime_r(&seconds, &parts);
+    size_t len = strftime(stamp, sizeof stamp, "%Y-%m-%dT%H:%M:%S", &parts);
+    snprintf(stamp + len, sizeof stamp - len, ".%06dZ %s ",
+            (int)(record.timeNs % 1000000000 / 1000),
+            levelNames[record.level]);
+    out->append(stamp);
+
+    for (unsigned i = 0; i < record.length; i++) {
+        unsigned char c = record.text[i];
+        out->push_back((c < 0x20 || c == 0x7f) ? '?' : (char)c);
+    }
+    out->push_back('\n');
+}
+
+/**
+ * Write every record queued so far and free the rings of exited threads.
+ *
+ * @return number of records written
+ */
+static size_t drainRings(string *out) {
+    static unsigned long long reportedDrops = 0;
+    vector<LogRing*> snapshot;
+    size_t count = 0;
+
+    {
+        lock_guard<mutex> guard(ringsLock);
+        snapshot = rings;
+    }
+
+    for (size_t i = 0; i < snapshot.size(); i++) {
+        LogRing *ring = snapshot[i];
+        bool retired = ring->retired.load(memory_order_acquire);
+        size_t tail = ring->tail.load(memory_order_relaxed);
+        size_t head = ring->head.load(memory_order_acquire);
+
+        for (; tail != head; tail++, count++) {
+            formatRecord(ring->slots[tail % LOG_RING_SLOTS], out);
+            if (out->length() >= LOG_BATCH_LEN)
+                writeOut(out);
+        }
+        ring->tail.store(tail, memory_order_release);  // Free the slots
+
+        // Retired is read first: nothing is written after it is set.
+        if (retired) {
+            lock_guard<mutex> guard(ringsLock);
+            for (size_t j = 0; j < rings.size(); j++) {
+                if (rings[j] == ring) {
+                    rings.erase(rings.begin() + j);
+                    break;
+                }
+            }
+            delete ring;
+        }
+    }
+
+    unsigned long long drops = dropped.load(memory_order_relaxed);
+    if (drops != reportedDrops) {
+        LogRecord note;
+        note.timeNs = chrono::duration_cast<chrono::nanoseconds>(
+                chrono::system_clock::now().time_since_epoch()).count();
+        note.level = LOG_WARN;
+        note.length = snprintf(note.text, LOG_RECORD_LEN,
+                "log_dropped total=%llu", drops);
+        formatRecord(note, out);
+        reportedDrops = drops;
+    }
+
+    writeOut(out);
+    return count;
+}
+
+/**
+ * Drain thread body: drain until stopped, then once more.
+ */
+static void drainLoop() {
+    string out;
+    out.reserve(LOG_BATCH_LEN + LOG_RECORD_LEN * 2);
+
+    while (true) {
+        // Read before draining: every record queued before the stop
+        // request is written by this pass.
+        bool stopping = stopRequested.load(memory_order_acquire);
+        size_t count = drainRings(&out);
+        if (stopping)
+            return;
+        if (count == 0)
+            this_thread::sleep_for(chrono::milliseconds(LOG_DRAIN_MS));
+    }
+}
+
+/**
+ * Start the drain thread. Records above level are discarded.
+ */
+void startLogger(LogLevel level) {
+    maxLevel.store(level);
+    drainThread = thread(drainLoop);
+}
+
+/**
+ * Write every buffered record and stop the drain thread.
+ */
+void stopLogger() {
+    if (!drainThread.joinable())
+        return;
+    stopRequested.store(true, memory_order_release);
+    drainThread.join();
+}
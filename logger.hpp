@@ -0,0 +1,68 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+/**
+ * File:    logger.hpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the interfaces of the asynchronous logger.
+ *
+ *          Logging threads never block on the terminal or a pipe. Each
+ *          thread formats its records into its own lock-free ring; a
+ *          background thread drains every ring and writes the records to
+ *          stdout in batches. When a ring is full the record is dropped
+ *          and counted, rather than stalling the thread.
+ *
+ *          Each request produces one access record of space separated
+ *          key=value fields, eg.
+ *          "access client=host port=40001 cmd=get file=a.txt status=ok
+ *          bytes=52 latency_us=310".
+ */
+#include <string>
+
+#define LOG_RING_SLOTS 1024  // Records buffered per thread
+#define LOG_RECORD_LEN 256   // Longest record text; longer is truncated
+#define LOG_DRAIN_MS 10      // Drain interval when the rings are idle
+
+// Record severities, most severe first
+enum LogLevel {
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,   // Access records
+    LOG_DEBUG
+};
+
+/**
+ * Parse a level name ("error", "warn", "info" or "debug").
+ *
+ * @return false if name is not a level
+ */
+bool parseLogLevel(const std::string &name, LogLevel *level);
+
+/**
+ * Start the drain thread. Records above level are discarded.
+ */
+void startLogger(LogLevel level);
+
+/**
+ * Write every buffered record and stop the drain thread.
+ */
+void stopLogger();
+
+/**
+ * Return if records at level are written.
+ */
+bool logEnabled(LogLevel level);
+
+/**
+ * Queue a printf style record at level.
+ */
+void logMessage(LogLevel level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * Queue "what: <error text of errno>" at LOG_ERROR, like perror().
+ */
+void logErrno(const char *what);
+
+#endif
@@ -0,0 +1,191 @@
+/**
+ * File:    metrics.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the implementation of the server metrics.
+ *
+ *          A value v at or above HIST_SUB_COUNT has its top HIST_SUB_BITS
+ *          bits kept: with m = msb(v) - HIST_SUB_BITS + 1, its bucket is
+ *          m * HIST_SUB_COUNT / 2 + (v >> m). Below HIST_SUB_COUNT, m is
+ *          0 and the bucket is v itself, so the two ranges join up.
+ */
+#include <cstdio>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include "metrics.hpp"
+#include "reactor.hpp"   // monotonicUs()
+#include "logger.hpp"
+using namespace std;
+
+// One stage's latencies. Aligned so stages do not share cache lines.
+struct alignas(64) Histogram {
+    atomic<unsigned long long> buckets[HIST_BUCKETS];
+    atomic<unsigned long long> sum;   // Microseconds
+    atomic<long long> max;
+};
+
+static const char *stageNames[STAGE_COUNT] = {
+    "accept", "parse", "lookup", "read", "connect", "send", "write",
+    "compress", "delta"
+};
+
+static const char *counterNames[CTR_COUNT] = {
+    "connections_accepted", "connections_active", "requests",
+    "request_errors", "requests_not_modified", "transfers_aborted",
+    "bytes_sent", "bytes_received", "uploads_stored", "upload_syncs",
+    "send_yields", "send_throttles", "connections_rejected",
+    "requests_busy", "timeouts", "deltas_sent", "delta_bytes_saved"
+};
+
+// Zero-initialized: static storage
+static Histogram histograms[STAGE_COUNT];
+static atomic<long long> counters[CTR_COUNT];
+
+/**
+ * Return the bucket of value us.
+ */
+static int bucketOf(long long us) {
+    if (us < 0)
+        us = 0;
+    if (us >= (1LL << HIST_MAX_BITS))
+        us = (1LL << HIST_MAX_BITS) - 1;
+    if (us < HIST_SUB_COUNT)
+        return us;
+    int m = (63 - __builtin_clzll(us)) - HIST_SUB_BITS + 1;
+    return m * (HIST_SUB_COUNT / 2) + (int)(us >> m);
+}
+
+/**
+ * Return the highest value that falls in bucket.
+ */
+static long long bucketTop(int bucket) {
+    if (bucket < HIST_SUB_COUNT)
+        return bucket;
+    int m = bucket / (HIST_SUB_COUNT / 2) - 1;
+    long long sub = bucket - m * (HIST_SUB_COUNT / 2);
+    return ((sub + 1) << m) - 1;
+}
+
+/**
+ * Record one latency of stage, in microseconds.
+ */
+void recordLatency(Stage stage, long long us) {
+    Histogram &h = histograms[stage];
+
+    h.buckets[bucketOf(us)].fetch_add(1, memory_order_relaxed);
+    h.sum.fetch_add(us < 0 ? 0 : us, memory_order_relaxed);
+
+    long long seen = h.max.load(memory_order_relaxed);
+    while (us > seen
+            && !h.max.compare_exchange_weak(seen, us, memory_order_relaxed))
+        ;
+}
+
+/**
+ * Add delta to counter; a negative delta lowers a gauge.
+ */
+void addCounter(Counter counter, long long delta) {
+    counters[counter].fetch_add(delta, memory_order_relaxed);
+}
+
+/**
+ * Append "name value" lines for the percentiles of one histogram.
+ */
+static void histogramStats(const char *name, const Histogram &h,
+        string *out) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    static const char *labels[] = { "p50", "p90", "p99", "p999" };
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long total = 0;
+
+    // Each bucket is read once, so the percentiles agree with each other
+    // even while other threads record.
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        counts[i] = h.buckets[i].load(memory_order_relaxed);
+        total += counts[i];
+    }
+
+    string prefix(name);
+    *out += prefix + "_count " + to_string(total) + "\n";
+    *out += prefix + "_mean_us "
+        + to_string(total ? h.sum.load(memory_order_relaxed) / total : 0)
+        + "\n";
+
+    // Smallest bucket holding the rank-th sample; ranks only grow. The
+    // bucket's top is reported, but never above the largest sample.
+    long long max = h.max.load(memory_order_relaxed);
+    int bucket = 0;
+    unsigned long long upTo = counts[0];  // Samples in buckets 0..bucket
+    for (int q = 0; q < 4; q++) {
+        unsigned long long rank =
+            (unsigned long long)(quantiles[q] * total + 0.999999);
+        if (rank == 0)
+            rank = 1;
+        while (upTo < rank && bucket < HIST_BUCKETS - 1)
+            upTo += counts[++bucket];
+        *out += prefix + "_" + labels[q] + "_us "
+            + to_string(total ? min(bucketTop(bucket), max) : 0) + "\n";
+    }
+    *out += prefix + "_max_us " + to_string(max) + "\n";
+}
+
+/**
+ * Return the counters and latency percentiles as "name value" lines.
+ */
+string metricsStats() {
+    string out;
+
+    for (int i = 0; i < CTR_COUNT; i++) {
+        out += string(counterNames[i]) + " "
+            + to_string(counters[i].load(memory_order_relaxed)) + "\n";
+    }
+    for (int i = 0; i < STAGE_COUNT; i++)
+        histogramStats(stageNames[i], histograms[i], &out);
+    return out;
+}
+
+/**
+ * Stats dump thread body: replace path with collect() every interval.
+ */
+static void dumpStats(string path, int interval,
+        function<string()> collect) {
+    string temp = path + ".tmp";
+
+    while (true) {
+        this_thread::sleep_for(chrono::seconds(interval));
+
+        string stats = collect();
+        FILE *file = fopen(temp.c_str(), "w");
+        if (file == NULL) {
+            logErrno("Stats file");
+            continue;
+        }
+        bool written = fwrite(stats.data(), 1, stats.length(), file)
+            == stats.length();
+        if (fclose(file) != 0 || !written) {
+            logErrno("Stats file");
+            continue;
+        }
+        // Readers see the old file or the new one, never half of one
+        if (rename(temp.c_str(), path.c_str()) == -1)
+            logErrno("Stats file");
+    }
+}
+
+/**
+ * Write collect() to path every interval seconds.
+ */
+void startStatsDump(const string &path, int interval,
+        function<string()> collect) {
+    thread(dumpStats, path, interval, collect).detach();
+}
+
+StageTimer::StageTimer(Stage stage) : stage(stage), start(monotonicUs()) {}
+
+StageTimer::~StageTimer() {
+    recordLatency(stage, monotonicUs() - start);
+}
@@ -0,0 +1,100 @@
+#ifndef METRICS_H
+#define METRICS_H
+/**
+ * File:    metrics.hpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the interfaces of the server metrics.
+ *
+ *          Counters, gauges and one latency histogram per request stage
+ *          are plain atomics, updated without locks from any thread. The
+ *          histograms are HDR style: buckets are exact below
+ *          HIST_SUB_COUNT us and grow with the value above it, so every
+ *          bucket is within 1 / (HIST_SUB_COUNT / 2) of its values across
+ *          the whole range at a fixed, small size.
+ *
+ *          Everything is reported as "name value" lines by "<stats>" on
+ *          a control connection, and optionally written to a file.
+ */
+#include <string>
+#include <functional>
+
+#define HIST_SUB_BITS 5                      // Precision bits per bucket
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)  // Exact buckets below this
+#define HIST_MAX_BITS 40                     // Values clamp at 2^40 us
+#define HIST_BUCKETS \
+    ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * (HIST_SUB_COUNT / 2))
+
+#define DEFAULT_STATS_INTERVAL 10  // Seconds between stats file writes
+
+// Request stages with a latency histogram
+enum Stage {
+    STAGE_ACCEPT,   // accept() to the client being watched
+    STAGE_PARSE,    // parseCommand() on the I/O pool
+    STAGE_LOOKUP,   // fileExists() or lsCWD()
+    STAGE_READ,     // Opening or mapping the file
+    STAGE_CONNECT,  // First data connect attempt to connected
+    STAGE_SEND,     // Connected to the last byte sent
+    STAGE_WRITE,    // One buffer of an upload body written to disk
+    STAGE_COMPRESS, // A file gzip compressed for a get
+    STAGE_DELTA,    // A file's delta found for a delta get
+    STAGE_COUNT
+};
+
+// Counters and gauges
+enum Counter {
+    CTR_ACCEPTED,     // Connections accepted
+    CTR_ACTIVE,       // Connections open now (gauge)
+    CTR_REQUESTS,     // Responses delivered
+    CTR_ERRORS,       // Of which error responses
+    CTR_NOT_MODIFIED, // Of which conditional gets answered without the file
+    CTR_ABORTED,      // Transfers abandoned before the last byte
+    CTR_BYTES_SENT,   // Response bytes written to data connections
+    CTR_BYTES_RECEIVED, // Upload bytes read from data connections
+    CTR_UPLOADS,      // Uploads stored
+    CTR_UPLOAD_SYNCS, // fdatasync() or syncfs() calls made for uploads
+    CTR_SEND_YIELDS,  // Send turns used up with bytes still to send
+    CTR_SEND_THROTTLES, // Sends held back by a rate limit
+    CTR_REJECTED,     // Connections turned away over --max-clients
+    CTR_BUSY,         // Commands answered busy over --max-transfers
+    CTR_TIMEOUTS,     // Connections or transfers past a deadline
+    CTR_DELTAS,       // Delta gets answered with a delta
+    CTR_DELTA_SAVED,  // File bytes those deltas did not send
+    CTR_COUNT
+};
+
+/**
+ * Record one latency of stage, in microseconds.
+ */
+void recordLatency(Stage stage, long long us);
+
+/**
+ * Add delta to counter; a negative delta lowers a gauge.
+ */
+void addCounter(Counter counter, long long delta);
+
+/**
+ * Return the counters and latency percentiles as "name value" lines.
+ */
+std::string metricsStats();
+
+/**
+ * Write collect() to path every interval seconds, replacing the file
+ * atomically, from a background thread.
+ */
+void startStatsDump(const std::string &path, int interval,
+        std::function<std::string()> collect);
+
+// Records the lifetime of the enclosing scope as a latency of stage.
+class StageTimer {
+public:
+    explicit StageTimer(Stage stage);
+    ~StageTimer();
+
+private:
+    Stage stage;
+    long long start;  // Monotonic us
+};
+
+#endif
@@ -0,0 +1,218 @@
+/**
+ * File:    parser.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the implementation of the client message
+ *          parser, and of parseTag(), the original single-tag scanner.
+ */
+#include <cstring>
+#include <string>
+#include <string_view>
+#include "ftserver.hpp"
+#include "protocol.hpp"
+#include "parser.hpp"
+using namespace std;
+
+// Parser states
+enum {
+    P_BETWEEN,  // Expecting '<' of the next element
+    P_TAG,      // Reading the open tag name up to '>'
+    P_CONTENT   // Looking for the matching close tag
+};
+
+/**
+ * Return whether tag is a message on its own when it comes first.
+ */
+static bool isStandalone(string_view tag) {
+    return tag == PROTO_TAG || tag == SESSION_TAG || tag == READY_TAG
+        || tag == STATS_TAG;
+}
+
+/**
+ * Prepare parser for the next message.
+ */
+void resetParser(MessageParser *parser) {
+    parser->state = P_BETWEEN;
+    parser->pos = 0;
+    parser->fieldCount = 0;
+    parser->length = 0;
+}
+
+/**
+ * Return the contents of the first element named tag
+ */
+string_view Message::field(string_view tag, bool *found) const {
+    for (int i = 0; i < fieldCount; i++) {
+        if (tags[i] == tag) {
+            if (found)
+                *found = true;
+            return contents[i];
+        }
+    }
+    if (found)
+        *found = false;
+    return string_view();
+}
+
+/**
+ * Fill message with views of the fields parser found in buf.
+ */
+static void makeMessage(const MessageParser *parser, const char *buf,
+        Message *message) {
+    message->fieldCount = parser->fieldCount;
+    for (int i = 0; i < parser->fieldCount; i++) {
+        const FieldSpan &span = parser->fields[i];
+        message->tags[i] = string_view(buf + span.tagOffset, span.tagLength);
+        message->contents[i] =
+            string_view(buf + span.contentOffset, span.contentLength);
+    }
+}
+
+/**
+ * Continue parsing the message that starts at buf.
+ */
+ParseStatus parseMessage(MessageParser *p, const char *buf, size_t len,
+        Message *message) {
+    while (p->pos < len) {
+        if (p->pos > MAX_MESSAGE_LEN)
+            return PARSE_ERROR;
+
+        switch (p->state) {
+        case P_BETWEEN:
+            // Tolerate whitespace between elements
+            if (buf[p->pos] == ' ' || buf[p->pos] == '\n'
+                    || buf[p->pos] == '\r' || buf[p->pos] == '\t') {
+                p->pos++;
+                break;
+            }
+            if (buf[p->pos] != '<')
+                return PARSE_ERROR;
+            p->tagStart = ++p->pos;
+            p->state = P_TAG;
+            break;
+
+        case P_TAG: {
+            const char *gt = (const char *)memchr(buf + p->pos, '>',
+                    len - p->pos);
+            if (gt == NULL) {
+                p->pos = len;
+                return PARSE_NEED_MORE;
+            }
+            p->tagLength = gt - (buf + p->tagStart);
+            if (p->tagLength == 0 || buf[p->tagStart] == '/')
+                return PARSE_ERROR;  // Empty tag or stray close tag
+            p->pos = p->contentStart = gt - buf + 1;
+            p->state = P_CONTENT;
+            break;
+        }
+
+        case P_CONTENT: {
+            const char *lt = (const char *)memchr(buf + p->pos, '<',
+                    len - p->pos);
+            if (lt == NULL) {
+                p->pos = len;
+                return PARSE_NEED_MORE;
+            }
+            size_t at = lt - buf;
+
+            // A close tag is "</" + tag + ">"; wait until all of it is here
+            if (len - at < p->tagLength + 3) {
+                p->pos = at;
+                return PARSE_NEED_MORE;
+            }
+            if (lt[1] != '/'
+                    || memcmp(lt + 2, buf + p->tagStart, p->tagLength) != 0
+                    || lt[2 + p->tagLength] != '>') {
+                p->pos = at + 1;  // '<' inside the content
+                break;
+            }
+
+            if (p->fieldCount == MAX_MESSAGE_FIELDS)
+                return PARSE_ERROR;
+            FieldSpan &span = p->fields[p->fieldCount++];
+            span.tagOffset = p->tagStart;
+            span.tagLength = p->tagLength;
+            span.contentOffset = p->contentStart;
+            span.contentLength = at - p->contentStart;
+            p->pos = at + p->tagLength + 3;
+            p->state = P_BETWEEN;
+
+            string_view tag(buf + p->tagStart, p->tagLength);
+            if (tag == PORT_TAG || (p->fieldCount == 1 && isStandalone(tag))) {
+                p->length = p->pos;
+                makeMessage(p, buf, message);
+                return PARSE_MESSAGE;
+            }
+            break;
+        }
+        }
+    }
+    return PARSE_NEED_MORE;
+}
+
+/**
+ * Parse a decimal port number
+ *
+ * @return the port, or -1 if text is not a valid port number
+ */
+int parsePort(string_view text) {
+    int port = 0;
+    if (text.empty() || text.length() > 5)
+        return -1;
+    for (size_t i = 0; i < text.length(); i++) {
+        if (text[i] < '0' || text[i] > '9')
+            return -1;
+        port = port * 10 + (text[i] - '0');
+    }
+    if (port < PORT_MIN || port > PORT_MAX)
+        return -1;
+    return port;
+}
+
+/**
+ * Parse a decimal unsigned 64-bit number
+ *
+ * @return false if text is empty, has a non-digit or overflows
+ */
+bool parseNumber(string_view text, uint64_t *value) {
+    uint64_t number = 0;
+    if (text.empty() || text.length() > 20)
+        return false;
+    for (size_t i = 0; i < text.length(); i++) {
+        if (text[i] < '0' || text[i] > '9')
+            return false;
+        uint64_t digit = text[i] - '0';
+        if (number > (UINT64_MAX - digit) / 10)
+            return false;
+        number = number * 10 + digit;
+    }
+    *value = number;
+    return true;
+}
+
+/**
+ * Return contents of tag or empty string
+ *
+ * @param tag the string inside xml style '<>' braces to find
+ * @param msg The unprocessed client request string
+ *
+ * @return  The string between the first instance of openTag and
+ *          closeTag
+ */
+string parseTag(string tag, string msg) {
+    int dataLength = 0;  // Character length of content between tags
+
+    // Add braces to tag to differentiate open and close tags
+    const string openTag("<" + tag + ">");
+    const string closeTag("</" + tag + ">");
+
+    // Calculate length of content
+    dataLength = msg.find(closeTag) - msg.find(openTag) - openTag.length();
+
+    // Verify content length and cut out tags.
+    if ( dataLength > 0)
+        return msg.substr((msg.find(openTag) + openTag.length()), dataLength);
+    else
+        return "";
+}
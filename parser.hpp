@@ -0,0 +1,111 @@
+#ifndef PARSER_H
+#define PARSER_H
+/**
+ * File:    parser.hpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the interfaces of the client message parser.
+ *
+ *          Clients send a stream of xml style elements
+ *          (eg. "<g>file</g><dataport>44444</dataport>"). A message is
+ *          either a command, ended by its dataport element, or a single
+ *          standalone element such as "<proto>2</proto>".
+ *
+ *          The parser is an incremental state machine over the
+ *          connection's receive buffer. It scans each byte once, however
+ *          TCP splits or coalesces the stream, keeps only offsets between
+ *          reads, and allocates nothing. Parsed fields are string_views
+ *          into the buffer, valid until the buffer changes.
+ */
+#include <string>
+#include <string_view>
+#include <stdint.h>
+
+#define MAX_MESSAGE_FIELDS 16  // Elements in one message
+#define MAX_MESSAGE_LEN 65536  // Longest message before a client is cut
+
+// Result of feeding bytes to the parser
+enum ParseStatus {
+    PARSE_NEED_MORE,  // Message incomplete; call again with more bytes
+    PARSE_MESSAGE,    // A complete message is available
+    PARSE_ERROR       // Malformed message; the connection is unusable
+};
+
+// Offsets of one element, relative to the start of its message
+struct FieldSpan {
+    uint32_t tagOffset;
+    uint32_t tagLength;
+    uint32_t contentOffset;
+    uint32_t contentLength;
+};
+
+// Parser state for one connection
+struct MessageParser {
+    int state;         // Position in the element grammar
+    size_t pos;        // Next byte to examine, from the message start
+    size_t tagStart;   // Current element's tag name
+    size_t tagLength;
+    size_t contentStart;
+    int fieldCount;
+    FieldSpan fields[MAX_MESSAGE_FIELDS];
+    size_t length;     // Bytes in the message, once complete
+};
+
+// A complete message, as views into the receive buffer
+struct Message {
+    int fieldCount;
+    std::string_view tags[MAX_MESSAGE_FIELDS];
+    std::string_view contents[MAX_MESSAGE_FIELDS];
+
+    /**
+     * Return the contents of the first element named tag
+     *
+     * @param found set to whether the element is present, if not NULL
+     */
+    std::string_view field(std::string_view tag, bool *found = NULL) const;
+};
+
+/**
+ * Prepare parser for the next message.
+ */
+void resetParser(MessageParser *parser);
+
+/**
+ * Continue parsing the message that starts at buf.
+ *
+ * @param parser state carried between calls for this message
+ * @param buf start of the message; may move between calls
+ * @param len bytes available at buf
+ * @param message receives the fields when PARSE_MESSAGE is returned;
+ *        parser->length is then the number of bytes consumed
+ */
+ParseStatus parseMessage(MessageParser *parser, const char *buf, size_t len,
+        Message *message);
+
+/**
+ * Parse a decimal port number
+ *
+ * @return the port, or -1 if text is not a valid port number
+ */
+int parsePort(std::string_view text);
+
+/**
+ * Parse a decimal unsigned 64-bit number
+ *
+ * @return false if text is empty, has a non-digit or overflows
+ */
+bool parseNumber(std::string_view text, uint64_t *value);
+
+/**
+ * Return contents of tag or empty string
+ *
+ * @param tag the string inside xml style '<>' braces to find
+ * @param msg The unprocessed client request string
+ *
+ * @return  The string between the first instance of openTag and
+ *          closeTag
+ */
+std::string parseTag(std::string tag, std::string msg);
+
+#endif
@@ -0,0 +1,452 @@
+/**
+ * File:    prefetch.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the implementation of readahead and page
+ *          cache warming.
+ *
+ *          Reactors and pool threads only queue notes; the prefetcher
+ *          thread owns the patterns and everything warmed, so nothing but
+ *          the queue is locked. For each file it keeps the few files got
+ *          next and how often, halving the counts now and then so a
+ *          pattern that stops holding fades. A file is warmed with
+ *          POSIX_FADV_WILLNEED, which starts the reads and returns, a
+ *          chunk at a time as the rate allows. A file whose first and last
+ *          pages to warm are already cached is taken to be cached whole,
+ *          as it usually is when it was sent moments ago.
+ */
+#include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>       // mincore()
+#include <sys/stat.h>
+#include "prefetch.hpp"
+#include "ratelimit.hpp"
+#include "reactor.hpp"      // monotonicMs(), monotonicUs()
+using namespace std;
+
+#define SWEEP_MS 1000   // Interval between write-offs of unused bytes
+#define TURN_CHUNKS 8   // Chunks asked for between looks at the notes
+
+// Something a reactor or pool thread asks of the prefetcher
+struct Note {
+    bool get;       // A get to learn from, or a batch member to warm
+    string prev;    // The connection's previous get, or empty
+    string client;
+    string name;
+};
+
+// A file that has come after another, and how often
+struct Successor {
+    string name;
+    unsigned count;
+};
+
+// The files that have come after one file
+struct Pattern {
+    vector<Successor> next;  // At most PREFETCH_SUCCESSORS
+    unsigned total;          // Sum of their counts
+};
+
+// A file being warmed
+struct WarmJob {
+    string name;
+    bool guessed;  // Predicted, not a batch member
+    int fd;        // -1 until opened
+    off_t offset;  // Next byte to ask for
+    size_t left;   // Bytes still to ask for
+};
+
+// Bytes warmed and not yet asked for
+struct Warmed {
+    size_t bytes;
+    bool guessed;       // Counts as a hit or as wasted
+    long long expires;  // Monotonic ms
+};
+
+// Never destroyed: the prefetcher thread still waits on these at exit.
+static mutex &prefetchLock = *new mutex();
+static condition_variable &prefetchReady = *new condition_variable();
+static deque<Note> &notes = *new deque<Note>();
+static atomic<bool> running(false);
+
+// Owned by the prefetcher thread
+static unordered_map<string, Pattern> &patterns =
+    *new unordered_map<string, Pattern>();
+static unordered_map<string, string> &lastByClient =
+    *new unordered_map<string, string>();
+static unordered_map<string, Warmed> &warmed =
+    *new unordered_map<string, Warmed>();
+static deque<WarmJob> &jobs = *new deque<WarmJob>();
+static size_t budget = 0;
+static size_t warmedBytes = 0;
+static TokenBucket bucket;
+
+static atomic<unsigned long long> notesDropped(0);
+static atomic<unsigned long long> filesWarmed(0);
+static atomic<unsigned long long> bytesWarmed(0);
+static atomic<unsigned long long> hits(0);
+static atomic<unsigned long long> wasted(0);
+static atomic<unsigned long long> resident(0);
+static atomic<unsigned long long> skipped(0);
+static atomic<unsigned long long> patternCount(0);
+
+/**
+ * Tell the kernel fd is about to be read from start to end.
+ */
+void adviseSequential(int fd) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+/**
+ * Start reading the first PREFETCH_HEAD bytes of a body that is about
+ * to be sent.
+ */
+void warmHead(int fd, off_t offset, size_t length) {
+    if (length > 0)
+        posix_fadvise(fd, offset, min(length, (size_t)PREFETCH_HEAD),
+                POSIX_FADV_WILLNEED);
+}
+
+/**
+ * Return if the page holding offset of fd is in the page cache. Unlike
+ * reading it, mapping it and asking does not start any I/O.
+ */
+static bool cached(int fd, off_t offset) {
+    static const long pageSize = sysconf(_SC_PAGESIZE);
+    off_t page = offset - offset % pageSize;
+    void *map = mmap(NULL, pageSize, PROT_READ, MAP_SHARED, fd, page);
+    if (map == MAP_FAILED)
+        return false;
+    unsigned char in = 0;
+    bool found = mincore(map, pageSize, &in) == 0 && (in & 1);
+    munmap(map, pageSize);
+    return found;
+}
+
+/**
+ * Count one more time that next came after name.
+ */
+static void learn(const string &name, const string &next) {
+    unordered_map<string, Pattern>::iterator found = patterns.find(name);
+    if (found == patterns.end()) {
+        if (patterns.size() >= PREFETCH_PATTERNS_MAX)
+            patterns.erase(patterns.begin());  // Any one; rarely reached
+        found = patterns.insert(make_pair(name, Pattern())).first;
+        found->second.total = 0;
+    }
+    Pattern &pattern = found->second;
+
+    size_t i = 0;
+    while (i < pattern.next.size() && pattern.next[i].name != next)
+        i++;
+    if (i == pattern.next.size()) {
+        Successor successor = { next, 0 };
+        if (pattern.next.size() < PREFETCH_SUCCESSORS) {
+            pattern.next.push_back(successor);
+        }
+        else {  // Replace the rarest
+            i = 0;
+            for (size_t j = 1; j < pattern.next.size(); j++) {
+                if (pattern.next[j].count < pattern.next[i].count)
+                    i = j;
+            }
+            pattern.total -= pattern.next[i].count;
+            pattern.next[i] = successor;
+        }
+    }
+    pattern.next[i].count++;
+    pattern.total++;
+
+    if (pattern.total >= PREFETCH_DECAY) {
+        pattern.total = 0;
+        for (size_t j = 0; j < pattern.next.size(); j++) {
+            pattern.next[j].count /= 2;
+            pattern.total += pattern.next[j].count;
+        }
+    }
+    patternCount = patterns.size();
+}
+
+/**
+ * Return the file that usually comes after name, or NULL if none does.
+ */
+static const string *likelyNext(const string &name) {
+    unordered_map<string, Pattern>::const_iterator found = patterns.find(name);
+    if (found == patterns.end())
+        return NULL;
+    const Pattern &pattern = found->second;
+    const Successor *best = NULL;
+    for (size_t i = 0; i < pattern.next.size(); i++) {
+        if (best == NULL || pattern.next[i].count > best->count)
+            best = &pattern.next[i];
+    }
+    if (best == NULL || best->count < PREFETCH_MIN_SEEN
+            || best->count * 100 < pattern.total * PREFETCH_MIN_PERCENT)
+        return NULL;
+    return &best->name;
+}
+
+/**
+ * Queue name to be warmed, unless it is warm or queued already.
+ *
+ * @param guessed if name is predicted, rather than sure to be sent
+ */
+static void queueWarm(const string &name, bool guessed) {
+    if (warmed.count(name) > 0)
+        return;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (jobs[i].name == name)
+            return;
+    }
+    if (jobs.size() >= PREFETCH_QUEUE_MAX) {
+        skipped++;
+        return;
+    }
+    WarmJob job = { name, guessed, -1, 0, 0 };
+    jobs.push_back(job);
+}
+
+/**
+ * Learn from a get, and queue the files likely to be got after it.
+ */
+static void handleGet(const Note &note) {
+    unordered_map<string, Warmed>::iterator used = warmed.find(note.name);
+    if (used != warmed.end()) {
+        if (used->second.guessed)
+            hits++;
+        warmedBytes -= used->second.bytes;
+        warmed.erase(used);
+    }
+    // Too late to warm it: its own transfer is reading it
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (jobs[i].name == note.name) {
+            if (jobs[i].fd != -1)
+                close(jobs[i].fd);
+            jobs.erase(jobs.begin() + i);
+            break;
+        }
+    }
+
+    string prev = note.prev;
+    if (prev.empty()) {
+        unordered_map<string, string>::iterator last =
+            lastByClient.find(note.client);
+        if (last != lastByClient.end())
+            prev = last->second;
+    }
+    if (lastByClient.size() >= PREFETCH_CLIENTS_MAX
+            && lastByClient.count(note.client) == 0)
+        lastByClient.clear();
+    lastByClient[note.client] = note.name;
+    if (!prev.empty() && prev != note.name)
+        learn(prev, note.name);
+
+    const string *next = &note.name;
+    for (int depth = 0; depth < PREFETCH_DEPTH; depth++) {
+        if ((next = likelyNext(*next)) == NULL || *next == note.name)
+            break;
+        queueWarm(*next, true);
+    }
+}
+
+/**
+ * Open the file of job and decide how much of it to warm.
+ *
+ * @return false if it is not to be warmed
+ */
+static bool startJob(WarmJob *job) {
+    struct stat info;
+    job->fd = open(job->name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (job->fd == -1)
+        return false;
+    if (fstat(job->fd, &info) == -1 || !S_ISREG(info.st_mode)
+            || info.st_size == 0)
+        return false;
+
+    size_t bytes = min((size_t)info.st_size, budget / PREFETCH_FILE_SHARE);
+    if (cached(job->fd, 0) && cached(job->fd, bytes - 1)) {
+        resident++;
+        return false;
+    }
+    if (warmedBytes + bytes > budget) {
+        skipped++;
+        return false;
+    }
+    Warmed entry = { bytes, job->guessed, monotonicMs() + PREFETCH_TTL_MS };
+    warmed[job->name] = entry;
+    warmedBytes += bytes;
+    filesWarmed++;
+    job->offset = 0;
+    job->left = bytes;
+    return true;
+}
+
+/**
+ * Ask for the next chunk of the front job, as the rate allows.
+ *
+ * @return false if the rate allows nothing now
+ */
+static bool warmChunk() {
+    WarmJob &job = jobs.front();
+    if (job.fd == -1 && !startJob(&job)) {
+        if (job.fd != -1)
+            close(job.fd);
+        jobs.pop_front();
+        return true;
+    }
+
+    size_t allowed = availableTokens(&bucket, monotonicUs());
+    if (allowed == 0)
+        return false;
+    size_t n = min(min(job.left, (size_t)PREFETCH_CHUNK), allowed);
+    posix_fadvise(job.fd, job.offset, n, POSIX_FADV_WILLNEED);
+    spendTokens(&bucket, n);
+    bytesWarmed += n;
+    job.offset += n;
+    job.left -= n;
+    if (job.left == 0) {
+        close(job.fd);
+        jobs.pop_front();
+    }
+    return true;
+}
+
+/**
+ * Write off warmed bytes that have gone unused past PREFETCH_TTL_MS.
+ */
+static void sweepWarmed(long long nowMs) {
+    unordered_map<string, Warmed>::iterator it = warmed.begin();
+    while (it != warmed.end()) {
+        if (it->second.expires <= nowMs) {
+            if (it->second.guessed)
+                wasted++;
+            warmedBytes -= it->second.bytes;
+            it = warmed.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+/**
+ * Prefetcher thread body: learn from notes and warm files, forever.
+ */
+static void prefetchThread() {
+    deque<Note> ready;
+    long long nextSweep = monotonicMs() + SWEEP_MS;
+
+    while (true) {
+        {
+            unique_lock<mutex> guard(prefetchLock);
+            if (notes.empty()) {
+                if (jobs.empty()) {
+                    prefetchReady.wait_for(guard,
+                            chrono::milliseconds(SWEEP_MS));
+                }
+                else {
+                    long long waitUs = tokenWaitUs(&bucket, monotonicUs());
+                    if (waitUs > 0)
+                        prefetchReady.wait_for(guard,
+                                chrono::microseconds(waitUs));
+                }
+            }
+            ready.swap(notes);
+        }
+
+        for (size_t i = 0; i < ready.size(); i++) {
+            if (ready[i].get)
+                handleGet(ready[i]);
+            else
+                queueWarm(ready[i].name, false);
+        }
+        ready.clear();
+
+        // A few chunks a turn, so new notes are not kept waiting
+        for (int i = 0; i < TURN_CHUNKS && !jobs.empty(); i++) {
+            if (!warmChunk())
+                break;
+        }
+
+        long long nowMs = monotonicMs();
+        if (nowMs >= nextSweep) {
+            sweepWarmed(nowMs);
+            nextSweep = nowMs + SWEEP_MS;
+        }
+    }
+}
+
+/**
+ * Start the prefetcher thread.
+ */
+void startPrefetcher(size_t bytes, uint64_t rate) {
+    if (bytes == 0)
+        return;
+    budget = bytes;
+    initBucket(&bucket, rate);
+    running = true;
+    thread(prefetchThread).detach();
+}
+
+/**
+ * Hand note to the prefetcher thread, unless too many are waiting.
+ */
+static void postNote(Note &note) {
+    {
+        lock_guard<mutex> guard(prefetchLock);
+        if (notes.size() >= PREFETCH_NOTES_MAX) {
+            notesDropped++;
+            return;
+        }
+        notes.push_back(move(note));
+    }
+    prefetchReady.notify_one();
+}
+
+/**
+ * Record a get of name, to learn from and to warm the files likely to
+ * be got next.
+ */
+void noteGet(const string &prev, const string &client, const string &name) {
+    if (!running)
+        return;
+    Note note = { true, prev, client, name };
+    postNote(note);
+}
+
+/**
+ * Warm each of names in order, as the members of a batch about to be
+ * sent.
+ */
+void prefetchFiles(const vector<string> &names) {
+    if (!running)
+        return;
+    for (size_t i = 0; i < names.size(); i++) {
+        Note note = { false, "", "", names[i] };
+        postNote(note);
+    }
+}
+
+/**
+ * Return the prefetcher counters as "name value" lines.
+ */
+string prefetchStats() {
+    return "prefetch_files " + to_string(filesWarmed.load()) + "\n"
+        + "prefetch_bytes " + to_string(bytesWarmed.load()) + "\n"
+        + "prefetch_hits " + to_string(hits.load()) + "\n"
+        + "prefetch_wasted " + to_string(wasted.load()) + "\n"
+        + "prefetch_resident " + to_string(resident.load()) + "\n"
+        + "prefetch_skipped " + to_string(skipped.load()) + "\n"
+        + "prefetch_dropped " + to_string(notesDropped.load()) + "\n"
+        + "prefetch_patterns " + to_string(patternCount.load()) + "\n";
+}
@@ -0,0 +1,89 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+/**
+ * File:    prefetch.hpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the interfaces of readahead and page cache
+ *          warming.
+ *
+ *          Every file opened to be sent is marked sequential, so the
+ *          kernel reads ahead in larger windows, and the start of a get's
+ *          body is asked for as the get is answered, before the data
+ *          connection is up. Beyond that, a prefetcher thread learns
+ *          which file each client tends to get after which, and asks the
+ *          kernel to read the likely next files, and the later members of
+ *          a batch, into the page cache ahead of their gets. Warmed bytes
+ *          not yet asked for are held to a memory budget, and the reads
+ *          to a rate, so guessing wrong costs a bounded amount of I/O.
+ */
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DEFAULT_PREFETCH_MB 64        // Budget of warmed, unrequested bytes
+#define DEFAULT_PREFETCH_RATE 65536   // KiB/s the prefetcher may read
+#define PREFETCH_HEAD (1 << 20)       // Bytes of a body warmed as it starts
+#define PREFETCH_CHUNK (1 << 20)      // Bytes asked for at a time
+#define PREFETCH_FILE_SHARE 4         // A file warms at most budget / this
+#define PREFETCH_TTL_MS 30000         // Warmed bytes unused this long are
+                                      // written off
+#define PREFETCH_SUCCESSORS 4         // Next files remembered per file
+#define PREFETCH_MIN_SEEN 2           // Times a file must have come next
+#define PREFETCH_MIN_PERCENT 30       // Of the times any file came next
+#define PREFETCH_DECAY 64             // Counts halve once they total this
+#define PREFETCH_DEPTH 2              // Files warmed ahead along a pattern
+#define PREFETCH_QUEUE_MAX 256        // Files waiting to be warmed
+#define PREFETCH_NOTES_MAX 4096       // Gets waiting to be learned from
+#define PREFETCH_PATTERNS_MAX 65536   // Files whose successors are kept
+#define PREFETCH_CLIENTS_MAX 4096     // Clients whose last get is kept
+
+/**
+ * Start the prefetcher thread. Until it is started, noteGet() and
+ * prefetchFiles() do nothing.
+ *
+ * @param budget most bytes warmed and not yet asked for
+ * @param rate bytes per second the prefetcher may read; 0 is unlimited
+ */
+void startPrefetcher(size_t budget, uint64_t rate);
+
+/**
+ * Tell the kernel fd is about to be read from start to end.
+ */
+void adviseSequential(int fd);
+
+/**
+ * Start reading the first PREFETCH_HEAD bytes of a body that is about
+ * to be sent, without waiting for them.
+ *
+ * @param offset file offset of the body
+ * @param length bytes in the body
+ */
+void warmHead(int fd, off_t offset, size_t length);
+
+/**
+ * Record a get of name, to learn from and to warm the files likely to
+ * be got next. Returns at once; safe to call from any thread.
+ *
+ * @param prev the file the same connection last got, or empty
+ * @param client the client's hostname, whose last get stands in for
+ *        prev when the connection has had none
+ */
+void noteGet(const std::string &prev, const std::string &client,
+        const std::string &name);
+
+/**
+ * Warm each of names in order, as the members of a batch about to be
+ * sent. Returns at once; safe to call from any thread.
+ */
+void prefetchFiles(const std::vector<std::string> &names);
+
+/**
+ * Return the prefetcher counters as "name value" lines.
+ */
+std::string prefetchStats();
+
+#endif
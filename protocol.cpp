@@ -0,0 +1,111 @@
+/**
+ * File:    protocol.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the encoding and decoding of protocol 2
+ *          response headers.
+ */
+#include <string>
+#include "protocol.hpp"
+using namespace std;
+
+/**
+ * Store the low bytes of value big-endian at buf.
+ */
+void putBigEndian(char *buf, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        buf[i] = (char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+/**
+ * Load a big-endian integer of the given width from buf.
+ */
+static uint64_t getBigEndian(const char *buf, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value = (value << 8) | (unsigned char)buf[i];
+    return value;
+}
+
+/**
+ * Append a protocol 2 header to out, followed by name, and by etag and
+ * range if given.
+ *
+ * @param out the buffer the header is appended to
+ * @param status one of FT_STATUS_*
+ * @param name the file name, or empty
+ * @param contentLength number of body bytes that follow
+ * @param etag the file's ETag, or NULL
+ * @param range where a partial body lies in the file, or NULL
+ * @param flags more FT_FLAG_* bits, of which nothing follows the name
+ */
+void appendFrameHeader(string *out, int status, const string &name,
+        uint64_t contentLength, const uint64_t *etag, const BodyRange *range,
+        int flags) {
+    char buf[FRAME_HEADER_LEN];
+
+    buf[0] = FRAME_MAGIC_0;
+    buf[1] = FRAME_MAGIC_1;
+    buf[2] = PROTO_FRAMED;
+    buf[3] = (char)status;
+    putBigEndian(buf + 4, name.length(), 2);
+    putBigEndian(buf + 6, flags | (etag ? FT_FLAG_ETAG : 0)
+            | (range ? FT_FLAG_RANGE : 0), 2);
+    putBigEndian(buf + 8, contentLength, 8);
+
+    out->append(buf, FRAME_HEADER_LEN);
+    out->append(name);
+    if (etag) {
+        char tag[FRAME_ETAG_LEN];
+        putBigEndian(tag, *etag, FRAME_ETAG_LEN);
+        out->append(tag, FRAME_ETAG_LEN);
+    }
+    if (range) {
+        char place[FRAME_RANGE_LEN];
+        putBigEndian(place, range->offset, 8);
+        putBigEndian(place + 8, range->fileSize, 8);
+        out->append(place, FRAME_RANGE_LEN);
+    }
+}
+
+/**
+ * Append a protocol 2 header for one page of a paged listing to out.
+ *
+ * @param out the buffer the header is appended to
+ * @param contentLength number of body bytes that follow
+ * @param cursor where the next page starts, or NULL on the last page
+ * @param withStat whether each name in the body has its size and mtime
+ */
+void appendListPageHeader(string *out, uint64_t contentLength,
+        const uint64_t *cursor, bool withStat) {
+    int flags = (cursor ? FT_FLAG_CURSOR : 0) | (withStat ? FT_FLAG_STAT : 0);
+    appendFrameHeader(out, FT_STATUS_LIST, "", contentLength, NULL, NULL,
+            flags);
+    if (cursor) {
+        char buf[FRAME_CURSOR_LEN];
+        putBigEndian(buf, *cursor, FRAME_CURSOR_LEN);
+        out->append(buf, FRAME_CURSOR_LEN);
+    }
+}
+
+/**
+ * Decode a protocol 2 header.
+ *
+ * @param buf at least FRAME_HEADER_LEN bytes
+ * @param header receives the decoded fields
+ *
+ * @return false if buf does not start with a valid header
+ */
+bool parseFrameHeader(const char *buf, FrameHeader *header) {
+    if (buf[0] != FRAME_MAGIC_0 || buf[1] != FRAME_MAGIC_1)
+        return false;
+    header->version = (uint8_t)buf[2];
+    header->status = (uint8_t)buf[3];
+    header->nameLength = (uint16_t)getBigEndian(buf + 4, 2);
+    header->flags = (uint16_t)getBigEndian(buf + 6, 2);
+    header->contentLength = getBigEndian(buf + 8, 8);
+    return header->version == PROTO_FRAMED;
+}
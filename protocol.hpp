@@ -0,0 +1,163 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+/**
+ * File:    protocol.hpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the wire format of ftserver responses.
+ *
+ *          Protocol 1 wraps every response in xml style tags
+ *          (eg. "<ok><name>f</name><data>...</data></ok>"), which breaks on
+ *          binary data and forces the client to buffer and scan it.
+ *
+ *          Protocol 2 is negotiated per control connection: the client
+ *          sends "<proto>2</proto>" and the server answers with the version
+ *          it will use, also as "<proto>N</proto>" on the control
+ *          connection. Every protocol 2 response starts with a fixed
+ *          16 byte header (all integers big-endian):
+ *
+ *              offset  size  field
+ *                   0     2  magic "FT"
+ *                   2     1  version (2)
+ *                   3     1  status (FT_STATUS_*)
+ *                   4     2  name length
+ *                   6     2  flags (FT_FLAG_*)
+ *                   8     8  content length
+ *
+ *          followed by the name, the 8 byte ETag if FT_FLAG_ETAG is set,
+ *          the 8 byte cursor of the next page if FT_FLAG_CURSOR is set,
+ *          the 8 byte offset of the body in the file and the 8 byte file
+ *          length if FT_FLAG_RANGE is set, and then content length raw
+ *          bytes. With FT_FLAG_GZIP, a file body is a gzip stream of the
+ *          file, and content length is the compressed length. With
+ *          FT_FLAG_CHUNKED, content length is 0 and the body is a sequence
+ *          of chunks, each its 4 byte length and then that many bytes,
+ *          ended by an empty chunk. A list body is a sequence of
+ *          NUL-terminated names; with FT_FLAG_STAT each name is followed
+ *          by the entry's 8 byte size and 8 byte mtime in ns since the
+ *          epoch. A page without FT_FLAG_CURSOR is the last. An error body
+ *          is the error message. A "not modified" response has no body;
+ *          its ETag is the one the client sent.
+ *
+ *          A batch is a sequence of responses on one data connection: a
+ *          file response for each member, or an error response named
+ *          after a member that could not be read, then an
+ *          FT_STATUS_BATCH_END header. Each member costs its 16 byte
+ *          header and its name.
+ *
+ *          A delta get is answered with an FT_STATUS_DELTA response
+ *          when the delta is enough smaller than the file, and else with
+ *          the whole file. A delta body is the 16 byte MD5 of the whole
+ *          new file, then a sequence of operations, each a one byte
+ *          code: FT_DELTA_COPY, followed by the 4 byte index of a block
+ *          of the client's copy and a 4 byte count of consecutive blocks
+ *          from it; or FT_DELTA_LITERAL, followed by an 8 byte length and
+ *          that many bytes of the new file.
+ *
+ *          A put is answered once its upload is on disk, on the data
+ *          connection that carried the body: an FT_STATUS_STORED header
+ *          named after the file, with no body, or an error response.
+ */
+#include <string>
+#include <stdint.h>
+
+#define PROTO_TAG "proto"
+#define PROTO_LEGACY 1  // xml style tags
+#define PROTO_FRAMED 2  // Fixed binary header, raw body
+
+#define FRAME_HEADER_LEN 16
+#define FRAME_MAGIC_0 'F'
+#define FRAME_MAGIC_1 'T'
+
+// Response status in a protocol 2 header
+#define FT_STATUS_FILE  0  // Body is the named file
+#define FT_STATUS_LIST  1  // Body is a directory listing
+#define FT_STATUS_ERROR 2  // Body is an error message
+#define FT_STATUS_NOT_MODIFIED 3  // The client's copy is current; no body
+#define FT_STATUS_BATCH_END 4  // Ends a batch; no name or body
+#define FT_STATUS_STORED 5  // The named upload is stored; no body
+#define FT_STATUS_BUSY 6    // Refused for overload; body is a message
+#define FT_STATUS_DELTA 7   // Body rebuilds the named file from the
+                            // client's copy
+
+// Header flags
+#define FT_FLAG_ETAG 0x1    // The file's ETag follows the name
+#define FT_FLAG_CURSOR 0x2  // The next page's cursor follows the name
+#define FT_FLAG_STAT 0x4    // List entries carry their size and mtime
+#define FT_FLAG_RANGE 0x8   // The body is a range; its place follows
+#define FT_FLAG_GZIP 0x10   // The body is the file, gzip compressed
+#define FT_FLAG_CHUNKED 0x20  // The body is in chunks of unknown total
+#define FRAME_CHUNK_LEN 4   // Length before each chunk of a chunked body
+#define FRAME_ETAG_LEN 8
+#define FRAME_CURSOR_LEN 8
+#define FRAME_STAT_LEN 16   // Size and mtime after each list entry name
+#define FRAME_RANGE_LEN 16  // Offset and file length of a range body
+
+// Delta body operations
+#define FT_DELTA_COPY 'C'     // Blocks of the client's copy
+#define FT_DELTA_LITERAL 'L'  // Bytes of the new file
+#define FT_DELTA_COPY_LEN 9      // Code, first block and block count
+#define FT_DELTA_LITERAL_LEN 9   // Code and length, before the bytes
+#define FT_DELTA_DIGEST_LEN 16   // MD5 of the new file, first in the body
+
+// Where a range body lies in its file
+struct BodyRange {
+    uint64_t offset;    // File offset of the first body byte
+    uint64_t fileSize;  // Length of the whole file
+};
+
+// Decoded protocol 2 response header
+struct FrameHeader {
+    uint8_t version;
+    uint8_t status;
+    uint16_t nameLength;
+    uint16_t flags;
+    uint64_t contentLength;
+};
+
+/**
+ * Append a protocol 2 header to out, followed by name, and by etag and
+ * range if given. Headers are appended to a caller's buffer so a pooled
+ * one can be reused without allocating.
+ *
+ * @param out the buffer the header is appended to
+ * @param status one of FT_STATUS_*
+ * @param name the file name, or empty
+ * @param contentLength number of body bytes that follow
+ * @param etag the file's ETag, or NULL
+ * @param range where a partial body lies in the file, or NULL
+ * @param flags more FT_FLAG_* bits, of which nothing follows the name
+ */
+void appendFrameHeader(std::string *out, int status,
+        const std::string &name, uint64_t contentLength,
+        const uint64_t *etag = NULL, const BodyRange *range = NULL,
+        int flags = 0);
+
+/**
+ * Append a protocol 2 header for one page of a paged listing to out.
+ *
+ * @param out the buffer the header is appended to
+ * @param contentLength number of body bytes that follow
+ * @param cursor where the next page starts, or NULL on the last page
+ * @param withStat whether each name in the body has its size and mtime
+ */
+void appendListPageHeader(std::string *out, uint64_t contentLength,
+        const uint64_t *cursor, bool withStat);
+
+/**
+ * Store the low bytes of value big-endian at buf.
+ */
+void putBigEndian(char *buf, uint64_t value, int bytes);
+
+/**
+ * Decode a protocol 2 header.
+ *
+ * @param buf at least FRAME_HEADER_LEN bytes
+ * @param header receives the decoded fields
+ *
+ * @return false if buf does not start with a valid header
+ */
+bool parseFrameHeader(const char *buf, FrameHeader *header);
+
+#endif
@@ -0,0 +1,101 @@
+/**
+ * File:    ratelimit.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the implementation of send rate limits.
+ */
+#include <cstdint>
+#include <mutex>
+#include "ratelimit.hpp"
+#include "reactor.hpp"      // monotonicUs()
+using namespace std;
+
+// Never destroyed: reactors may still send while the process exits.
+static mutex &globalLock = *new mutex();
+static TokenBucket globalBucket = { 0, 0, 0, 0 };
+
+/**
+ * Add the tokens earned since the last refill.
+ */
+static void refill(TokenBucket *bucket, long long nowUs) {
+    if (nowUs > bucket->lastUs) {
+        bucket->tokens += bucket->rate * (nowUs - bucket->lastUs) / 1e6;
+        if (bucket->tokens > bucket->burst)
+            bucket->tokens = bucket->burst;
+        bucket->lastUs = nowUs;
+    }
+}
+
+/**
+ * Start bucket full, at rate bytes per second; 0 is unlimited.
+ */
+void initBucket(TokenBucket *bucket, uint64_t rate) {
+    bucket->rate = (double)rate;
+    bucket->burst = (double)rate / RATE_BURST_DIV;
+    if (bucket->burst < RATE_BURST_MIN)
+        bucket->burst = RATE_BURST_MIN;
+    bucket->tokens = bucket->burst;
+    bucket->lastUs = monotonicUs();
+}
+
+/**
+ * Return how many bytes may be sent now.
+ */
+size_t availableTokens(TokenBucket *bucket, long long nowUs) {
+    if (bucket->rate == 0)
+        return SIZE_MAX;
+    refill(bucket, nowUs);
+    return (bucket->tokens < RATE_MIN_SEND) ? 0 : (size_t)bucket->tokens;
+}
+
+/**
+ * Take the tokens of bytes sent.
+ */
+void spendTokens(TokenBucket *bucket, size_t bytes) {
+    if (bucket->rate != 0)
+        bucket->tokens -= (double)bytes;
+}
+
+/**
+ * Return microseconds until availableTokens() is not 0.
+ */
+long long tokenWaitUs(const TokenBucket *bucket, long long nowUs) {
+    if (bucket->rate == 0)
+        return 0;
+    double tokens = bucket->tokens
+        + bucket->rate * (nowUs - bucket->lastUs) / 1e6;
+    if (tokens >= RATE_MIN_SEND)
+        return 0;
+    return (long long)((RATE_MIN_SEND - tokens) * 1e6 / bucket->rate) + 1;
+}
+
+/**
+ * Limit every reactor together to rate bytes per second.
+ */
+void setGlobalRate(uint64_t rate) {
+    initBucket(&globalBucket, rate);
+}
+
+// The rate is fixed before the reactors start, so unlimited needs no lock.
+
+size_t globalTokens(long long nowUs) {
+    if (globalBucket.rate == 0)
+        return SIZE_MAX;
+    lock_guard<mutex> guard(globalLock);
+    return availableTokens(&globalBucket, nowUs);
+}
+
+void spendGlobalTokens(size_t bytes) {
+    if (globalBucket.rate == 0)
+        return;
+    lock_guard<mutex> guard(globalLock);
+    spendTokens(&globalBucket, bytes);
+}
+
+long long globalWaitUs(long long nowUs) {
+    if (globalBucket.rate == 0)
+        return 0;
+    lock_guard<mutex> guard(globalLock);
+    return tokenWaitUs(&globalBucket, nowUs);
+}
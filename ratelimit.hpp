@@ -0,0 +1,66 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+/**
+ * File:    ratelimit.hpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the interfaces of send rate limits.
+ *
+ *          A limit is a token bucket: tokens are bytes, added at the
+ *          limit's rate up to a burst of a tenth of a second's worth.
+ *          Each connection may have its own bucket, and every reactor
+ *          shares one global bucket. A send spends what it wrote, and
+ *          may overdraw a bucket a little when reactors race for the
+ *          global one; the debt is paid by waiting longer.
+ */
+#include <cstddef>
+#include <stdint.h>
+
+#define RATE_MIN_SEND (16 * 1024)  // Fewest bytes a limited send waits for
+#define RATE_BURST_MIN (64 * 1024) // Smallest burst of a limited bucket
+#define RATE_BURST_DIV 10          // Burst is rate / this (0.1 s)
+
+struct TokenBucket {
+    double rate;       // Bytes per second; 0 for unlimited
+    double burst;      // Most tokens saved up
+    double tokens;     // Bytes that may be sent now; negative is debt
+    long long lastUs;  // Monotonic us of the last refill
+};
+
+/**
+ * Start bucket full, at rate bytes per second; 0 is unlimited.
+ */
+void initBucket(TokenBucket *bucket, uint64_t rate);
+
+/**
+ * Return how many bytes may be sent now: 0 while fewer than
+ * RATE_MIN_SEND tokens are saved up, and SIZE_MAX if unlimited.
+ */
+size_t availableTokens(TokenBucket *bucket, long long nowUs);
+
+/**
+ * Take the tokens of bytes sent.
+ */
+void spendTokens(TokenBucket *bucket, size_t bytes);
+
+/**
+ * Return microseconds until availableTokens() is not 0.
+ */
+long long tokenWaitUs(const TokenBucket *bucket, long long nowUs);
+
+/**
+ * Limit every reactor together to rate bytes per second; 0 is
+ * unlimited. Call before the reactors start.
+ */
+void setGlobalRate(uint64_t rate);
+
+/**
+ * availableTokens(), spendTokens() and tokenWaitUs() of the global
+ * bucket. Safe to call from any thread.
+ */
+size_t globalTokens(long long nowUs);
+void spendGlobalTokens(size_t bytes);
+long long globalWaitUs(long long nowUs);
+
+#endif
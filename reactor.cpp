@@ -0,0 +1,2096 @@
+/**
+ * File:    reactor.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the implementation of the ftserver event
+ *          loop: a non-blocking, edge-triggered epoll reactor.
+ *
+ *          Control connections are read until EAGAIN into a per-connection
+ *          buffer, which an incremental parser scans as bytes arrive.
+ *          Each complete command is handed to parseCommand() and
+ *          its response queued on the connection. parseCommand() touches
+ *          the disk, so it runs on the blocking I/O pool.
+ *
+ *          Responses are sent one at a time over a non-blocking connection
+ *          to the client's data port, so the order of responses matches
+ *          the order of commands. The server connects as soon as a
+ *          response is ready; a refused connect is retried with an
+ *          exponential backoff, cut short when the client reports its
+ *          listener ready on the control connection.
+ *
+ *          A protocol 2 connection may open a session, in which one data
+ *          connection carries every response. Clients pipeline commands
+ *          freely; the framed headers delimit the responses, which come
+ *          back in command order. Response headers and trailers go out with
+ *          scatter-gather writes and file bodies with sendfile(), so memory
+ *          per transfer does not grow with the file size.
+ *
+ *          The io_uring backend keeps all of the above and changes only
+ *          how I/O is issued. Accepts and control receives are multishot
+ *          operations, armed once per socket; data connects and sends
+ *          are queued as operations, and file bodies are read into
+ *          registered buffers and sent from there. Everything queued
+ *          while handling a batch of completions reaches the kernel in
+ *          the one io_uring_enter() that waits for the next batch. Each
+ *          operation is tagged with its Endpoint and the kind of
+ *          operation, and a connection is freed only once its last
+ *          operation has completed.
+ */
+#include <string>
+#include <cstring>
+#include <set>
+#include <atomic>
+#include <vector>
+#include <utility>
+#include <cerrno>
+#include <ctime>
+#include <cstdlib>
+#include <unistd.h>
+#include <netdb.h>       // addrinfo, getnameinfo()
+#include <sys/epoll.h>
+#include <poll.h>         // POLLIN, POLLOUT for ring polls
+#include <sys/uio.h>      // struct iovec
+#include <sys/sendfile.h>
+#include "ftserver.hpp"
+#include "reactor.hpp"
+#include "iopool.hpp"
+#include "prefetch.hpp"
+#include "protocol.hpp"
+#include "filecache.hpp"
+#include "compress.hpp"
+#include "parser.hpp"
+#include "logger.hpp"
+#include "resolver.hpp"
+#include "metrics.hpp"
+#include "uring.hpp"
+using namespace std;
+
+// Kind of io_uring operation, kept in the low bits of its tag; the rest
+// of the tag is the Endpoint it acts on.
+enum RingOp {
+    OP_NONE,     // Untagged: a cancel
+    OP_ACCEPT,   // Multishot accept on the listener
+    OP_MAILBOX,  // Multishot poll of the mailbox
+    OP_RECV,     // Multishot receive on a control socket, or a receive
+                 // of upload bytes on a data socket
+    OP_POLL,     // Control socket space, or an idle data socket's hangup
+    OP_CONNECT,  // Data connect
+    OP_SEND,     // Data send, of memory or of the file buffer
+    OP_READ      // File read into the connection's buffer
+};
+#define RING_OP_MASK 7ULL
+static_assert(alignof(Endpoint) > RING_OP_MASK, "tags need free low bits");
+
+// Connections whose front transfer is XFER_BACKOFF, ordered by readyAt;
+// or connections over a rate limit, ordered by wakeAt.
+typedef set< pair<long long, Connection*> > TimerSet;
+
+// Every worker runs its own reactor; none of this state is shared.
+static thread_local int epfd = -1;          // The epoll instance
+static thread_local TimerSet timers;        // Pending data-connect delays
+static thread_local Mailbox *mailbox;       // Blocking I/O completions
+static thread_local Ring *ring;             // io_uring backend, or NULL
+static thread_local deque<Connection*> runQueue;  // Waiting for a send turn
+static thread_local TimerSet asleep;        // Waiting for rate limit tokens
+static thread_local TimerSet deadlines;     // Every connection, by checkAt
+
+// Shared by every reactor, for --max-clients and --max-transfers. Checked
+// without a lock, so concurrent reactors may overshoot by a few.
+static atomic<int> clientCount(0);
+static atomic<int> transfersInFlight(0);
+
+// Connections closed during the current batch of events. Freed once the
+// batch is done so later events in it never touch freed memory.
+static thread_local vector<Connection*> graveyard;
+
+static void closeConnection(Connection *conn);
+static void startTransfer(Connection *conn);
+static void commandParsed(Connection *conn, Transfer *t);
+static void releaseResponse(Response *r);
+static void finishTransfer(Connection *conn, bool completed);
+static void failTransfer(Connection *conn);
+static void sendResponse(Connection *conn);
+static void armDeadline(Connection *conn, long long now);
+static void closeData(Connection *conn);
+static void dataPortReady(Connection *conn, int port);
+static bool armRecv(Connection *conn);
+static bool armPollOut(Connection *conn);
+static bool ringSendFront(Connection *conn);
+static void ringConnectData(Connection *conn);
+static void cancelRingOps(Connection *conn);
+static void releaseFileBuffer(Connection *conn);
+static void watchIdleData(Connection *conn);
+static void unwatchIdleData(Connection *conn);
+static void dataOpQueued(Connection *conn, RingOp op);
+static void fillSegment(Connection *conn, shared_ptr<GzipStream> stream);
+static unsigned long long tagOf(Endpoint *ep, RingOp op);
+
+/**
+ * Return milliseconds on the monotonic clock.
+ */
+long long monotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Return microseconds on the monotonic clock.
+ */
+long long monotonicUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Write the access record of a transfer that has ended.
+ *
+ * @param outcome status to record, or NULL to take it from the response
+ *
+ * The response of a transfer still XFER_READING belongs to the I/O pool,
+ * which may be assigning it, so only its request is read.
+ */
+static void logAccess(const Connection *conn, const Transfer &t,
+        const char *outcome) {
+    static const char *verbs[] = { "get", "list", "batch", "put", "unknown" };
+    const char *file = "-";
+    size_t bytes = t.sent;
+
+    if (!logEnabled(LOG_INFO))
+        return;
+    if (t.request.verb != VERB_LIST && t.request.verb != VERB_UNKNOWN)
+        file = t.request.filename.c_str();
+    if (t.request.verb == VERB_BATCH && !t.request.list.match.empty())
+        file = t.request.list.match.c_str();
+    if (outcome == NULL && t.response.status == FT_STATUS_ERROR)
+        outcome = "error";
+    else if (outcome == NULL && t.response.status == FT_STATUS_NOT_MODIFIED)
+        outcome = "not_modified";
+    else if (outcome == NULL && t.response.status == FT_STATUS_BUSY)
+        outcome = "busy";
+    else if (outcome == NULL && t.response.status == FT_STATUS_DELTA)
+        outcome = "delta";
+    else if (outcome == NULL)
+        outcome = "ok";
+    if (t.state != XFER_READING && t.response.upload)
+        bytes = t.response.upload->received;  // The body came the other way
+    logMessage(LOG_INFO, "access client=%s port=%d cmd=%s file=%s status=%s "
+            "bytes=%zu latency_us=%lld", conn->cHostname.c_str(),
+            t.request.dataPortNo, verbs[t.request.verb], file,
+            outcome, bytes, monotonicUs() - t.startUs);
+}
+
+/**
+ * Create a non-blocking listening socket on portno.
+ *
+ * @param portno port number to listen on.
+ * @param reusePort whether other sockets may bind the same port
+ *
+ * @return listening socket descriptor or -1 on error
+ */
+int openListener(const char *portno, bool reusePort) {
+    int s = -1;
+    int yes = 1;
+    struct addrinfo hints;
+    struct addrinfo *servinfo;  // will point to the results
+    struct addrinfo *next;      // Next in linked list of ip addresses
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;        // ipv4 socket
+    hints.ai_socktype = SOCK_STREAM;  // TCP, not UDP
+    hints.ai_flags = AI_PASSIVE;      // fill in my ip for me
+
+    if (getaddrinfo(NULL, portno, &hints, &servinfo) != 0) {
+        logErrno("Error with getaddrinfo");
+        return -1;
+    }
+
+    // Walk the linked list of struct addrinfos until one binds.
+    for (next = servinfo; next != NULL; next = next->ai_next) {
+        s = socket(next->ai_family, next->ai_socktype | SOCK_NONBLOCK,
+                next->ai_protocol);
+        if (s == -1) {
+            logErrno("Server socket");
+            continue;
+        }
+
+        // Allow a restarted server to rebind while old sockets drain
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+
+        // Let every worker bind its own listener; the kernel spreads
+        // incoming connections across them.
+        if (reusePort && setsockopt(s, SOL_SOCKET, SO_REUSEPORT,
+                    &yes, sizeof yes) == -1) {
+            logErrno("SO_REUSEPORT");
+            close(s);
+            s = -1;
+            continue;
+        }
+
+        if (bind(s, next->ai_addr, next->ai_addrlen) == -1) {
+            logErrno("Bind");
+            close(s);
+            s = -1;
+            continue;
+        }
+        break;
+    }
+    freeaddrinfo(servinfo);
+
+    if (s == -1)
+        return -1;
+
+    if (listen(s, LISTEN_BACKLOG) == -1) {
+        logErrno("Listen");
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+/**
+ * Change the event mask of an endpoint, registering it if needed.
+ */
+static int watch(Endpoint *ep, uint32_t events, int op) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = events | EPOLLET;
+    ev.data.ptr = ep;
+    if (epoll_ctl(epfd, op, ep->fd, &ev) == -1) {
+        logErrno("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Schedule a closed connection to be freed once neither the I/O pool
+ * nor the ring holds it.
+ */
+static void releaseIfIdle(Connection *conn) {
+    if (conn->pendingJobs > 0 || conn->io.ops > 0 || conn->scheduled)
+        return;
+    if (ring)
+        releaseFileBuffer(conn);
+    graveyard.push_back(conn);
+}
+
+/**
+ * Completion of a hostname lookup; runs on the reactor.
+ */
+static void hostResolved(Connection *conn, const string &name) {
+    conn->pendingJobs--;
+    if (conn->closed) {
+        releaseIfIdle(conn);
+        return;
+    }
+    if (name != conn->cHostname)
+        logMessage(LOG_DEBUG, "Client %s is %s", conn->cHostname.c_str(),
+                name.c_str());
+    conn->cHostname = name;  // Commands parsed from now on use the name
+}
+
+/**
+ * Replace the client's numeric address with its hostname, once the
+ * resolver has it.
+ */
+static void resolveClient(Connection *conn) {
+    conn->pendingJobs++;
+    resolveHost(conn->cHostname, (struct sockaddr *)&conn->addr,
+            conn->addrlen, mailbox, [conn](const string &name) {
+                hostResolved(conn, name);
+            });
+}
+
+/**
+ * Set up and start serving a client accepted as socket c, whose address
+ * is in conn->addr.
+ *
+ * @param acceptedUs monotonic us at which accepting began
+ */
+static void addClient(Connection *conn, int c, long long acceptedUs) {
+    char clientHost[MAX_HOST_LEN];  // The connecting client hostname
+
+    // Over the limit, a client is told so at once rather than queued.
+    // The reply fits any socket buffer; if it does not go, neither
+    // would anything else.
+    if (serverOptions.maxClients > 0
+            && clientCount.load(memory_order_relaxed)
+                >= serverOptions.maxClients) {
+        static const char busy[] = "<" BUSY_TAG "></" BUSY_TAG ">";
+        send(c, busy, sizeof busy - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(c);
+        delete conn;
+        addCounter(CTR_REJECTED, 1);
+        return;
+    }
+
+    conn->control.fd = c;
+    conn->control.kind = EP_CONTROL;
+    conn->control.conn = conn;
+    conn->data.fd = -1;
+    conn->data.kind = EP_DATA;
+    conn->data.conn = conn;
+    conn->peerClosed = false;
+    conn->closed = false;
+    conn->pendingJobs = 0;
+    conn->proto = PROTO_LEGACY;
+    conn->session = false;
+    conn->sending = false;
+    conn->dataPortNo = 0;
+    conn->deficit = SEND_QUANTUM;
+    initBucket(&conn->bucket, (uint64_t)serverOptions.clientRate * 1024);
+    conn->scheduled = false;
+    conn->wakeAt = -1;
+    conn->activeMs = monotonicMs();
+    conn->messageMs = -1;
+    conn->checkAt = -1;
+    conn->io.ops = 0;
+    conn->io.recvArmed = false;
+    conn->io.pollOut = false;
+    conn->io.idlePoll = false;
+    conn->io.dataOp = OP_NONE;
+    conn->io.fixedBuf = -1;
+    conn->io.bufLen = 0;
+    conn->io.bufSent = 0;
+    resetParser(&conn->parser);
+
+    // Fill client's address (clientHost) using the info in c_addr.
+    // Numeric only: a slow DNS server must not stall the accept path.
+    memset(clientHost, 0, MAX_HOST_LEN);
+    getnameinfo((struct sockaddr *)&conn->addr, conn->addrlen,
+            clientHost, MAX_HOST_LEN, NULL, 0, NI_NUMERICHOST);
+    conn->cHostname = clientHost;
+    logMessage(LOG_DEBUG, "Connection from %s", conn->cHostname.c_str());
+
+    bool watched = ring ? armRecv(conn)
+        : watch(&conn->control, EPOLLIN | EPOLLOUT | EPOLLRDHUP,
+                EPOLL_CTL_ADD) == 0;
+    if (!watched) {
+        if (ring)
+            logErrno("io_uring recv");
+        close(c);
+        delete conn;
+        return;
+    }
+    clientCount.fetch_add(1, memory_order_relaxed);
+    armDeadline(conn, conn->activeMs);
+    addCounter(CTR_ACCEPTED, 1);
+    addCounter(CTR_ACTIVE, 1);
+    recordLatency(STAGE_ACCEPT, monotonicUs() - acceptedUs);
+    if (serverOptions.resolveTtl > 0)
+        resolveClient(conn);
+}
+
+/**
+ * Accept every pending client on the listener.
+ */
+static void acceptClients(int listener) {
+    while (true) {
+        Connection *conn = new Connection();
+        conn->addrlen = sizeof(struct sockaddr_storage);
+        long long acceptedUs = monotonicUs();
+        int c = accept4(listener, (struct sockaddr *)&conn->addr,
+                &conn->addrlen, SOCK_NONBLOCK);
+        if (c == -1) {
+            delete conn;
+            // EAGAIN: backlog drained. Anything else is per-client;
+            // a transient error must not stop the server.
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                logErrno("Accept");
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;
+        }
+        addClient(conn, c, acceptedUs);
+    }
+}
+
+/**
+ * Start the front transfer now, or arm its timer, if it is ready.
+ */
+static void scheduleFront(Connection *conn) {
+    if (conn->transfers.empty()) {
+        if (conn->peerClosed)
+            closeConnection(conn);
+        return;
+    }
+    Transfer &front = conn->transfers.front();
+    if (front.state != XFER_BACKOFF)
+        return;  // Still being read, or already connecting
+    if (front.readyAt <= monotonicMs())
+        startTransfer(conn);
+    else
+        timers.insert(make_pair(front.readyAt, conn));
+}
+
+/**
+ * Completion of parseCommand() on the I/O pool; runs on the reactor.
+ */
+static void commandParsed(Connection *conn, Transfer *t) {
+    conn->pendingJobs--;
+    if (conn->closed) {
+        releaseResponse(&t->response);
+        releaseIfIdle(conn);
+        return;
+    }
+
+    // A streamed body fills its next segment while the first goes out
+    if (t->response.stream && !gzipStreamEnded(*t->response.stream))
+        fillSegment(conn, t->response.stream);
+
+    // Connect right away; a client that is not listening yet is
+    // retried with backoff or kicked by its ready signal.
+    t->state = XFER_BACKOFF;
+    t->readyAt = monotonicMs();
+    if (t == &conn->transfers.front())
+        scheduleFront(conn);
+}
+
+/**
+ * Write queued control replies until done or the socket is full.
+ *
+ * @return false if the connection must be aborted
+ */
+static bool flushControl(Connection *conn) {
+    while (!conn->outBuf.empty()) {
+        ssize_t sent = send(conn->control.fd, conn->outBuf.data(),
+                conn->outBuf.length(), MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return !ring || armPollOut(conn);  // Resume when writable
+            logErrno("Send");
+            return false;
+        }
+        conn->outBuf.erase(0, sent);
+    }
+    return true;
+}
+
+/**
+ * Answer a "<proto>N</proto>" request with the version this connection
+ * will use from now on.
+ */
+static void negotiateProtocol(Connection *conn, const Message &message) {
+    conn->proto = (message.contents[0] == "2") ? PROTO_FRAMED : PROTO_LEGACY;
+    conn->outBuf.append("<" PROTO_TAG ">" + to_string(conn->proto)
+            + "</" PROTO_TAG ">");
+}
+
+/**
+ * Answer a "<session>1</session>" request. A session keeps one data
+ * connection open across responses, which only protocol 2 can delimit.
+ * "<session>0</session>" ends the session after the queued responses.
+ */
+static void negotiateSession(Connection *conn, const Message &message) {
+    conn->session = (message.contents[0] == "1")
+        && conn->proto == PROTO_FRAMED;
+    if (!conn->session && conn->transfers.empty())
+        closeData(conn);
+    conn->outBuf.append(conn->session
+            ? "<" SESSION_TAG ">1</" SESSION_TAG ">"
+            : "<" SESSION_TAG ">0</" SESSION_TAG ">");
+}
+
+/**
+ * Handle a message that stands alone, outside any command
+ * ("<proto>N</proto>", "<session>N</session>", "<ready>PORT</ready>"
+ * or "<stats></stats>").
+ *
+ * @return false if message is not a standalone message
+ */
+static bool processSessionMessage(Connection *conn, const Message &message) {
+    if (message.fieldCount != 1)
+        return false;
+
+    const string_view &tag = message.tags[0];
+    if (tag == PROTO_TAG) {
+        negotiateProtocol(conn, message);
+    }
+    else if (tag == SESSION_TAG) {
+        negotiateSession(conn, message);
+    }
+    else if (tag == STATS_TAG) {
+        conn->outBuf.append("<" STATS_TAG ">" + serverStats()
+                + "</" STATS_TAG ">");
+    }
+    else if (tag == READY_TAG) {
+        dataPortReady(conn, parsePort(message.contents[0]));
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Hand every complete command in conn->inBuf to parseCommand().
+ *
+ * @return false if the connection must be aborted
+ */
+static bool processCommands(Connection *conn) {
+    size_t start = 0;  // First byte of the message being parsed
+    Message message;
+    ParseStatus status = PARSE_NEED_MORE;
+
+    while (!conn->closed) {
+        status = parseMessage(&conn->parser, conn->inBuf.data() + start,
+                conn->inBuf.length() - start, &message);
+        if (status != PARSE_MESSAGE)
+            break;
+        start += conn->parser.length;
+        resetParser(&conn->parser);
+
+        if (processSessionMessage(conn, message))
+            continue;
+
+        // Only the filename is copied out of the receive buffer.
+        Request request;
+        if (!parseRequest(message, &request)) {
+            logMessage(LOG_WARN, "Client %s sent invalid data port number",
+                    conn->cHostname.c_str());
+            return false;  // Problem with client port
+        }
+        if (request.verb == VERB_GET) {
+            noteGet(conn->lastGet, conn->cHostname, request.filename);
+            conn->lastGet = request.filename;
+        }
+
+        conn->transfers.push_back(Transfer());
+        Transfer *t = &conn->transfers.back();
+        t->request = move(request);
+        t->client = conn->cHostname;
+        t->startUs = monotonicUs();
+        t->sent = 0;
+        t->part = 0;
+        t->partStart = 0;
+        t->state = XFER_READING;
+        t->readyAt = 0;
+        t->attempts = 0;
+        t->expired = false;
+
+        // Over the limit, the command is answered busy at once, without
+        // touching the disk.
+        t->admitted = serverOptions.maxTransfers == 0
+            || transfersInFlight.load(memory_order_relaxed)
+                < serverOptions.maxTransfers;
+        if (!t->admitted) {
+            t->response = busyResponse(conn->proto);
+            t->state = XFER_BACKOFF;
+            t->readyAt = monotonicMs();
+            if (t == &conn->transfers.front())
+                scheduleFront(conn);
+            continue;
+        }
+        transfersInFlight.fetch_add(1, memory_order_relaxed);
+
+        // parseCommand() reads the directory and the file from disk;
+        // run it on the I/O pool so this reactor keeps serving.
+        // Deque references survive push_back, and conn outlives the job.
+        // Both closures fit in a std::function without allocating.
+        conn->pendingJobs++;
+        int proto = conn->proto;
+        submitIo(mailbox,
+            [t, proto]() {
+                t->response = parseCommand(t->request, t->client, proto);
+            },
+            [t, conn]() {
+                commandParsed(conn, t);
+            });
+    }
+
+    if (conn->closed)
+        return true;  // Finished its last transfer while we were here
+
+    // The parser keeps offsets, so it survives dropping parsed bytes.
+    conn->inBuf.erase(0, start);
+    if (conn->inBuf.empty())
+        conn->messageMs = -1;
+    else if (start > 0 || conn->messageMs == -1)
+        conn->messageMs = monotonicMs();  // What is left is a new command
+    if (!flushControl(conn))
+        return false;
+
+    // A malformed or endless message is not a client.
+    return status != PARSE_ERROR;
+}
+
+/**
+ * Process the bytes received into conn->inBuf, and close the connection
+ * if it is broken or done.
+ */
+static void controlReceived(Connection *conn) {
+    conn->activeMs = monotonicMs();
+    if (!processCommands(conn)) {
+        closeConnection(conn);
+        return;
+    }
+
+    // Responses already queued are still delivered after the client
+    // closes its end of the control connection.
+    if (conn->peerClosed && conn->transfers.empty())
+        closeConnection(conn);
+}
+
+/**
+ * Read the control socket until EAGAIN and process complete commands.
+ */
+static void handleControl(Connection *conn, uint32_t events) {
+    char buffer[RECV_BUF_LEN];  // holds incoming data
+    ssize_t recvRetVal;         // Bytes read or error
+
+    if (events & EPOLLERR) {
+        closeConnection(conn);
+        return;
+    }
+    if ((events & EPOLLOUT) && !flushControl(conn)) {
+        closeConnection(conn);
+        return;
+    }
+
+    while (!conn->peerClosed) {
+        recvRetVal = recv(conn->control.fd, buffer, RECV_BUF_LEN, 0);
+        if (recvRetVal > 0) {
+            conn->inBuf.append(buffer, recvRetVal);
+        }
+        else if (recvRetVal == 0) {  // All data has been received
+            conn->peerClosed = true;
+        }
+        else if (errno == EINTR) {
+            continue;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        }
+        else {  // -1 indicates an error condition
+            logErrno("Recv");
+            closeConnection(conn);
+            return;
+        }
+    }
+
+    controlReceived(conn);
+}
+
+/**
+ * Close the files behind a response and its parts, if any.
+ */
+static void releaseResponse(Response *r) {
+    if (r->fd != -1) {
+        if (!r->fdShared)
+            close(r->fd);
+        r->fd = -1;
+    }
+    for (size_t i = 0; i < r->parts.size(); i++)
+        releaseResponse(&r->parts[i]);
+}
+
+/**
+ * Return the response of t being sent: the response itself, then each
+ * part of a batch.
+ */
+static Response &currentPart(Transfer &t) {
+    return (t.part == 0) ? t.response : t.response.parts[t.part - 1];
+}
+
+/**
+ * Return the header, body and trailer bytes of r, without its parts.
+ */
+static size_t partLength(const Response &r) {
+    return r.header.length() + r.length + r.trailer.length();
+}
+
+/**
+ * Move t past every batch part it has sent in full, closing their
+ * files, so currentPart() is the first one not yet sent or the last.
+ */
+static void advancePart(Transfer &t) {
+    while (t.part < t.response.parts.size()) {
+        Response &r = currentPart(t);
+        size_t end = t.partStart + partLength(r);
+        if (t.sent < end)
+            return;
+        if (r.fd != -1) {
+            if (!r.fdShared)
+                close(r.fd);
+            r.fd = -1;
+        }
+        t.partStart = end;
+        t.part++;
+    }
+}
+
+/**
+ * Close the data connection, if one is open.
+ */
+static void closeData(Connection *conn) {
+    if (ring)
+        unwatchIdleData(conn);
+    if (conn->data.fd != -1) {
+        close(conn->data.fd);  // epoll forgets closed descriptors
+        conn->data.fd = -1;
+    }
+}
+
+/**
+ * Finish the active transfer and start the next one, if any.
+ * A session keeps its data connection open for the next response.
+ */
+static void finishTransfer(Connection *conn, bool completed) {
+    Transfer &t = conn->transfers.front();
+    logAccess(conn, t, completed ? NULL : "aborted");
+    if (t.admitted)
+        transfersInFlight.fetch_sub(1, memory_order_relaxed);
+    conn->activeMs = monotonicMs();
+    if (completed) {
+        recordLatency(STAGE_SEND, monotonicUs() - t.sendUs);
+        addCounter(CTR_REQUESTS, 1);
+        if (t.response.status == FT_STATUS_ERROR)
+            addCounter(CTR_ERRORS, 1);
+        else if (t.response.status == FT_STATUS_NOT_MODIFIED)
+            addCounter(CTR_NOT_MODIFIED, 1);
+        else if (t.response.status == FT_STATUS_BUSY)
+            addCounter(CTR_BUSY, 1);
+    }
+    else {
+        addCounter(CTR_ABORTED, 1);
+    }
+    // A put refused before its body was read leaves the body unread on
+    // the data connection, and one ended by the client half-closing it
+    // leaves it at EOF, so a session cannot go on using it either way.
+    if (!conn->session || (t.request.verb == VERB_PUT
+                && (!t.response.upload || t.response.upload->eof)))
+        closeData(conn);
+    if (ring)
+        releaseFileBuffer(conn);
+    releaseResponse(&conn->transfers.front().response);
+    conn->transfers.pop_front();
+    // Going idle ends a busy period; the next response gets a full turn.
+    // Pipelined responses share the turn, so a session cannot jump the
+    // queue with a stream of them.
+    if (conn->transfers.empty()
+            || conn->transfers.front().state == XFER_READING)
+        conn->deficit = SEND_QUANTUM;
+    scheduleFront(conn);
+    if (ring)
+        watchIdleData(conn);
+}
+
+/**
+ * Abandon the active transfer. The data connection is closed even in
+ * a session, since the client cannot resynchronize a partial response.
+ */
+static void failTransfer(Connection *conn) {
+    closeData(conn);
+    finishTransfer(conn, false);
+}
+
+/**
+ * Park conn at the back of the run queue until its next send turn.
+ */
+static void yieldSend(Connection *conn) {
+    conn->scheduled = true;
+    runQueue.push_back(conn);
+    addCounter(CTR_SEND_YIELDS, 1);
+}
+
+/**
+ * Park conn until its rate limits let it send again, waitUs from now.
+ */
+static void sleepSend(Connection *conn, long long waitUs) {
+    conn->scheduled = true;
+    conn->wakeAt = monotonicMs() + (waitUs + 999) / 1000;
+    asleep.insert(make_pair(conn->wakeAt, conn));
+    addCounter(CTR_SEND_THROTTLES, 1);
+}
+
+/**
+ * Return how many bytes conn may send now: the rest of its turn, within
+ * its own and the global rate limit. If that is nothing, park conn until
+ * it may send again.
+ */
+static size_t sendBudget(Connection *conn) {
+    if (conn->scheduled)
+        return 0;  // Parked; an event does not jump the queue
+    if (conn->deficit == 0) {
+        yieldSend(conn);
+        return 0;
+    }
+    long long now = monotonicUs();
+    size_t budget = min(conn->deficit,
+            min(availableTokens(&conn->bucket, now), globalTokens(now)));
+    if (budget == 0)
+        sleepSend(conn, max(tokenWaitUs(&conn->bucket, now),
+                    globalWaitUs(now)));
+    return budget;
+}
+
+/**
+ * Charge bytes sent by conn to its turn and its rate limits.
+ */
+static void chargeSend(Connection *conn, size_t bytes) {
+    conn->deficit -= min(bytes, conn->deficit);
+    spendTokens(&conn->bucket, bytes);
+    spendGlobalTokens(bytes);
+    addCounter(CTR_BYTES_SENT, bytes);
+    conn->activeMs = monotonicMs();
+}
+
+/**
+ * Give each connection in the run queue its turn, after waking those
+ * whose rate limits have refilled. Connections that use up the turn go
+ * to the back of the queue, for the next round.
+ */
+static void runSendQueue() {
+    long long now = monotonicMs();
+    while (!asleep.empty() && asleep.begin()->first <= now) {
+        Connection *conn = asleep.begin()->second;
+        asleep.erase(asleep.begin());
+        conn->scheduled = false;
+        conn->wakeAt = -1;
+        sendResponse(conn);
+    }
+    for (size_t n = runQueue.size(); n > 0; n--) {
+        Connection *conn = runQueue.front();
+        runQueue.pop_front();
+        conn->scheduled = false;
+        if (conn->closed) {
+            releaseIfIdle(conn);
+            continue;
+        }
+        conn->deficit += SEND_QUANTUM;
+        sendResponse(conn);
+    }
+}
+
+/**
+ * Cut the pieces of msg down to at most budget bytes.
+ */
+static void clampPieces(struct msghdr *msg, size_t budget) {
+    for (size_t i = 0; i < msg->msg_iovlen; i++) {
+        if (msg->msg_iov[i].iov_len >= budget) {
+            msg->msg_iov[i].iov_len = budget;
+            msg->msg_iovlen = i + 1;
+            return;
+        }
+        budget -= msg->msg_iov[i].iov_len;
+    }
+}
+
+/**
+ * Point msg at every in-memory piece of t's response from t.sent on,
+ * stopping at a file body. The pieces of a batch run on into the parts
+ * that follow, so small members go out together.
+ *
+ * @param iov room for GATHER_IOV pieces
+ */
+static void gatherPieces(const Transfer &t, struct msghdr *msg,
+        struct iovec *iov) {
+    size_t sent = t.sent - t.partStart;  // Into the current part
+
+    memset(msg, 0, sizeof *msg);
+    msg->msg_iov = iov;
+    for (size_t p = t.part; p <= t.response.parts.size(); p++) {
+        const Response &r = (p == 0) ? t.response : t.response.parts[p - 1];
+        const char *base[3] = { r.header.data(), r.data, r.trailer.data() };
+        size_t len[3] = { r.header.length(), r.length, r.trailer.length() };
+        size_t pos = 0;
+
+        for (int i = 0; i < 3; i++) {
+            size_t end = pos + len[i];
+            if (i == 1 && r.fd != -1 && sent < end)
+                return;
+            if (sent < end) {
+                if (msg->msg_iovlen == GATHER_IOV)
+                    return;
+                size_t skip = (sent > pos) ? sent - pos : 0;
+                iov[msg->msg_iovlen].iov_base = (char *)base[i] + skip;
+                iov[msg->msg_iovlen].iov_len = len[i] - skip;
+                msg->msg_iovlen++;
+            }
+            pos = end;
+        }
+        sent = 0;  // Later parts are sent from their start
+    }
+}
+
+/**
+ * Completion of fillGzipStream() on the I/O pool; runs on the reactor.
+ */
+static void segmentFilled(Connection *conn, shared_ptr<GzipStream> stream) {
+    conn->pendingJobs--;
+    stream->filling = false;
+    if (conn->closed) {
+        releaseIfIdle(conn);
+        return;
+    }
+    if (!conn->transfers.empty()
+            && conn->transfers.front().response.stream == stream)
+        sendResponse(conn);  // Waiting for it, or will be soon
+}
+
+/**
+ * Have the I/O pool compress the next segment of stream.
+ */
+static void fillSegment(Connection *conn, shared_ptr<GzipStream> stream) {
+    stream->filling = true;
+    conn->pendingJobs++;
+    submitIo(mailbox,
+        [stream]() { fillGzipStream(stream.get()); },
+        [conn, stream]() { segmentFilled(conn, stream); });
+}
+
+/**
+ * Once the segment of the front transfer's streamed body being sent is
+ * all out, make the next one its body, and start filling the one after.
+ *
+ * @return 1 if the next segment is the body now, 0 if it is still being
+ *         filled (its completion resumes the send), -1 if the transfer
+ *         failed
+ */
+static int nextSegment(Connection *conn) {
+    Transfer &t = conn->transfers.front();
+    Response &r = t.response;
+    shared_ptr<GzipStream> stream = r.stream;
+
+    if (stream->filling)
+        return 0;
+    if (stream->failed) {
+        logMessage(LOG_WARN, "Compressing %s failed during transfer",
+                t.request.filename.c_str());
+        failTransfer(conn);
+        return -1;
+    }
+    // What is sent of the response so far is done with; the header is
+    // given back to its pool, and the new segment starts the count.
+    t.partStart += r.header.length() + r.length;
+    recycleBuffer(&r.header);
+    takeGzipSegment(stream.get(), &r.data, &r.length);
+    if (!stream->finished)
+        fillSegment(conn, stream);
+    return 1;
+}
+
+/**
+ * Write as much of the front response as the data socket accepts. On
+ * the ring, queue the next operation of the front response instead.
+ *
+ * @return true if the transfer ended (finished or failed), false if the
+ *         socket is full or an operation is in flight
+ */
+static bool sendFront(Connection *conn) {
+    if (ring)
+        return ringSendFront(conn);
+
+    Transfer &t = conn->transfers.front();
+
+    // t.sent counts bytes of header, body and trailer together, and of
+    // every part of a batch.
+    for (;;) {
+        advancePart(t);
+        Response &r = currentPart(t);
+        size_t at = t.sent - t.partStart;
+        size_t headerLen = r.header.length();
+        size_t bodyEnd = headerLen + r.length;
+        ssize_t sent;
+
+        if (r.stream && at >= bodyEnd && !gzipStreamEnded(*r.stream)) {
+            int next = nextSegment(conn);
+            if (next == 1)
+                continue;
+            return next == -1;
+        }
+        if (at >= bodyEnd + r.trailer.length())
+            break;
+        size_t budget = sendBudget(conn);
+        if (budget == 0)
+            return false;  // Resumed on its next turn
+        if (r.fd != -1 && at >= headerLen && at < bodyEnd) {
+            // File body: page cache straight to the socket
+            off_t pos = r.offset + (at - headerLen);
+            size_t toSend = min(bodyEnd - at, min(budget,
+                        (size_t)SENDFILE_CHUNK));
+            sent = sendfile(conn->data.fd, r.fd, &pos, toSend);
+            if (sent == 0) {  // File shrank underneath us
+                logMessage(LOG_WARN, "File %s truncated during transfer",
+                        t.request.filename.c_str());
+                failTransfer(conn);
+                return true;
+            }
+        }
+        else {
+            // Every in-memory piece from t.sent on, in one write.
+            // MSG_NOSIGNAL prevents broken pipe signal
+            struct iovec iov[GATHER_IOV];
+            struct msghdr msg;
+            gatherPieces(t, &msg, iov);
+            clampPieces(&msg, budget);
+            sent = sendmsg(conn->data.fd, &msg, MSG_NOSIGNAL);
+        }
+
+        if (sent == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return false;  // Resume on EPOLLOUT
+            logErrno("Send");
+            failTransfer(conn);
+            return true;
+        }
+        t.sent += sent;
+        chargeSend(conn, sent);
+    }
+    finishTransfer(conn, true);
+    return true;
+}
+
+/**
+ * Completion of writeUpload() on the I/O pool; runs on the reactor.
+ */
+static void uploadWritten(Connection *conn, shared_ptr<Upload> upload) {
+    conn->pendingJobs--;
+    upload->writing = false;
+    if (conn->closed) {
+        releaseIfIdle(conn);
+        return;
+    }
+    if (conn->transfers.empty()
+            || conn->transfers.front().response.upload != upload)
+        return;  // The transfer failed meanwhile
+    sendResponse(conn);  // Receives again, or commits
+}
+
+/**
+ * Completion of commitUpload(); runs on the reactor. Answer the put.
+ */
+static void uploadCommitted(Connection *conn, shared_ptr<Upload> upload) {
+    conn->pendingJobs--;
+    if (conn->closed) {
+        releaseIfIdle(conn);
+        return;
+    }
+    if (conn->transfers.empty()
+            || conn->transfers.front().response.upload != upload)
+        return;
+    Transfer &t = conn->transfers.front();
+    storedResponse(&t.response, conn->proto);
+    t.state = XFER_SENDING;
+    sendResponse(conn);
+}
+
+/**
+ * Hand the received buffer of upload to the I/O pool to be written,
+ * and receive on into the other buffer meanwhile.
+ */
+static void writeBuffered(Connection *conn, shared_ptr<Upload> upload) {
+    swap(upload->buffer, upload->writeBuf);
+    upload->writeLen = upload->buffered;
+    upload->buffered = 0;
+    upload->writing = true;
+    conn->pendingJobs++;
+    submitIo(mailbox,
+        [upload]() { writeUpload(upload.get()); },
+        [conn, upload]() { uploadWritten(conn, upload); });
+}
+
+/**
+ * Account for n body bytes received into the front upload; 0 is the end
+ * of the stream.
+ *
+ * @return false if the transfer failed: the stream ended short of the
+ *         length the client gave
+ */
+static bool bodyReceived(Connection *conn, size_t n) {
+    Upload &upload = *conn->transfers.front().response.upload;
+
+    if (n == 0) {
+        upload.eof = true;
+        if (!uploadReceived(upload)) {
+            logMessage(LOG_WARN, "Upload of %s ended after %llu of %llu "
+                    "bytes", upload.name.c_str(),
+                    (unsigned long long)upload.received,
+                    (unsigned long long)upload.size);
+            failTransfer(conn);
+            return false;
+        }
+        return true;
+    }
+    upload.buffered += n;
+    upload.received += n;
+    addCounter(CTR_BYTES_RECEIVED, n);
+    conn->activeMs = monotonicMs();
+    return true;
+}
+
+/**
+ * Read the body of the front upload until the socket is empty, handing
+ * each full buffer to the I/O pool and committing the file once all of
+ * it is written. While both buffers are busy reading stops, and the
+ * client is held back by TCP flow control until a write finishes. On
+ * the ring, queue the next receive instead.
+ *
+ * @return true if the transfer failed, false if it waits for the
+ *         client, a write or its commit
+ */
+static bool receiveUpload(Connection *conn) {
+    shared_ptr<Upload> upload = conn->transfers.front().response.upload;
+
+    for (;;) {
+        if (upload->committing || (ring && conn->io.dataOp != OP_NONE))
+            return false;
+        if (uploadReceived(*upload)) {
+            if (upload->writing)
+                return false;  // Finish writing first
+            if (upload->buffered > 0) {
+                writeBuffered(conn, upload);
+                return false;
+            }
+            upload->committing = true;
+            conn->pendingJobs++;
+            commitUpload(upload, serverOptions.durability, mailbox,
+                    [conn, upload]() { uploadCommitted(conn, upload); });
+            return false;
+        }
+        if (upload->buffered == UPLOAD_CHUNK) {
+            if (upload->writing)
+                return false;  // Resumed by uploadWritten()
+            writeBuffered(conn, upload);
+        }
+
+        size_t room = UPLOAD_CHUNK - upload->buffered;
+        if (upload->sized && room > upload->size - upload->received)
+            room = upload->size - upload->received;
+        char *to = upload->buffer.data() + upload->buffered;
+        if (ring) {
+            if (!ringRecv(ring, conn->data.fd, to, room,
+                        tagOf(&conn->data, OP_RECV))) {
+                logErrno("io_uring recv");
+                failTransfer(conn);
+                return true;
+            }
+            dataOpQueued(conn, OP_RECV);
+            return false;
+        }
+
+        ssize_t n = recv(conn->data.fd, to, room, 0);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return false;  // Resume on EPOLLIN
+            logErrno("Receive");
+            failTransfer(conn);
+            return true;
+        }
+        if (!bodyReceived(conn, n))
+            return true;
+    }
+}
+
+/**
+ * Send responses over the data connection until the socket is full or
+ * none are ready. Pipelined responses in a session follow each other
+ * in this loop rather than by recursion. A put receives its body here
+ * first.
+ */
+static void sendResponse(Connection *conn) {
+    if (conn->sending)
+        return;  // The loop below will pick up the new front
+    conn->sending = true;
+    while (!conn->closed && conn->data.fd != -1 && !conn->transfers.empty()) {
+        TransferState state = conn->transfers.front().state;
+        if (state == XFER_RECEIVING) {
+            if (!receiveUpload(conn))
+                break;
+        }
+        else if (state != XFER_SENDING || !sendFront(conn)) {
+            break;
+        }
+    }
+    conn->sending = false;
+}
+
+/**
+ * The client refused the data connection, most likely because its
+ * listener is not open yet. Try again after an exponential backoff,
+ * unless the client has been given long enough.
+ */
+static void retryConnect(Connection *conn) {
+    Transfer &t = conn->transfers.front();
+    long long now = monotonicMs();
+
+    close(conn->data.fd);
+    conn->data.fd = -1;
+
+    if (serverOptions.connectTimeout > 0 && now - t.firstAttempt
+            >= serverOptions.connectTimeout * 1000LL) {
+        // errno is not the connect's by now; report the deadline itself
+        logMessage(LOG_WARN, "Client %s timed out: connecting to data port "
+                "%d for %lld ms, %d attempts", conn->cHostname.c_str(),
+                t.request.dataPortNo, now - t.firstAttempt, t.attempts);
+        addCounter(CTR_TIMEOUTS, 1);
+        failTransfer(conn);
+        return;
+    }
+    // Attempts are unbounded without a timeout; test before shifting
+    long long delay = CONNECT_BACKOFF_MAX_MS;
+    if (t.attempts <= 30)
+        delay = (long long)CONNECT_BACKOFF_MIN_MS << (t.attempts - 1);
+    if (delay > CONNECT_BACKOFF_MAX_MS)
+        delay = CONNECT_BACKOFF_MAX_MS;
+
+    t.state = XFER_BACKOFF;
+    t.readyAt = now + delay;
+    timers.insert(make_pair(t.readyAt, conn));
+}
+
+/**
+ * Connect now if the front transfer is waiting out a backoff on port.
+ * Sent by clients as "<ready>PORT</ready>" once their listener is open.
+ */
+static void dataPortReady(Connection *conn, int port) {
+    if (conn->transfers.empty())
+        return;
+    Transfer &t = conn->transfers.front();
+    if (t.state != XFER_BACKOFF || t.request.dataPortNo != port)
+        return;  // Not parsed yet (it will connect at once) or connected
+    timers.erase(make_pair(t.readyAt, conn));
+    startTransfer(conn);
+}
+
+/**
+ * Mark the front transfer connected and ready to send, or to receive
+ * the body of a put.
+ */
+static void transferConnected(Connection *conn) {
+    Transfer &t = conn->transfers.front();
+    conn->activeMs = monotonicMs();
+    t.state = t.response.upload ? XFER_RECEIVING : XFER_SENDING;
+    t.sendUs = monotonicUs();
+    if (t.attempts > 0)
+        recordLatency(STAGE_CONNECT, t.sendUs - t.connectUs);
+}
+
+/**
+ * Begin a non-blocking connect to the client's data port.
+ */
+static void startTransfer(Connection *conn) {
+    Transfer &t = conn->transfers.front();
+    struct sockaddr_storage dataAddr = conn->addr;
+
+    // A session reuses its open data connection to the same port.
+    if (conn->data.fd != -1) {
+        if (conn->dataPortNo == t.request.dataPortNo) {
+            if (ring)
+                unwatchIdleData(conn);
+            transferConnected(conn);
+            sendResponse(conn);
+            return;
+        }
+        closeData(conn);
+    }
+
+    if (t.attempts++ == 0) {
+        t.firstAttempt = monotonicMs();
+        t.connectUs = monotonicUs();
+    }
+
+    // The client program is the "server" for this data connection.
+    ((struct sockaddr_in *)&dataAddr)->sin_port = htons(t.request.dataPortNo);
+
+    conn->data.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (conn->data.fd == -1) {
+        logErrno("Data socket");
+        failTransfer(conn);
+        return;
+    }
+
+    t.state = XFER_CONNECTING;
+    if (ring) {
+        conn->io.dataAddr = *(struct sockaddr_in *)&dataAddr;
+        ringConnectData(conn);
+        return;
+    }
+    if (connect(conn->data.fd, (struct sockaddr *)&dataAddr,
+                sizeof(struct sockaddr_in)) == 0) {
+        transferConnected(conn);
+    }
+    else if (errno == ECONNREFUSED) {
+        retryConnect(conn);
+        return;
+    }
+    else if (errno != EINPROGRESS) {
+        logErrno("Connect");
+        failTransfer(conn);
+        return;
+    }
+
+    if (watch(&conn->data, EPOLLIN | EPOLLOUT | EPOLLRDHUP,
+                EPOLL_CTL_ADD) == -1) {
+        failTransfer(conn);
+        return;
+    }
+    conn->dataPortNo = t.request.dataPortNo;
+    if (t.state == XFER_SENDING || t.state == XFER_RECEIVING)
+        sendResponse(conn);
+}
+
+/**
+ * Data socket became writable, readable or failed.
+ */
+static void handleData(Connection *conn, uint32_t events) {
+    if (conn->data.fd == -1)
+        return;
+
+    // An idle session data connection; the client may have dropped it.
+    if (conn->transfers.empty()
+            || conn->transfers.front().state == XFER_READING
+            || conn->transfers.front().state == XFER_BACKOFF) {
+        if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+            closeData(conn);
+        return;
+    }
+    Transfer &t = conn->transfers.front();
+
+    if (t.state == XFER_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof err;
+        getsockopt(conn->data.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err == ECONNREFUSED) {
+            retryConnect(conn);
+            return;
+        }
+        if (err != 0) {
+            errno = err;
+            logErrno("Connect");
+            failTransfer(conn);
+            return;
+        }
+        transferConnected(conn);
+    }
+    else if ((events & EPOLLERR) || ((events & EPOLLHUP)
+                && t.state != XFER_RECEIVING)) {
+        // An upload reads what the client sent before hanging up
+        failTransfer(conn);
+        return;
+    }
+    sendResponse(conn);
+}
+
+/**
+ * Release every descriptor held by conn and schedule it to be freed.
+ */
+static void closeConnection(Connection *conn) {
+    if (conn->closed)
+        return;
+    if (!conn->transfers.empty()
+            && conn->transfers.front().state == XFER_BACKOFF)
+        timers.erase(make_pair(conn->transfers.front().readyAt, conn));
+    deadlines.erase(make_pair(conn->checkAt, conn));
+    clientCount.fetch_sub(1, memory_order_relaxed);
+    // The run queue lets go of conn on its turn; asleep lets go now.
+    if (conn->wakeAt != -1) {
+        asleep.erase(make_pair(conn->wakeAt, conn));
+        conn->scheduled = false;
+        conn->wakeAt = -1;
+    }
+    // The ring holds its own references to the sockets, so operations
+    // in flight must be cancelled, not just have their descriptors closed.
+    if (ring)
+        cancelRingOps(conn);
+    if (conn->data.fd != -1)
+        close(conn->data.fd);
+    // Responses still being built belong to the I/O pool until their
+    // completion runs; commandParsed() releases those.
+    for (size_t i = 0; i < conn->transfers.size(); i++) {
+        logAccess(conn, conn->transfers[i], "aborted");
+        addCounter(CTR_ABORTED, 1);
+        if (conn->transfers[i].admitted)
+            transfersInFlight.fetch_sub(1, memory_order_relaxed);
+        if (conn->transfers[i].state != XFER_READING)
+            releaseResponse(&conn->transfers[i].response);
+    }
+    close(conn->control.fd);
+    conn->closed = true;
+    addCounter(CTR_ACTIVE, -1);
+
+    // Jobs still on the I/O pool, or operations on the ring, hold conn;
+    // the last one to finish frees it.
+    releaseIfIdle(conn);
+}
+
+/**
+ * Start every delayed transfer whose delay has expired.
+ *
+ * @return ms until the next delay expires, or -1 if none are pending
+ */
+static int runTimers() {
+    long long now = monotonicMs();
+    while (!timers.empty()) {
+        TimerSet::iterator first = timers.begin();
+        if (first->first > now)
+            return (int)(first->first - now);
+        Connection *conn = first->second;
+        timers.erase(first);
+        startTransfer(conn);
+    }
+    return -1;
+}
+
+/**
+ * Return when the current phase of conn expires, in monotonic ms, or -1
+ * if it cannot; phase receives its name.
+ */
+static long long phaseDeadline(const Connection *conn, const char **phase) {
+    const ServerOptions &o = serverOptions;
+
+    if (!conn->transfers.empty()) {
+        const Transfer &t = conn->transfers.front();
+        const Upload *upload = t.response.upload.get();
+        if (t.expired)
+            return -1;  // Failing already
+        switch (t.state) {
+        case XFER_CONNECTING:
+            *phase = "connect";
+            return o.connectTimeout ? t.firstAttempt
+                + o.connectTimeout * 1000LL : -1;
+        case XFER_SENDING:
+        case XFER_RECEIVING:
+            // The disk, not the client, holds up a write or a commit
+            if (upload && (upload->writing || upload->committing))
+                return -1;
+            *phase = (t.state == XFER_SENDING) ? "send" : "receive";
+            return o.sendTimeout ? conn->activeMs
+                + o.sendTimeout * 1000LL : -1;
+        default:
+            return -1;  // Reading the disk, or backing off
+        }
+    }
+    if (conn->messageMs != -1) {
+        *phase = "header";
+        return o.headerTimeout ? conn->messageMs
+            + o.headerTimeout * 1000LL : -1;
+    }
+    *phase = "idle";
+    return o.idleTimeout ? conn->activeMs + o.idleTimeout * 1000LL : -1;
+}
+
+/**
+ * (Re)enter conn in the deadline set: at the expiry of its current
+ * phase, or after DEADLINE_RECHECK_MS, whichever is sooner, since its
+ * phase may change meanwhile.
+ */
+static void armDeadline(Connection *conn, long long now) {
+    const char *phase;
+    long long due = phaseDeadline(conn, &phase);
+    long long at = now + DEADLINE_RECHECK_MS;
+
+    if (due != -1 && due < at)
+        at = (due > now) ? due : now + 1;
+    conn->checkAt = at;
+    deadlines.insert(make_pair(at, conn));
+}
+
+/**
+ * End what conn was doing in phase, now past its deadline: a stalled
+ * command or an idle client loses its connection, a stalled transfer
+ * fails. On the ring, an operation in flight is cancelled instead, and
+ * its completion fails the transfer.
+ */
+static void expirePhase(Connection *conn, const char *phase) {
+    logMessage(LOG_WARN, "Client %s timed out: %s", conn->cHostname.c_str(),
+            phase);
+    addCounter(CTR_TIMEOUTS, 1);
+    if (conn->transfers.empty()) {
+        closeConnection(conn);
+        return;
+    }
+    Transfer &t = conn->transfers.front();
+    t.expired = true;
+    if (ring && conn->io.dataOp != OP_NONE) {
+        ringCancel(ring, tagOf(&conn->data, (RingOp)conn->io.dataOp));
+        return;
+    }
+    failTransfer(conn);
+}
+
+/**
+ * Check every connection whose deadline check is due.
+ */
+static void runDeadlines() {
+    long long now = monotonicMs();
+    while (!deadlines.empty() && deadlines.begin()->first <= now) {
+        Connection *conn = deadlines.begin()->second;
+        deadlines.erase(deadlines.begin());
+        const char *phase;
+        long long due = phaseDeadline(conn, &phase);
+        if (due != -1 && due <= now) {
+            expirePhase(conn, phase);
+            if (conn->closed)
+                continue;
+        }
+        armDeadline(conn, now);
+    }
+}
+
+/**
+ * Run due timers, send turns and deadline checks, and return how long
+ * the reactor may wait for events: 0 while connections wait for a turn,
+ * else ms until the next timer, wake-up or check, or -1 if there is none.
+ */
+static int pollTimeout() {
+    runSendQueue();
+    runDeadlines();
+    int timeout = runTimers();
+    if (!runQueue.empty())
+        return 0;
+    const TimerSet *waits[] = { &asleep, &deadlines };
+    for (int i = 0; i < 2; i++) {
+        if (waits[i]->empty())
+            continue;
+        long long wait = waits[i]->begin()->first - monotonicMs();
+        wait = (wait < 0) ? 0 : wait;
+        if (timeout == -1 || wait < timeout)
+            timeout = (int)wait;
+    }
+    return timeout;
+}
+
+/**
+ * Return the tag of operation op on ep.
+ */
+static unsigned long long tagOf(Endpoint *ep, RingOp op) {
+    return (unsigned long long)(uintptr_t)ep | op;
+}
+
+/**
+ * Arm the multishot receive of the control socket.
+ *
+ * @return false if it could not be queued
+ */
+static bool armRecv(Connection *conn) {
+    if (!ringRecvMulti(ring, conn->control.fd,
+                tagOf(&conn->control, OP_RECV)))
+        return false;
+    conn->io.recvArmed = true;
+    conn->io.ops++;
+    return true;
+}
+
+/**
+ * Wait for room on the control socket for the queued replies.
+ *
+ * @return false if the wait could not be queued
+ */
+static bool armPollOut(Connection *conn) {
+    if (conn->io.pollOut)
+        return true;
+    if (!ringPoll(ring, conn->control.fd, POLLOUT, false,
+                tagOf(&conn->control, OP_POLL))) {
+        logErrno("io_uring poll");
+        return false;
+    }
+    conn->io.pollOut = true;
+    conn->io.ops++;
+    return true;
+}
+
+/**
+ * Record that op is in flight on the data socket.
+ */
+static void dataOpQueued(Connection *conn, RingOp op) {
+    conn->io.dataOp = op;
+    conn->io.ops++;
+}
+
+/**
+ * Cancel every operation conn has in flight; their completions still
+ * arrive, and the last one lets conn be freed.
+ */
+static void cancelRingOps(Connection *conn) {
+    if (conn->io.recvArmed)
+        ringCancel(ring, tagOf(&conn->control, OP_RECV));
+    if (conn->io.pollOut)
+        ringCancel(ring, tagOf(&conn->control, OP_POLL));
+    unwatchIdleData(conn);
+    if (conn->io.dataOp != OP_NONE)
+        ringCancel(ring, tagOf(&conn->data, (RingOp)conn->io.dataOp));
+}
+
+/**
+ * Return the buffer the front transfer's file bytes are read into.
+ */
+static char *fileBuffer(Connection *conn) {
+    if (conn->io.fixedBuf != -1)
+        return fixedBuffer(ring, conn->io.fixedBuf);
+    return conn->io.heapBuf.data();
+}
+
+/**
+ * Give up the file buffer of a transfer that has ended.
+ */
+static void releaseFileBuffer(Connection *conn) {
+    if (conn->io.fixedBuf != -1) {
+        releaseFixedBuffer(ring, conn->io.fixedBuf);
+        conn->io.fixedBuf = -1;
+    }
+    conn->io.bufLen = 0;
+    conn->io.bufSent = 0;
+}
+
+/**
+ * Watch an idle session data connection for the client dropping it, as
+ * EPOLLRDHUP does on epoll, so the next response connects afresh.
+ */
+static void watchIdleData(Connection *conn) {
+    if (conn->closed || conn->data.fd == -1 || conn->io.idlePoll
+            || conn->io.dataOp != OP_NONE)
+        return;
+    if (!conn->transfers.empty()
+            && (conn->transfers.front().state == XFER_SENDING
+                || conn->transfers.front().state == XFER_RECEIVING))
+        return;  // Not idle after all
+    // Not fatal if it cannot be queued; the next send finds a dead peer.
+    if (ringPoll(ring, conn->data.fd, POLLRDHUP, false,
+                tagOf(&conn->data, OP_POLL))) {
+        conn->io.idlePoll = true;
+        conn->io.ops++;
+    }
+}
+
+/**
+ * Stop watching the data connection before it is used or closed. A
+ * result the watch delivers after this is stale and ignored.
+ */
+static void unwatchIdleData(Connection *conn) {
+    if (conn->io.idlePoll) {
+        ringCancel(ring, tagOf(&conn->data, OP_POLL));
+        conn->io.idlePoll = false;
+    }
+}
+
+/**
+ * Queue the connect of the data socket to conn->io.dataAddr.
+ */
+static void ringConnectData(Connection *conn) {
+    conn->dataPortNo = conn->transfers.front().request.dataPortNo;
+    if (!ringConnect(ring, conn->data.fd,
+                (struct sockaddr *)&conn->io.dataAddr,
+                sizeof conn->io.dataAddr, tagOf(&conn->data, OP_CONNECT))) {
+        logErrno("io_uring connect");
+        failTransfer(conn);
+        return;
+    }
+    dataOpQueued(conn, OP_CONNECT);
+}
+
+/**
+ * Queue the next operation of the front response: the rest of the file
+ * buffer, the next file chunk into it, or the in-memory pieces.
+ *
+ * @return true if the transfer ended (finished or failed), false if an
+ *         operation is in flight
+ */
+static bool ringSendFront(Connection *conn) {
+    Transfer &t = conn->transfers.front();
+    RingIo &io = conn->io;
+    unsigned long long sendTag = tagOf(&conn->data, OP_SEND);
+    RingOp op = OP_SEND;
+    bool queued;
+
+    if (io.dataOp != OP_NONE)
+        return false;
+    advancePart(t);
+    Response &r = currentPart(t);
+    size_t at = t.sent - t.partStart;
+    size_t headerLen = r.header.length();
+    size_t bodyEnd = headerLen + r.length;
+    if (r.stream && at >= bodyEnd && !gzipStreamEnded(*r.stream)) {
+        int next = nextSegment(conn);
+        if (next != 1)
+            return next == -1;
+        at = t.sent - t.partStart;
+        headerLen = 0;
+        bodyEnd = r.length;
+    }
+    if (at >= bodyEnd + r.trailer.length()) {
+        finishTransfer(conn, true);
+        return true;
+    }
+
+    if (io.bufSent < io.bufLen) {
+        size_t budget = sendBudget(conn);
+        if (budget == 0)
+            return false;  // Resumed on its next turn
+        queued = ringSend(ring, conn->data.fd, fileBuffer(conn) + io.bufSent,
+                min(io.bufLen - io.bufSent, budget), MSG_NOSIGNAL, sendTag);
+    }
+    else if (r.fd != -1 && at >= headerLen && at < bodyEnd) {
+        // Reads go to a registered buffer when one is free
+        if (io.fixedBuf == -1)
+            io.fixedBuf = acquireFixedBuffer(ring);
+        if (io.fixedBuf == -1 && io.heapBuf.empty())
+            io.heapBuf.resize(URING_FIXED_BUF_LEN);
+        size_t toRead = bodyEnd - at;
+        toRead = (toRead < URING_FIXED_BUF_LEN) ? toRead : URING_FIXED_BUF_LEN;
+        queued = ringRead(ring, r.fd, fileBuffer(conn), toRead,
+                r.offset + (at - headerLen), io.fixedBuf,
+                tagOf(&conn->data, OP_READ));
+        op = OP_READ;
+    }
+    else {
+        size_t budget = sendBudget(conn);
+        if (budget == 0)
+            return false;
+        gatherPieces(t, &io.msg, io.iov);
+        clampPieces(&io.msg, budget);
+        queued = ringSendmsg(ring, conn->data.fd, &io.msg, MSG_NOSIGNAL,
+                sendTag);
+    }
+
+    if (!queued) {
+        logErrno("io_uring send");
+        failTransfer(conn);
+        return true;
+    }
+    dataOpQueued(conn, op);
+    return false;
+}
+
+/**
+ * A multishot accept produced a client socket, or failed.
+ */
+static void ringAccepted(Endpoint *listenEp, const Completion &c) {
+    if (!c.more && !ringAcceptMulti(ring, listenEp->fd,
+                tagOf(listenEp, OP_ACCEPT)))
+        logErrno("io_uring accept");
+    if (c.res < 0) {
+        // Per-client errors; the accept stays armed.
+        if (c.res != -EAGAIN && c.res != -EINTR && c.res != -ECONNABORTED) {
+            errno = -c.res;
+            logErrno("Accept");
+        }
+        return;
+    }
+
+    long long acceptedUs = monotonicUs();
+    Connection *conn = new Connection();
+    conn->addrlen = sizeof(struct sockaddr_storage);
+    if (getpeername(c.res, (struct sockaddr *)&conn->addr,
+                &conn->addrlen) == -1) {
+        close(c.res);  // Gone already
+        delete conn;
+        return;
+    }
+    addClient(conn, c.res, acceptedUs);
+}
+
+/**
+ * A control receive completed: append its bytes, or note the end of
+ * the stream, then process the commands.
+ */
+static void ringReceived(Connection *conn, const Completion &c) {
+    if (c.res > 0) {
+        conn->inBuf.append(recvBuffer(ring, c.bufferId), c.res);
+        recycleRecvBuffer(ring, c.bufferId);
+    }
+    else if (c.res == 0) {  // All data has been received
+        conn->peerClosed = true;
+    }
+    else if (c.res != -ENOBUFS) {  // Out of buffers: just rearm below
+        errno = -c.res;
+        logErrno("Recv");
+        closeConnection(conn);
+        return;
+    }
+
+    if (!conn->io.recvArmed && !conn->peerClosed && !armRecv(conn)) {
+        logErrno("io_uring recv");
+        closeConnection(conn);
+        return;
+    }
+    controlReceived(conn);
+}
+
+/**
+ * A data connect completed.
+ */
+static void ringConnected(Connection *conn, int res) {
+    if (res == -ECONNREFUSED) {
+        retryConnect(conn);
+        return;
+    }
+    if (res < 0) {
+        errno = -res;
+        if (res != -ECANCELED)  // Cancelled by expirePhase(), which logged
+            logErrno("Connect");
+        failTransfer(conn);
+        return;
+    }
+    transferConnected(conn);
+    sendResponse(conn);
+}
+
+/**
+ * A data send completed.
+ */
+static void ringSent(Connection *conn, int res) {
+    Transfer &t = conn->transfers.front();
+
+    if (res < 0) {
+        // Epoll notices a client dropping an idle session connection
+        // while it is idle; the ring notices when the next response
+        // fails. Nothing of it went out, so connect afresh.
+        if (t.sent == 0 && t.attempts == 0 && !t.response.upload
+                && !t.expired) {
+            closeData(conn);
+            releaseFileBuffer(conn);
+            startTransfer(conn);
+            return;
+        }
+        errno = -res;
+        if (res != -ECANCELED)
+            logErrno("Send");
+        failTransfer(conn);
+        return;
+    }
+    if (conn->io.bufSent < conn->io.bufLen)
+        conn->io.bufSent += res;
+    t.sent += res;
+    chargeSend(conn, res);
+    sendResponse(conn);
+}
+
+/**
+ * A receive of upload bytes completed.
+ */
+static void ringBodyReceived(Connection *conn, int res) {
+    if (res < 0) {
+        errno = -res;
+        if (res != -ECANCELED)
+            logErrno("Receive");
+        failTransfer(conn);
+        return;
+    }
+    if (bodyReceived(conn, res))
+        sendResponse(conn);
+}
+
+/**
+ * A file read into the connection's buffer completed.
+ */
+static void ringFileRead(Connection *conn, int res) {
+    if (res <= 0) {
+        if (res == 0) {  // File shrank underneath us
+            logMessage(LOG_WARN, "File %s truncated during transfer",
+                    conn->transfers.front().request.filename.c_str());
+        }
+        else {
+            errno = -res;
+            logErrno("Read");
+        }
+        failTransfer(conn);
+        return;
+    }
+    conn->io.bufLen = res;
+    conn->io.bufSent = 0;
+    sendResponse(conn);
+}
+
+/**
+ * Dispatch one completion of a connection's operation.
+ */
+static void connectionCompleted(Endpoint *ep, RingOp op,
+        const Completion &c) {
+    Connection *conn = ep->conn;
+    bool current = true;  // Not the stale result of a cancelled watch
+
+    if (!c.more) {
+        conn->io.ops--;
+        if (op == OP_RECV && ep == &conn->control) {
+            conn->io.recvArmed = false;
+        }
+        else if (op == OP_POLL && ep == &conn->control) {
+            conn->io.pollOut = false;
+        }
+        else if (op == OP_POLL) {
+            current = conn->io.idlePoll;
+            conn->io.idlePoll = false;
+        }
+        else {
+            conn->io.dataOp = OP_NONE;
+        }
+    }
+    if (conn->closed) {
+        if (c.bufferId != -1)
+            recycleRecvBuffer(ring, c.bufferId);
+        if (!c.more)
+            releaseIfIdle(conn);
+        return;
+    }
+
+    switch (op) {
+    case OP_RECV:
+        if (ep == &conn->data)
+            ringBodyReceived(conn, c.res);
+        else
+            ringReceived(conn, c);
+        break;
+    case OP_POLL:
+        if (ep == &conn->data) {
+            if (current && c.res > 0)
+                closeData(conn);  // Client dropped its idle session
+        }
+        else if (!flushControl(conn)) {
+            closeConnection(conn);
+        }
+        break;
+    case OP_CONNECT:
+        ringConnected(conn, c.res);
+        break;
+    case OP_SEND:
+        ringSent(conn, c.res);
+        break;
+    case OP_READ:
+        ringFileRead(conn, c.res);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Run the event loop on the ring until notKilled is cleared.
+ *
+ * @return 0 on clean exit, -1 on a fatal io_uring error
+ */
+static int runRingReactor(int listener, bool *notKilled) {
+    Endpoint listenEp = { listener, EP_LISTENER, NULL };
+    Endpoint mailboxEp = { mailboxFd(mailbox), EP_MAILBOX, NULL };
+    Completion c;
+
+    if (!ringAcceptMulti(ring, listener, tagOf(&listenEp, OP_ACCEPT))
+            || !ringPoll(ring, mailboxEp.fd, POLLIN, true,
+                tagOf(&mailboxEp, OP_MAILBOX))) {
+        logErrno("io_uring");
+        return -1;
+    }
+
+    // Accept and serve clients until interrupt is received.
+    while (*notKilled) {
+        if (ringWait(ring, pollTimeout()) == -1) {
+            if (errno == EINTR)
+                continue;
+            logErrno("io_uring_enter");
+            return -1;
+        }
+
+        while (ringNext(ring, &c)) {
+            Endpoint *ep = (Endpoint *)(uintptr_t)(c.tag & ~RING_OP_MASK);
+            RingOp op = (RingOp)(c.tag & RING_OP_MASK);
+            switch (op) {
+            case OP_NONE:
+                break;
+            case OP_ACCEPT:
+                ringAccepted(ep, c);
+                break;
+            case OP_MAILBOX:
+                if (!c.more && !ringPoll(ring, ep->fd, POLLIN, true, c.tag))
+                    logErrno("io_uring poll");
+                drainMailbox(mailbox);
+                break;
+            default:
+                connectionCompleted(ep, op, c);
+                break;
+            }
+        }
+
+        for (size_t i = 0; i < graveyard.size(); i++)
+            delete graveyard[i];
+        graveyard.clear();
+    }
+    return 0;
+}
+
+/**
+ * Run the event loop until notKilled is cleared.
+ *
+ * @param listener a non-blocking listening socket
+ * @param notKilled whether keyboard interrupt has been received
+ *
+ * @return 0 on clean exit, -1 on a fatal epoll or io_uring error
+ */
+int runReactor(int listener, bool *notKilled) {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    Endpoint listenEp;
+    Endpoint mailboxEp;
+
+    if ((mailbox = createMailbox()) == NULL)
+        return -1;
+    if (serverOptions.ioUring) {
+        if ((ring = openRing()) != NULL) {
+            int status = runRingReactor(listener, notKilled);
+            closeRing(ring);
+            ring = NULL;
+            return status;
+        }
+        logMessage(LOG_WARN, "io_uring unavailable; serving with epoll");
+    }
+
+    if ((epfd = epoll_create1(0)) == -1) {
+        logErrno("epoll_create1");
+        return -1;
+    }
+
+    listenEp.fd = listener;
+    listenEp.kind = EP_LISTENER;
+    listenEp.conn = NULL;
+    mailboxEp.fd = mailboxFd(mailbox);
+    mailboxEp.kind = EP_MAILBOX;
+    mailboxEp.conn = NULL;
+    if (watch(&listenEp, EPOLLIN, EPOLL_CTL_ADD) == -1
+            || watch(&mailboxEp, EPOLLIN, EPOLL_CTL_ADD) == -1)
+        return -1;
+
+    // Accept and serve clients until interrupt is received.
+    while (*notKilled) {
+        int n = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, pollTimeout());
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            logErrno("epoll_wait");
+            return -1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            Endpoint *ep = (Endpoint *)events[i].data.ptr;
+            if (ep->conn && ep->conn->closed)
+                continue;
+            switch (ep->kind) {
+            case EP_LISTENER:
+                acceptClients(ep->fd);
+                break;
+            case EP_CONTROL:
+                handleControl(ep->conn, events[i].events);
+                break;
+            case EP_DATA:
+                handleData(ep->conn, events[i].events);
+                break;
+            case EP_MAILBOX:
+                drainMailbox(mailbox);
+                break;
+            }
+        }
+
+        for (size_t i = 0; i < graveyard.size(); i++)
+            delete graveyard[i];
+        graveyard.clear();
+    }
+
+    close(epfd);
+    return 0;
+}
@@ -0,0 +1,184 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+/**
+ * File:    reactor.hpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the interfaces of the ftserver event loop.
+ *
+ *          The reactor owns the listening socket and every control and
+ *          data connection. All sockets are non-blocking and registered
+ *          edge-triggered with epoll, so one slow client can no longer
+ *          stall the others. Each control connection keeps its own read
+ *          buffer and a queue of responses waiting for a data connection.
+ *          A put reads its body from the data connection before its
+ *          response is sent back on it.
+ *
+ *          Sends are scheduled by deficit round robin: a connection
+ *          sends at most SEND_QUANTUM bytes per turn, then yields to the
+ *          back of its reactor's run queue. A multi-gigabyte transfer
+ *          thus takes turns with every other, and a small response or
+ *          listing waits for at most one quantum per busy connection.
+ *          Connections over a rate limit wait out their token bucket.
+ *
+ *          Every phase of a connection has a deadline: finishing a
+ *          command, sitting idle, connecting to the data port and making
+ *          progress on a transfer. Each connection has one entry in its
+ *          reactor's deadline set, checked when the phase would expire
+ *          or at least every DEADLINE_RECHECK_MS; progress only updates
+ *          a timestamp, so a busy connection costs nothing extra.
+ *
+ *          With the io_uring backend the same reactor is driven by
+ *          completions instead: operations are queued on the ring and the
+ *          handlers run when they finish, rather than when a socket
+ *          becomes ready.
+ */
+#include <string>
+#include <deque>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>      // struct iovec
+#include <netinet/in.h>
+#include "ftserver.hpp"
+#include "parser.hpp"
+#include "ratelimit.hpp"
+#include "bufpool.hpp"
+
+#define MAX_EPOLL_EVENTS 256  // Events handled per epoll_wait() call
+#define GATHER_IOV 64  // In-memory pieces gathered into one sendmsg()
+#define SEND_QUANTUM (256 * 1024)  // Bytes a connection sends per turn
+
+// Retry schedule when the client's data port refuses the connection,
+// typically because it opens its listener only after sending a command.
+#define CONNECT_BACKOFF_MIN_MS 1     // First retry delay; doubles each time
+#define CONNECT_BACKOFF_MAX_MS 256   // Longest delay between retries
+
+// Deadlines of each phase of a connection, in seconds; 0 never expires.
+// A client that stalls in a phase is dropped, or its transfer failed.
+#define DEFAULT_HEADER_TIMEOUT 10   // First byte of a command to its last
+#define DEFAULT_IDLE_TIMEOUT 300    // No command and no transfer
+#define DEFAULT_CONNECT_TIMEOUT 5   // First data connect attempt to connected
+#define DEFAULT_SEND_TIMEOUT 60     // No data sent or received
+#define DEADLINE_RECHECK_MS 1000    // Longest wait between deadline checks
+
+// What an epoll registration refers to.
+enum EndpointKind { EP_LISTENER, EP_CONTROL, EP_DATA, EP_MAILBOX };
+
+// Progress of a response through its data connection.
+enum TransferState {
+    XFER_READING,     // parseCommand() running on the I/O pool
+    XFER_BACKOFF,     // Waiting to (re)try connecting at readyAt
+    XFER_CONNECTING,  // Non-blocking connect() in progress
+    XFER_RECEIVING,   // Connected; reading and storing an upload body
+    XFER_SENDING      // Connected; writing response bytes
+};
+
+struct Connection;
+
+// Registered with epoll as data.ptr
+struct Endpoint {
+    int fd;
+    EndpointKind kind;
+    Connection *conn;  // NULL for the listener and mailbox
+};
+
+// One response destined for a client's data port.
+struct Transfer {
+    Request request;       // The command, with the client's data port
+    std::string client;    // Client hostname when the command arrived
+    Response response;     // Formatted response; owns its file
+    size_t sent;           // Header, body and trailer bytes written
+    size_t part;           // Response being sent: 0, or 1 + batch part
+    size_t partStart;      // Bytes written before that response
+    long long startUs;     // Monotonic us the command was parsed
+    TransferState state;
+    long long readyAt;     // Monotonic ms at which to connect
+    int attempts;          // Connects tried so far
+    long long firstAttempt;  // Monotonic ms of the first connect
+    long long connectUs;   // Monotonic us of the first connect
+    long long sendUs;      // Monotonic us the data connection was ready
+    bool admitted;         // Counted against --max-transfers
+    bool expired;          // Past its deadline; failing
+};
+
+// A connection's io_uring operations; unused with epoll.
+struct RingIo {
+    int ops;                    // Operations in flight that refer to conn
+    bool recvArmed;             // Multishot receive on the control socket
+    bool pollOut;               // Waiting for control socket space
+    bool idlePoll;              // Watching an idle session data socket
+    int dataOp;                 // Operation on the data socket, or 0
+    struct sockaddr_in dataAddr;  // Target of a connect in flight
+    struct msghdr msg;          // Gather send in flight
+    struct iovec iov[GATHER_IOV];
+    int fixedBuf;               // Fixed buffer holding file bytes, or -1
+    std::vector<char> heapBuf;  // File bytes when no fixed buffer is free
+    size_t bufLen;              // File bytes read into the buffer
+    size_t bufSent;             // Of which sent
+};
+
+// Per-client control connection state.
+struct Connection {
+    Endpoint control;                // The control socket
+    Endpoint data;                   // Data socket (kept open in a session)
+    struct sockaddr_storage addr;    // Client address
+    socklen_t addrlen;
+    std::string cHostname;           // Client hostname (status messages)
+    std::string inBuf;               // Bytes received but not yet parsed
+    MessageParser parser;            // Progress through inBuf
+    std::string outBuf;              // Control replies not yet sent
+    std::string lastGet;             // File last got, to learn patterns
+    int proto;                       // Negotiated response protocol
+    bool session;                    // Keep the data connection open
+    int dataPortNo;                  // Client port of the open data socket
+    bool sending;                    // Inside sendResponse(); no reentry
+    // Front is the active transfer; nodes are reused, not freed
+    std::deque<Transfer, RecyclingAllocator<Transfer> > transfers;
+    bool peerClosed;                 // Control side reached EOF
+    bool closed;                     // Descriptors released; awaiting free
+    int pendingJobs;                 // I/O pool jobs that still hold this
+    size_t deficit;                  // Bytes left of its send turn
+    TokenBucket bucket;              // Its --client-rate limit
+    bool scheduled;                  // Parked: in the run queue or asleep
+    long long wakeAt;                // Monotonic ms it may send again, if
+                                     // asleep on its rate limit, or -1
+    long long activeMs;              // Monotonic ms of its last progress
+    long long messageMs;             // When a partial command began, or -1
+    long long checkAt;               // When its deadline is next checked
+    RingIo io;                       // io_uring backend state
+};
+
+/**
+ * Create a non-blocking listening socket on portno.
+ *
+ * @param portno port number to listen on.
+ * @param reusePort whether other sockets may bind the same port
+ *
+ * @return listening socket descriptor or -1 on error
+ */
+int openListener(const char *portno, bool reusePort);
+
+/**
+ * Run the event loop until notKilled is cleared. Every thread that
+ * calls this gets its own, independent reactor, on io_uring if
+ * serverOptions.ioUring is set and the kernel supports it, else epoll.
+ *
+ * @param listener a non-blocking listening socket
+ * @param notKilled whether keyboard interrupt has been received
+ *
+ * @return 0 on clean exit, -1 on a fatal epoll or io_uring error
+ */
+int runReactor(int listener, bool *notKilled);
+
+/**
+ * Return milliseconds on the monotonic clock.
+ */
+long long monotonicMs();
+
+/**
+ * Return microseconds on the monotonic clock.
+ */
+long long monotonicUs();
+
+#endif
@@ -0,0 +1,174 @@
+/**
+ * File:    resolver.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the implementation of the client hostname
+ *          resolver.
+ */
+#include <string>
+#include <cstring>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <netdb.h>          // getnameinfo()
+#include "resolver.hpp"
+#include "iopool.hpp"
+#include "reactor.hpp"      // monotonicMs()
+using namespace std;
+
+typedef function<void(const string &)> ResolveDone;
+
+// A reactor waiting for a name
+struct Waiter {
+    Mailbox *box;
+    ResolveDone done;
+};
+
+// One address being looked up
+struct Lookup {
+    string address;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+};
+
+// A cached result
+struct CachedName {
+    string name;
+    long long expires;  // Monotonic ms
+};
+
+// Never destroyed: the resolver thread still waits on these at exit.
+static mutex &resolverLock = *new mutex();
+static condition_variable &resolverReady = *new condition_variable();
+static deque<Lookup> &lookups = *new deque<Lookup>();
+static unordered_map<string, vector<Waiter> > &waiting =
+    *new unordered_map<string, vector<Waiter> >();
+static unordered_map<string, CachedName> &names =
+    *new unordered_map<string, CachedName>();
+
+static long long ttlMs = 0;
+
+/**
+ * Look addr up with getnameinfo(); "" if it has no name.
+ */
+static string lookupName(const struct sockaddr *addr, socklen_t addrlen) {
+    char host[NI_MAXHOST];
+    if (getnameinfo(addr, addrlen, host, sizeof host, NULL, 0,
+                NI_NAMEREQD) != 0)
+        return "";
+    return host;
+}
+
+static LookupFn lookupFn = lookupName;
+
+/**
+ * Cache name for address, making room if the cache is full.
+ *
+ * @pre resolverLock is held
+ */
+static void cacheName(const string &address, const string &name,
+        long long now) {
+    if (names.size() >= RESOLVER_CACHE_MAX && !names.count(address)) {
+        for (unordered_map<string, CachedName>::iterator it = names.begin();
+                it != names.end(); ) {
+            if (it->second.expires <= now)
+                it = names.erase(it);
+            else
+                ++it;
+        }
+        if (names.size() >= RESOLVER_CACHE_MAX)
+            names.erase(names.begin());
+    }
+    CachedName &entry = names[address];
+    entry.name = name;
+    entry.expires = now + ttlMs;
+}
+
+/**
+ * Resolver thread body: look up addresses forever.
+ */
+static void resolverThread() {
+    while (true) {
+        Lookup lookup;
+        {
+            unique_lock<mutex> guard(resolverLock);
+            while (lookups.empty())
+                resolverReady.wait(guard);
+            lookup = lookups.front();
+            lookups.pop_front();
+        }
+
+        // May block for seconds on an unreachable DNS server
+        string name = lookupFn((const struct sockaddr *)&lookup.addr,
+                lookup.addrlen);
+        if (name.empty())
+            name = lookup.address;  // No name; cached too
+
+        vector<Waiter> waiters;
+        {
+            lock_guard<mutex> guard(resolverLock);
+            cacheName(lookup.address, name, monotonicMs());
+            waiters.swap(waiting[lookup.address]);
+            waiting.erase(lookup.address);
+        }
+        for (size_t i = 0; i < waiters.size(); i++) {
+            ResolveDone done = waiters[i].done;
+            postToMailbox(waiters[i].box, [done, name]() { done(name); });
+        }
+    }
+}
+
+/**
+ * Start the resolver thread.
+ */
+void startResolver(int ttlSeconds) {
+    ttlMs = (long long)ttlSeconds * 1000;
+    thread(resolverThread).detach();
+}
+
+/**
+ * Replace the name lookup, eg. with a stub in a test.
+ */
+void setResolverLookup(LookupFn lookup) {
+    lookupFn = lookup;
+}
+
+/**
+ * Resolve the client at addr.
+ */
+bool resolveHost(const string &address, const struct sockaddr *addr,
+        socklen_t addrlen, Mailbox *box, ResolveDone done) {
+    string name;
+    {
+        lock_guard<mutex> guard(resolverLock);
+        unordered_map<string, CachedName>::iterator found =
+            names.find(address);
+        if (found != names.end() && found->second.expires > monotonicMs()) {
+            name = found->second.name;
+        }
+        else if (lookups.size() >= RESOLVER_CACHE_MAX) {
+            name = address;  // Backlogged; keep the client numeric
+        }
+        else {
+            vector<Waiter> &waiters = waiting[address];
+            Waiter waiter = { box, done };
+            waiters.push_back(waiter);
+            if (waiters.size() > 1)
+                return false;  // Already being looked up
+
+            Lookup lookup;
+            lookup.address = address;
+            memcpy(&lookup.addr, addr, addrlen);
+            lookup.addrlen = addrlen;
+            lookups.push_back(lookup);
+            resolverReady.notify_one();
+            return false;
+        }
+    }
+    done(name);
+    return true;
+}
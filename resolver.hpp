@@ -0,0 +1,58 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+/**
+ * File:    resolver.hpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the interfaces of the client hostname
+ *          resolver.
+ *
+ *          Connections are accepted with the client's numeric address;
+ *          the accept path never waits on DNS. When resolution is on, a
+ *          resolver thread looks up the name and posts it back to the
+ *          reactor's mailbox. Results, failures included, are cached by
+ *          address for a fixed time, so a busy client costs one lookup
+ *          per TTL, and concurrent lookups of one address are merged.
+ */
+#include <string>
+#include <functional>
+#include <sys/socket.h>
+
+#define RESOLVER_CACHE_MAX 4096  // Addresses cached at most
+
+struct Mailbox;
+
+// Name lookup of an address; returns "" if the address has no name.
+typedef std::function<std::string(const struct sockaddr *, socklen_t)>
+    LookupFn;
+
+/**
+ * Start the resolver thread.
+ *
+ * @param ttlSeconds how long a result is cached
+ */
+void startResolver(int ttlSeconds);
+
+/**
+ * Replace the name lookup, eg. with a stub in a test. The default uses
+ * getnameinfo(). Call before startResolver().
+ */
+void setResolverLookup(LookupFn lookup);
+
+/**
+ * Resolve the client at addr.
+ *
+ * @param address the numeric form of addr; the cache key
+ * @param box mailbox of the calling reactor
+ * @param done receives the hostname, or address if it has none; runs on
+ *        the reactor that owns box
+ *
+ * @return true if done has been called already, on this thread: the
+ *         name was cached, or too many lookups are queued to add one
+ */
+bool resolveHost(const std::string &address, const struct sockaddr *addr,
+        socklen_t addrlen, Mailbox *box,
+        std::function<void(const std::string &)> done);
+
+#endif
@@ -0,0 +1,268 @@
+/**
+ * File:    upload.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the implementation of file uploads.
+ *
+ *          A sync of the file only makes its data durable; the rename is
+ *          a change to the directory, which needs a sync of its own. A
+ *          group commit syncs the whole filesystem once, renames every
+ *          upload of the group, then syncs the directory once.
+ */
+#include <string>
+#include <cerrno>
+#include <cstdio>       // rename()
+#include <cstdlib>      // mkostemp()
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <climits>      // NAME_MAX
+#include <cstring>
+#include <fcntl.h>      // fallocate()
+#include <unistd.h>
+#include <sys/stat.h>
+#include "upload.hpp"
+#include "iopool.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+using namespace std;
+
+// An upload waiting for the group committer
+struct Commit {
+    shared_ptr<Upload> upload;
+    Mailbox *box;
+    function<void()> done;
+};
+
+// Never destroyed: the committer thread still waits on these at exit.
+static mutex &commitLock = *new mutex();
+static condition_variable &commitReady = *new condition_variable();
+static deque<Commit> &commits = *new deque<Commit>();
+
+/**
+ * Remove the temporary file of an upload that was not stored.
+ */
+Upload::~Upload() {
+    if (fd != -1)
+        close(fd);
+    if (!stored && !tempName.empty())
+        unlink(tempName.c_str());
+}
+
+/**
+ * Parse a durability mode name: none, file or group.
+ */
+bool parseDurability(const string &name, Durability *mode) {
+    static const char *names[] = { "none", "file", "group" };
+
+    for (int i = DURABILITY_NONE; i <= DURABILITY_GROUP; i++) {
+        if (name == names[i]) {
+            *mode = (Durability)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Return if name is that of an upload's temporary file.
+ */
+bool uploadTempName(const char *name) {
+    return strncmp(name, UPLOAD_TEMP_PREFIX,
+            sizeof UPLOAD_TEMP_PREFIX - 1) == 0;
+}
+
+/**
+ * Sync the served directory, making renames into it durable.
+ *
+ * @return false on failure
+ */
+static bool syncDirectory() {
+    int dirFd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd == -1) {
+        logErrno("Open directory");
+        return false;
+    }
+    bool synced = (fsync(dirFd) == 0);
+    if (!synced)
+        logErrno("fsync directory");
+    close(dirFd);
+    return synced;
+}
+
+/**
+ * Rename a written upload over its name.
+ *
+ * @return false on failure, with error set
+ */
+static bool publishUpload(Upload *upload) {
+    if (rename(upload->tempName.c_str(), upload->name.c_str()) == -1) {
+        logErrno("Rename upload");
+        upload->error = "COULD NOT STORE FILE";
+        return false;
+    }
+    upload->stored = true;
+    addCounter(CTR_UPLOADS, 1);
+    return true;
+}
+
+/**
+ * Commit one upload by itself. Blocks; runs on the I/O pool.
+ */
+static void commitAlone(Upload *upload, Durability mode) {
+    if (!upload->error.empty())
+        return;
+    if (mode == DURABILITY_FILE) {
+        addCounter(CTR_UPLOAD_SYNCS, 1);
+        if (fdatasync(upload->fd) == -1) {
+            logErrno("fdatasync upload");
+            upload->error = "COULD NOT STORE FILE";
+            return;
+        }
+    }
+    if (publishUpload(upload) && mode == DURABILITY_FILE
+            && !syncDirectory())
+        upload->error = "COULD NOT STORE FILE";
+}
+
+/**
+ * Committer thread body: commit every upload waiting, together, forever.
+ */
+static void committerThread() {
+    while (true) {
+        vector<Commit> group;
+        {
+            unique_lock<mutex> guard(commitLock);
+            while (commits.empty())
+                commitReady.wait(guard);
+            while (!commits.empty() && group.size() < GROUP_COMMIT_MAX) {
+                group.push_back(commits.front());
+                commits.pop_front();
+            }
+        }
+
+        // Uploads arriving during the sync wait for the next group.
+        addCounter(CTR_UPLOAD_SYNCS, 1);
+        bool synced = (syncfs(group[0].upload->fd) == 0);
+        if (!synced)
+            logErrno("syncfs uploads");
+
+        bool renamed = false;
+        for (size_t i = 0; i < group.size(); i++) {
+            Upload *upload = group[i].upload.get();
+            if (!synced)
+                upload->error = "COULD NOT STORE FILE";
+            else if (publishUpload(upload))
+                renamed = true;
+        }
+        if (renamed && !syncDirectory()) {
+            for (size_t i = 0; i < group.size(); i++) {
+                if (group[i].upload->stored)
+                    group[i].upload->error = "COULD NOT STORE FILE";
+            }
+        }
+
+        for (size_t i = 0; i < group.size(); i++)
+            postToMailbox(group[i].box, group[i].done);
+    }
+}
+
+/**
+ * Start the group committer thread, for DURABILITY_GROUP.
+ */
+void startCommitter() {
+    thread(committerThread).detach();
+}
+
+/**
+ * Create the temporary file of an upload to name.
+ */
+shared_ptr<Upload> openUpload(const string &name, bool sized, uint64_t size,
+        string *error) {
+    // Only names in the served directory; never a path out of it.
+    if (name.empty() || name == "." || name == ".."
+            || name.find('/') != string::npos || name.length() > NAME_MAX
+            || uploadTempName(name.c_str())) {
+        *error = "INVALID FILE NAME";
+        return NULL;
+    }
+
+    shared_ptr<Upload> upload(new Upload());
+    upload->name = name;
+    upload->sized = sized;
+    upload->size = size;
+
+    char temp[] = UPLOAD_TEMP_PREFIX "XXXXXX";
+    upload->fd = mkostemp(temp, O_CLOEXEC);
+    if (upload->fd == -1) {
+        logErrno("Create upload");
+        *error = "COULD NOT CREATE FILE";
+        return NULL;
+    }
+    upload->tempName = temp;
+    fchmod(upload->fd, 0644);  // mkostemp() makes it private
+
+    // Reserve the blocks up front: no ENOSPC halfway through, and the
+    // file is laid out in few extents.
+    if (sized && size > 0 && fallocate(upload->fd, 0, 0, size) == -1
+            && errno != EOPNOTSUPP) {
+        logErrno("fallocate upload");
+        *error = (errno == ENOSPC) ? "NOT ENOUGH SPACE"
+            : "COULD NOT CREATE FILE";
+        return NULL;
+    }
+
+    upload->buffer.resize(UPLOAD_CHUNK);
+    upload->writeBuf.resize(UPLOAD_CHUNK);
+    return upload;
+}
+
+/**
+ * Return if every byte of the body has been received.
+ */
+bool uploadReceived(const Upload &upload) {
+    return upload.sized ? upload.received == upload.size : upload.eof;
+}
+
+/**
+ * Write writeBuf to the file. Blocks; runs on the I/O pool.
+ */
+void writeUpload(Upload *upload) {
+    StageTimer timer(STAGE_WRITE);
+    size_t done = 0;
+
+    while (done < upload->writeLen && upload->error.empty()) {
+        ssize_t n = pwrite(upload->fd, upload->writeBuf.data() + done,
+                upload->writeLen - done, upload->written);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            logErrno("Write upload");
+            upload->error = (errno == ENOSPC) ? "NOT ENOUGH SPACE"
+                : "COULD NOT WRITE FILE";
+            return;
+        }
+        done += n;
+        upload->written += n;
+    }
+}
+
+/**
+ * Make a written upload durable as mode says and rename it over its
+ * name, setting stored or error.
+ */
+void commitUpload(shared_ptr<Upload> upload, Durability mode, Mailbox *box,
+        function<void()> done) {
+    if (mode != DURABILITY_GROUP || !upload->error.empty()) {
+        submitIo(box, [upload, mode]() { commitAlone(upload.get(), mode); },
+                done);
+        return;
+    }
+    Commit commit = { upload, box, done };
+    lock_guard<mutex> guard(commitLock);
+    commits.push_back(commit);
+    commitReady.notify_one();
+}
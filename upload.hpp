@@ -0,0 +1,123 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+/**
+ * File:    upload.hpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the interfaces of file uploads.
+ *
+ *          A put streams its body from the data connection into a
+ *          temporary file in the served directory, preallocated with
+ *          fallocate() when the client gives the size. The reactor
+ *          receives into one buffer while the I/O pool writes the other,
+ *          so the socket and the disk stay busy together and at most two
+ *          buffers of a body are ever held. Once the body is on disk the
+ *          file is made durable and renamed over its name, so readers see
+ *          either the old file or the whole new one.
+ *
+ *          Durability is a server option: none leaves flushing to the
+ *          kernel; file syncs each upload and the directory before
+ *          answering; group hands uploads to a committer thread that
+ *          makes every upload waiting at once durable with one syncfs()
+ *          and one directory sync, so concurrent uploads share the cost.
+ */
+#include <string>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <stdint.h>
+
+#define UPLOAD_CHUNK (1 << 20)  // Body bytes per buffer and per write
+#define GROUP_COMMIT_MAX 256    // Most uploads made durable together
+#define UPLOAD_TEMP_PREFIX ".ftupload-"  // Temporary files, until renamed
+
+// When an upload is on stable storage before the client is answered
+enum Durability {
+    DURABILITY_NONE,   // Renamed only; flushed whenever the kernel likes
+    DURABILITY_FILE,   // fdatasync() of each file, then its directory
+    DURABILITY_GROUP   // One syncfs() for every upload waiting together
+};
+
+// Receives completions from the pool on a reactor thread.
+struct Mailbox;
+
+// One body being received. The reactor fills buffer while the I/O pool
+// writes writeBuf; the two are swapped as each write is handed over.
+struct Upload {
+    std::string name;      // Final name in the served directory
+    std::string tempName;  // Where the body is written until committed
+    int fd;                // The temporary file
+    bool sized;            // The client gave the body length
+    uint64_t size;         // The body length, when sized
+    uint64_t received;     // Body bytes read from the data connection
+    uint64_t written;      // Of which on disk (in the page cache)
+    std::vector<char> buffer;    // Being received into
+    size_t buffered;             // Bytes in buffer
+    std::vector<char> writeBuf;  // Being written by the I/O pool
+    size_t writeLen;             // Bytes in writeBuf
+    bool writing;          // A write is running on the I/O pool
+    bool eof;              // The client ended the stream
+    bool committing;       // The whole body is written; committing
+    bool stored;           // Renamed over name
+    std::string error;     // Why the upload failed, or empty
+
+    Upload() : fd(-1), sized(false), size(0), received(0), written(0),
+        buffered(0), writeLen(0), writing(false), eof(false),
+        committing(false), stored(false) {}
+    ~Upload();
+};
+
+/**
+ * Parse a durability mode name: none, file or group.
+ *
+ * @return false if name is not a mode
+ */
+bool parseDurability(const std::string &name, Durability *mode);
+
+/**
+ * Start the group committer thread, for DURABILITY_GROUP.
+ */
+void startCommitter();
+
+/**
+ * Return if name is that of an upload's temporary file. Such files are
+ * half written, so they are never listed, served or uploaded to.
+ */
+bool uploadTempName(const char *name);
+
+/**
+ * Create the temporary file of an upload to name.
+ *
+ * @param name a file name in the served directory
+ * @param sized whether size is the body length
+ * @param error receives why the upload cannot be taken, on failure
+ *
+ * @return the new upload, or NULL on failure
+ */
+std::shared_ptr<Upload> openUpload(const std::string &name, bool sized,
+        uint64_t size, std::string *error);
+
+/**
+ * Return if every byte of the body has been received.
+ */
+bool uploadReceived(const Upload &upload);
+
+/**
+ * Write writeBuf to the file. Blocks; runs on the I/O pool. After a
+ * failure, sets error and skips later writes, so the rest of the body
+ * is only drained.
+ */
+void writeUpload(Upload *upload);
+
+/**
+ * Make a written upload durable as mode says and rename it over its
+ * name, setting stored or error.
+ *
+ * @param box mailbox of the submitting reactor
+ * @param done completion; runs on the reactor that owns box
+ */
+void commitUpload(std::shared_ptr<Upload> upload, Durability mode,
+        Mailbox *box, std::function<void()> done);
+
+#endif
@@ -0,0 +1,544 @@
+/**
+ * File:    uring.cpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the implementation of the io_uring
+ *          wrapper.
+ *
+ *          The queues are the kernel's shared rings, mapped into this
+ *          process. The submission array is filled once with the
+ *          identity, so slot i always names entry i. A new entry is
+ *          written at the local tail and published with a release store
+ *          when the queue is submitted; completions are read up to the
+ *          kernel's tail with an acquire load and handed back by moving
+ *          the head.
+ *
+ *          The kernel needs 6.0 or later, for multishot receive. The
+ *          ring asks for single-issuer, deferred task work where the
+ *          kernel has it (6.1), so completions are posted only while
+ *          the reactor waits for them.
+ */
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <vector>
+#include "uring.hpp"
+#include "logger.hpp"
+using namespace std;
+
+#ifndef FTSERVER_NO_URING
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct Ring {
+    int fd;
+
+    // Submission queue, shared with the kernel
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned sqLocalTail;        // Entries written, published on submit
+    struct io_uring_sqe *sqes;
+
+    // Completion queue, shared with the kernel
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+
+    void *sqMap;                 // Mappings released by closeRing()
+    size_t sqMapLen;
+    void *cqMap;
+    size_t cqMapLen;
+    size_t sqesLen;
+
+    struct io_uring_buf_ring *bufRing;  // Provided receive buffers
+    size_t bufRingLen;
+    char *recvBufs;
+    unsigned short bufTail;      // Local tail of bufRing
+
+    char *fixedBufs;             // Registered read buffers, or NULL
+    vector<int> freeFixed;       // Indexes of idle fixed buffers
+};
+
+// Operations the reactor queues. SEND_ZC stands in for multishot
+// receive, which has no probe bit of its own and came in the same
+// release.
+static const int requiredOps[] = {
+    IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_POLL_ADD,
+    IORING_OP_CONNECT, IORING_OP_SENDMSG, IORING_OP_SEND,
+    IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_ASYNC_CANCEL,
+    IORING_OP_SEND_ZC
+};
+
+static int sysSetup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sysEnter(int fd, unsigned toSubmit, unsigned minComplete,
+        unsigned flags, const void *arg, size_t argLen) {
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete,
+            flags, arg, argLen);
+}
+
+static int sysRegister(int fd, unsigned op, const void *arg, unsigned n) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+/**
+ * Return whether the kernel implements every operation in requiredOps.
+ */
+static bool probeOps(int fd) {
+    size_t len = sizeof(struct io_uring_probe)
+        + 256 * sizeof(struct io_uring_probe_op);
+    vector<char> buffer(len, 0);
+    struct io_uring_probe *probe = (struct io_uring_probe *)buffer.data();
+
+    if (sysRegister(fd, IORING_REGISTER_PROBE, probe, 256) == -1)
+        return false;
+    for (size_t i = 0; i < sizeof requiredOps / sizeof requiredOps[0]; i++) {
+        int op = requiredOps[i];
+        if (op > probe->last_op
+                || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            errno = EOPNOTSUPP;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Map the queues of the ring set up as fd with params p.
+ */
+static bool mapQueues(Ring *ring, const struct io_uring_params &p) {
+    ring->sqMapLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cqMapLen = p.cq_off.cqes
+        + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        if (ring->cqMapLen > ring->sqMapLen)
+            ring->sqMapLen = ring->cqMapLen;
+        ring->cqMapLen = ring->sqMapLen;
+    }
+
+    ring->sqMap = mmap(NULL, ring->sqMapLen, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqMap == MAP_FAILED) {
+        ring->sqMap = NULL;
+        return false;
+    }
+    if (single) {
+        ring->cqMap = ring->sqMap;
+    }
+    else {
+        ring->cqMap = mmap(NULL, ring->cqMapLen, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqMap == MAP_FAILED) {
+            ring->cqMap = NULL;
+            return false;
+        }
+    }
+    ring->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, ring->sqesLen, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        return false;
+    ring->sqes = (struct io_uring_sqe *)sqes;
+
+    char *sq = (char *)ring->sqMap;
+    char *cq = (char *)ring->cqMap;
+    ring->sqHead = (unsigned *)(sq + p.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sqMask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sqEntries = p.sq_entries;
+    ring->sqLocalTail = *ring->sqTail;
+    unsigned *array = (unsigned *)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+
+    ring->cqHead = (unsigned *)(cq + p.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cqMask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return true;
+}
+
+/**
+ * Register the provided receive buffers as group 0.
+ */
+static bool registerRecvBuffers(Ring *ring) {
+    ring->bufRingLen = URING_RECV_BUFS * sizeof(struct io_uring_buf);
+    void *mem = mmap(NULL, ring->bufRingLen, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return false;
+    ring->bufRing = (struct io_uring_buf_ring *)mem;
+    ring->recvBufs = new char[URING_RECV_BUFS * URING_RECV_BUF_LEN];
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (unsigned long long)(uintptr_t)mem;
+    reg.ring_entries = URING_RECV_BUFS;
+    reg.bgid = 0;
+    if (sysRegister(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        return false;
+
+    ring->bufTail = 0;
+    for (int bid = 0; bid < URING_RECV_BUFS; bid++)
+        recycleRecvBuffer(ring, bid);
+    return true;
+}
+
+/**
+ * Register the fixed file read buffers. They are pinned and count
+ * against RLIMIT_MEMLOCK; without them, reads go to ordinary memory.
+ */
+static void registerFixedBuffers(Ring *ring) {
+    size_t len = (size_t)URING_FIXED_BUFS * URING_FIXED_BUF_LEN;
+    void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return;
+
+    struct iovec iov[URING_FIXED_BUFS];
+    for (int i = 0; i < URING_FIXED_BUFS; i++) {
+        iov[i].iov_base = (char *)mem + (size_t)i * URING_FIXED_BUF_LEN;
+        iov[i].iov_len = URING_FIXED_BUF_LEN;
+    }
+    if (sysRegister(ring->fd, IORING_REGISTER_BUFFERS, iov,
+                URING_FIXED_BUFS) == -1) {
+        logMessage(LOG_WARN, "io_uring fixed buffers unavailable: %s",
+                strerror(errno));
+        munmap(mem, len);
+        return;
+    }
+    ring->fixedBufs = (char *)mem;
+    for (int i = URING_FIXED_BUFS - 1; i >= 0; i--)
+        ring->freeFixed.push_back(i);
+}
+
+/**
+ * Set up a ring, with its buffers, on a kernel that supports every
+ * operation the reactor uses.
+ *
+ * @return the ring, or NULL if io_uring is missing or too old
+ */
+Ring *openRing() {
+    struct io_uring_params p;
+    Ring *ring = new Ring();
+
+    memset(&p, 0, sizeof p);
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER
+        | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = URING_CQ_ENTRIES;
+    ring->fd = sysSetup(URING_ENTRIES, &p);
+    if (ring->fd == -1 && errno == EINVAL) {  // Before 6.1
+        memset(&p, 0, sizeof p);
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_CQ_ENTRIES;
+        ring->fd = sysSetup(URING_ENTRIES, &p);
+    }
+    if (ring->fd == -1) {
+        logErrno("io_uring_setup");
+        delete ring;
+        return NULL;
+    }
+
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !probeOps(ring->fd)) {
+        logMessage(LOG_WARN, "io_uring lacks needed operations");
+        closeRing(ring);
+        return NULL;
+    }
+    if (!mapQueues(ring, p) || !registerRecvBuffers(ring)) {
+        logErrno("io_uring setup");
+        closeRing(ring);
+        return NULL;
+    }
+    registerFixedBuffers(ring);
+    return ring;
+}
+
+/**
+ * Release ring and its buffers.
+ */
+void closeRing(Ring *ring) {
+    if (ring->fd != -1)
+        close(ring->fd);
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqesLen);
+    if (ring->cqMap && ring->cqMap != ring->sqMap)
+        munmap(ring->cqMap, ring->cqMapLen);
+    if (ring->sqMap)
+        munmap(ring->sqMap, ring->sqMapLen);
+    if (ring->bufRing)
+        munmap(ring->bufRing, ring->bufRingLen);
+    delete[] ring->recvBufs;
+    if (ring->fixedBufs)
+        munmap(ring->fixedBufs, (size_t)URING_FIXED_BUFS * URING_FIXED_BUF_LEN);
+    delete ring;
+}
+
+/**
+ * Publish the entries written since the last submit.
+ *
+ * @return how many entries the kernel has yet to consume
+ */
+static unsigned publish(Ring *ring) {
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    return ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Return a zeroed submission entry, submitting the queue first if it
+ * is full.
+ *
+ * @return the entry, or NULL if the full queue could not be submitted
+ */
+static struct io_uring_sqe *nextSqe(Ring *ring) {
+    while (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE)
+            >= ring->sqEntries) {
+        if (sysEnter(ring->fd, publish(ring), 0, 0, NULL, 0) == -1
+                && errno != EINTR)
+            return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqLocalTail & ring->sqMask];
+    memset(sqe, 0, sizeof *sqe);
+    ring->sqLocalTail++;
+    return sqe;
+}
+
+/**
+ * Submit every queued operation and wait for a completion.
+ *
+ * @param timeoutMs longest wait in ms, or -1 to wait indefinitely
+ *
+ * @return 0 once completions are ready or the timeout expired, -1 with
+ *         errno on error
+ */
+int ringWait(Ring *ring, int timeoutMs) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = IORING_ENTER_GETEVENTS;
+
+    memset(&arg, 0, sizeof arg);
+    if (timeoutMs >= 0) {
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+        arg.ts = (unsigned long long)(uintptr_t)&ts;
+    }
+    flags |= IORING_ENTER_EXT_ARG;
+    if (sysEnter(ring->fd, publish(ring), 1, flags, &arg, sizeof arg) == -1
+            && errno != ETIME)
+        return -1;
+    return 0;
+}
+
+/**
+ * Take the oldest completion.
+ *
+ * @return false if there is none
+ */
+bool ringNext(Ring *ring, Completion *c) {
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+        return false;
+
+    const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqMask];
+    c->tag = cqe->user_data;
+    c->res = cqe->res;
+    c->more = cqe->flags & IORING_CQE_F_MORE;
+    c->bufferId = (cqe->flags & IORING_CQE_F_BUFFER)
+        ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Queue an operation on fd; the caller fills in the rest.
+ */
+static struct io_uring_sqe *prepare(Ring *ring, int opcode, int fd,
+        unsigned long long tag) {
+    struct io_uring_sqe *sqe = nextSqe(ring);
+    if (sqe != NULL) {
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->user_data = tag;
+    }
+    return sqe;
+}
+
+bool ringAcceptMulti(Ring *ring, int listener, unsigned long long tag) {
+    struct io_uring_sqe *sqe = prepare(ring, IORING_OP_ACCEPT, listener, tag);
+    if (sqe == NULL)
+        return false;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    return true;
+}
+
+bool ringRecvMulti(Ring *ring, int fd, unsigned long long tag) {
+    struct io_uring_sqe *sqe = prepare(ring, IORING_OP_RECV, fd, tag);
+    if (sqe == NULL)
+        return false;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    return true;
+}
+
+bool ringPoll(Ring *ring, int fd, unsigned events, bool multi,
+        unsigned long long tag) {
+    struct io_uring_sqe *sqe = prepare(ring, IORING_OP_POLL_ADD, fd, tag);
+    if (sqe == NULL)
+        return false;
+    sqe->poll32_events = events;
+    if (multi)
+        sqe->len = IORING_POLL_ADD_MULTI;
+    return true;
+}
+
+bool ringConnect(Ring *ring, int fd, const struct sockaddr *addr,
+        socklen_t addrlen, unsigned long long tag) {
+    struct io_uring_sqe *sqe = prepare(ring, IORING_OP_CONNECT, fd, tag);
+    if (sqe == NULL)
+        return false;
+    sqe->addr = (unsigned long long)(uintptr_t)addr;
+    sqe->off = addrlen;
+    return true;
+}
+
+bool ringSendmsg(Ring *ring, int fd, const struct msghdr *msg, int flags,
+        unsigned long long tag) {
+    struct io_uring_sqe *sqe = prepare(ring, IORING_OP_SENDMSG, fd, tag);
+    if (sqe == NULL)
+        return false;
+    sqe->addr = (unsigned long long)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    return true;
+}
+
+bool ringSend(Ring *ring, int fd, const char *buf, size_t len, int flags,
+        unsigned long long tag) {
+    struct io_uring_sqe *sqe = prepare(ring, IORING_OP_SEND, fd, tag);
+    if (sqe == NULL)
+        return false;
+    sqe->addr = (unsigned long long)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = flags;
+    return true;
+}
+
+bool ringRecv(Ring *ring, int fd, char *buf, size_t len,
+        unsigned long long tag) {
+    struct io_uring_sqe *sqe = prepare(ring, IORING_OP_RECV, fd, tag);
+    if (sqe == NULL)
+        return false;
+    sqe->addr = (unsigned long long)(uintptr_t)buf;
+    sqe->len = len;
+    return true;
+}
+
+bool ringRead(Ring *ring, int fd, char *buf, size_t len, off_t offset,
+        int fixedIndex, unsigned long long tag) {
+    struct io_uring_sqe *sqe = prepare(ring,
+            fixedIndex == -1 ? IORING_OP_READ : IORING_OP_READ_FIXED, fd, tag);
+    if (sqe == NULL)
+        return false;
+    sqe->addr = (unsigned long long)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    if (fixedIndex != -1)
+        sqe->buf_index = fixedIndex;
+    return true;
+}
+
+bool ringCancel(Ring *ring, unsigned long long tag) {
+    struct io_uring_sqe *sqe = prepare(ring, IORING_OP_ASYNC_CANCEL, -1, 0);
+    if (sqe == NULL)
+        return false;
+    sqe->addr = tag;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    return true;
+}
+
+const char *recvBuffer(Ring *ring, int bid) {
+    return ring->recvBufs + (size_t)bid * URING_RECV_BUF_LEN;
+}
+
+void recycleRecvBuffer(Ring *ring, int bid) {
+    // Indexed from the base: in C++ the header's flexible array member
+    // sits behind a one-byte empty struct, so bufRing->bufs is off by a
+    // slot. The tail overlays the reserved field of entry 0.
+    struct io_uring_buf *bufs = (struct io_uring_buf *)ring->bufRing;
+    struct io_uring_buf *buf = &bufs[ring->bufTail & (URING_RECV_BUFS - 1)];
+    buf->addr = (unsigned long long)(uintptr_t)recvBuffer(ring, bid);
+    buf->len = URING_RECV_BUF_LEN;
+    buf->bid = bid;
+    ring->bufTail++;
+    __atomic_store_n(&bufs[0].resv, ring->bufTail, __ATOMIC_RELEASE);
+}
+
+int acquireFixedBuffer(Ring *ring) {
+    if (ring->freeFixed.empty())
+        return -1;
+    int index = ring->freeFixed.back();
+    ring->freeFixed.pop_back();
+    return index;
+}
+
+char *fixedBuffer(Ring *ring, int index) {
+    return ring->fixedBufs + (size_t)index * URING_FIXED_BUF_LEN;
+}
+
+void releaseFixedBuffer(Ring *ring, int index) {
+    ring->freeFixed.push_back(index);
+}
+
+#else  // FTSERVER_NO_URING: the reactor stays on epoll
+
+Ring *openRing() {
+    logMessage(LOG_WARN, "io_uring support not built");
+    errno = ENOSYS;
+    return NULL;
+}
+
+void closeRing(Ring *) {}
+int ringWait(Ring *, int) { errno = ENOSYS; return -1; }
+bool ringNext(Ring *, Completion *) { return false; }
+bool ringAcceptMulti(Ring *, int, unsigned long long) { return false; }
+bool ringRecvMulti(Ring *, int, unsigned long long) { return false; }
+bool ringPoll(Ring *, int, unsigned, bool, unsigned long long) {
+    return false;
+}
+bool ringConnect(Ring *, int, const struct sockaddr *, socklen_t,
+        unsigned long long) {
+    return false;
+}
+bool ringSendmsg(Ring *, int, const struct msghdr *, int,
+        unsigned long long) {
+    return false;
+}
+bool ringSend(Ring *, int, const char *, size_t, int, unsigned long long) {
+    return false;
+}
+bool ringRecv(Ring *, int, char *, size_t, unsigned long long) {
+    return false;
+}
+bool ringRead(Ring *, int, char *, size_t, off_t, int, unsigned long long) {
+    return false;
+}
+bool ringCancel(Ring *, unsigned long long) { return false; }
+const char *recvBuffer(Ring *, int) { return NULL; }
+void recycleRecvBuffer(Ring *, int) {}
+int acquireFixedBuffer(Ring *) { return -1; }
+char *fixedBuffer(Ring *, int) { return NULL; }
+void releaseFixedBuffer(Ring *, int) {}
+
+#endif
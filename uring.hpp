@@ -0,0 +1,164 @@
+#ifndef URING_H
+#define URING_H
+/**
+ * File:    uring.hpp
+ * Author:  Daniel Bonnin
+ * email:   bonnind@oregonstate.edu
+ *
+ * Descr:   This file contains the interfaces of a minimal io_uring
+ *          wrapper, made directly on the system calls so the server
+ *          needs no library beyond the kernel headers.
+ *
+ *          A Ring is one submission and completion queue pair, owned by
+ *          one reactor thread. Operations are queued with the ring*()
+ *          calls below and passed to the kernel together by the next
+ *          ringWait(), so a batch of events costs one system call.
+ *          Each operation carries a 64-bit tag that comes back with its
+ *          completion.
+ *
+ *          Along with the queues a ring registers two buffer pools with
+ *          the kernel: provided buffers, which multishot receives fill
+ *          as data arrives, and fixed buffers, which file reads fill
+ *          without the kernel mapping the pages again on every read.
+ *
+ *          Building with FTSERVER_NO_URING leaves only stubs, and
+ *          openRing() always fails.
+ */
+#include <cstddef>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define URING_ENTRIES 256             // Submission queue slots
+#define URING_CQ_ENTRIES 4096         // Completion queue slots
+#define URING_RECV_BUFS 256           // Provided receive buffers; power of 2
+#define URING_RECV_BUF_LEN 4096       // Bytes per receive buffer
+#define URING_FIXED_BUFS 32           // Registered file read buffers
+#define URING_FIXED_BUF_LEN (128 * 1024)  // Bytes per file read buffer
+
+struct Ring;
+
+// One completed operation.
+struct Completion {
+    unsigned long long tag;  // As given when the operation was queued
+    int res;                 // Result, or -errno
+    bool more;               // A multishot operation is still armed
+    int bufferId;            // Receive buffer holding the data, or -1
+};
+
+/**
+ * Set up a ring, with its buffers, on a kernel that supports every
+ * operation the reactor uses: multishot accept and receive, connect,
+ * sendmsg, send and read.
+ *
+ * @return the ring, or NULL if io_uring is missing or too old
+ */
+Ring *openRing();
+
+/**
+ * Release ring and its buffers.
+ */
+void closeRing(Ring *ring);
+
+/**
+ * Submit every queued operation and wait for a completion.
+ *
+ * @param timeoutMs longest wait in ms, or -1 to wait indefinitely
+ *
+ * @return 0 once completions are ready or the timeout expired, -1 with
+ *         errno on error
+ */
+int ringWait(Ring *ring, int timeoutMs);
+
+/**
+ * Take the oldest completion.
+ *
+ * @return false if there is none
+ */
+bool ringNext(Ring *ring, Completion *c);
+
+// Queue an operation. Each returns false, with errno set, if the
+// submission queue is full and could not be submitted.
+
+/**
+ * Accept connections on listener until cancelled; each completion
+ * carries a new socket.
+ */
+bool ringAcceptMulti(Ring *ring, int listener, unsigned long long tag);
+
+/**
+ * Receive on fd until cancelled or end of stream, into provided
+ * buffers.
+ */
+bool ringRecvMulti(Ring *ring, int fd, unsigned long long tag);
+
+/**
+ * Wait for events on fd; with multi, until cancelled.
+ */
+bool ringPoll(Ring *ring, int fd, unsigned events, bool multi,
+        unsigned long long tag);
+
+/**
+ * Connect fd to addr. addr must stay valid until the next ringWait().
+ */
+bool ringConnect(Ring *ring, int fd, const struct sockaddr *addr,
+        socklen_t addrlen, unsigned long long tag);
+
+/**
+ * Send msg on fd. msg and its iovecs must outlive the operation.
+ */
+bool ringSendmsg(Ring *ring, int fd, const struct msghdr *msg, int flags,
+        unsigned long long tag);
+
+/**
+ * Send len bytes of buf on fd.
+ */
+bool ringSend(Ring *ring, int fd, const char *buf, size_t len, int flags,
+        unsigned long long tag);
+
+/**
+ * Receive up to len bytes on fd into buf.
+ */
+bool ringRecv(Ring *ring, int fd, char *buf, size_t len,
+        unsigned long long tag);
+
+/**
+ * Read up to len bytes at offset of fd into buf: fixed buffer
+ * fixedIndex, or any memory if fixedIndex is -1.
+ */
+bool ringRead(Ring *ring, int fd, char *buf, size_t len, off_t offset,
+        int fixedIndex, unsigned long long tag);
+
+/**
+ * Cancel every operation in flight with tag. Each still completes,
+ * usually with -ECANCELED.
+ */
+bool ringCancel(Ring *ring, unsigned long long tag);
+
+/**
+ * Return the provided receive buffer with id bid.
+ */
+const char *recvBuffer(Ring *ring, int bid);
+
+/**
+ * Hand the receive buffer bid back to the kernel.
+ */
+void recycleRecvBuffer(Ring *ring, int bid);
+
+/**
+ * Take an idle fixed buffer.
+ *
+ * @return its index, or -1 if all are in use or none are registered
+ */
+int acquireFixedBuffer(Ring *ring);
+
+/**
+ * Return the memory of fixed buffer index.
+ */
+char *fixedBuffer(Ring *ring, int index);
+
+/**
+ * Return fixed buffer index to the idle pool.
+ */
+void releaseFixedBuffer(Ring *ring, int index);
+
+#endif